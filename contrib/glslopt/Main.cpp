@@ -2,7 +2,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include "glsl_optimizer.h"
+#include "c11/threads.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#endif
 
 static glslopt_ctx* gContext = 0;
 
@@ -10,21 +24,48 @@ static int printhelp(const char* msg)
 {
 	if (msg) printf("%s\n\n\n", msg);
 	printf("Usage: glslopt <-f|-v> <input shader> [<output shader>]\n");
+	printf("       glslopt -b <directory|manifest> [-o <output directory>] [-j <threads>] [-s <summary>]\n");
 	printf("\t-f : fragment shader (default)\n");
 	printf("\t-v : vertex shader\n");
 	printf("\t-1 : target OpenGL (default)\n");
 	printf("\t-2 : target OpenGL ES 2.0\n");
 	printf("\t-3 : target OpenGL ES 3.0\n");
+	printf("\t-m : target Metal\n");
+	printf("\t-O0 .. -O3 : optimization level (default -O3)\n");
+	printf("\t-P <pipeline> : explicit optimization pass pipeline, e.g. \"inline,dce,copyprop,constfold*\"\n");
+	printf("\t-p <file> : write compile phase and optimization pass timings as JSON to file (- for stdout)\n");
 	printf("\n\tIf no output specified, output is to [input].out.\n");
+	printf("\nBatch mode (-b) optimizes many shaders in one process:\n");
+	printf("\t-b <directory> : every .vert/.vsh/.vs (vertex) and .frag/.fsh/.fs (fragment) file in it\n");
+	printf("\t-b <manifest> : a text file with one shader per line: [-v|-f] [-1|-2|-3|-m] <input> [<output>];\n");
+	printf("\t                paths are relative to the manifest, the stage comes from the extension unless\n");
+	printf("\t                given, the target from the command line unless given; # starts a comment line\n");
+	printf("\t-o <directory> : write outputs there, under the path relative to the directory or manifest\n");
+	printf("\t                 (default: [input].out); outputs that collide with each other or an input are errors\n");
+	printf("\t-j <threads> : number of worker threads (default: one per CPU core)\n");
+	printf("\t-s <file> : write per shader status and timings as JSON to file (- for stdout)\n");
 	return 1;
 }
 
-static bool init(glslopt_target target)
+static glslopt_ctx* createContext(glslopt_target target, int level, const char* pipeline)
 {
-	gContext = glslopt_initialize(target);
-	if( !gContext )
-		return false;
-	return true;
+	glslopt_ctx* ctx = glslopt_initialize(target);
+	if( !ctx )
+		return 0;
+	glslopt_set_optimization_level(ctx, (glslopt_optimization_level)level);
+	if( pipeline && !glslopt_set_optimization_pipeline(ctx, pipeline) )
+	{
+		printf("Invalid optimization pipeline: %s\n", pipeline);
+		glslopt_cleanup(ctx);
+		return 0;
+	}
+	return ctx;
+}
+
+static bool init(glslopt_target target, int level, const char* pipeline)
+{
+	gContext = createContext(target, level, pipeline);
+	return gContext != 0;
 }
 
 static void term()
@@ -32,14 +73,11 @@ static void term()
 	glslopt_cleanup(gContext);
 }
 
-static char* loadFile(const char* filename)
+static char* readFile(const char* filename)
 {
 	FILE* file = fopen(filename, "rt");
 	if( !file )
-	{
-		printf("Failed to open %s for reading\n", filename);
 		return 0;
-	}
 
 	fseek(file, 0, SEEK_END);
 	const int size = ftell(file);
@@ -53,6 +91,14 @@ static char* loadFile(const char* filename)
 	return result;
 }
 
+static char* loadFile(const char* filename)
+{
+	char* result = readFile(filename);
+	if( !result )
+		printf("Failed to open %s for reading\n", filename);
+	return result;
+}
+
 static bool saveFile(const char* filename, const char* data)
 {
 	int size = (int)strlen(data);
@@ -75,15 +121,74 @@ static bool saveFile(const char* filename, const char* data)
 	return true;
 }
 
-static bool compileShader(const char* dstfilename, const char* srcfilename, bool vertexShader)
+static void writeJsonString(FILE* file, const char* str)
+{
+	fputc('"', file);
+	for( ; *str; ++str )
+	{
+		const unsigned char c = (unsigned char)*str;
+		if( c == '"' || c == '\\' )
+			fprintf(file, "\\%c", c);
+		else if( c < 0x20 )
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+static bool saveProfile(const char* filename, const char* srcfilename, glslopt_shader* shader)
+{
+	const bool toStdout = 0 == strcmp(filename, "-");
+	FILE* file = toStdout ? stdout : fopen(filename, "wt");
+	if( !file )
+	{
+		printf( "Failed to open %s for writing\n", filename);
+		return false;
+	}
+
+	fprintf(file, "{\n\t\"shader\": ");
+	writeJsonString(file, srcfilename);
+	fprintf(file, ",\n\t\"status\": %s,\n", glslopt_get_status(shader) ? "true" : "false");
+	fprintf(file, "\t\"iterations\": %d,\n", glslopt_shader_get_optimization_iterations(shader));
+
+	fprintf(file, "\t\"phases\": {");
+	for( int i = 0; i < kGlslPhaseCount; ++i )
+	{
+		const glslopt_phase phase = (glslopt_phase)i;
+		fprintf(file, "%s\n\t\t\"%s\": %.4f", i ? "," : "", glslopt_get_phase_name(phase), glslopt_shader_get_phase_time(shader, phase));
+	}
+	fprintf(file, "\n\t},\n");
+
+	fprintf(file, "\t\"passes\": [");
+	const int passCount = glslopt_shader_get_pass_count(shader);
+	for( int i = 0; i < passCount; ++i )
+	{
+		const char* name;
+		int calls, progressCalls;
+		double timeMs;
+		glslopt_shader_get_pass_stats(shader, i, &name, &calls, &progressCalls, &timeMs);
+		fprintf(file, "%s\n\t\t{ \"name\": \"%s\", \"calls\": %d, \"progress\": %d, \"time\": %.4f }", i ? "," : "", name, calls, progressCalls, timeMs);
+	}
+	fprintf(file, "\n\t]\n}\n");
+
+	if( !toStdout )
+		fclose(file);
+	return true;
+}
+
+static bool compileShader(const char* dstfilename, const char* srcfilename, bool vertexShader, const char* profilename)
 {
 	const char* originalShader = loadFile(srcfilename);
 	if( !originalShader )
 		return false;
 
 	const glslopt_shader_type type = vertexShader ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+	const unsigned options = profilename ? kGlslOptionProfile : 0;
 
-	glslopt_shader* shader = glslopt_optimize(gContext, type, originalShader, 0);
+	glslopt_shader* shader = glslopt_optimize(gContext, type, originalShader, options);
+	if( profilename && !saveProfile(profilename, srcfilename, shader) )
+		return false;
 	if( !glslopt_get_status(shader) )
 	{
 		printf( "Failed to compile %s:\n\n%s\n", srcfilename, glslopt_get_log(shader));
@@ -99,6 +204,487 @@ static bool compileShader(const char* dstfilename, const char* srcfilename, bool
 	return true;
 }
 
+// -------------------------------------------------------------------------
+// Batch mode: optimizes a directory or manifest of shaders in one process.
+// Each target's context (and with it the builtin functions) is created once,
+// and the shaders are shared out to worker threads that read, optimize and
+// write one file at a time.
+
+struct BatchJob
+{
+	std::string input;
+	std::string output;
+	glslopt_shader_type type;
+	glslopt_target target;
+
+	bool status;
+	bool ioFailed; // input could not be read or output not written
+	double timeMs; // glslopt_optimize only
+	std::string error;
+};
+
+struct BatchState
+{
+	std::vector<BatchJob>* jobs;
+	glslopt_ctx* contexts[kGlslTargetMetal+1];
+	mtx_t mutex;
+	size_t next;
+};
+
+static double getTimeMs()
+{
+	#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	if( !freq.QuadPart )
+		QueryPerformanceFrequency(&freq);
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return double(t.QuadPart) * 1000.0 / double(freq.QuadPart);
+	#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+	#endif
+}
+
+static int getHardwareThreadCount()
+{
+	#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+	#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int)count : 1;
+	#endif
+}
+
+static bool endsWith(const std::string& str, const char* sub)
+{
+	const size_t len = strlen(sub);
+	return str.size() >= len && 0 == strcmp(str.c_str() + str.size() - len, sub);
+}
+
+// Shader stage from the file extension; false if it is not a shader file.
+static bool getShaderType(const std::string& path, glslopt_shader_type& type)
+{
+	if( endsWith(path, ".vert") || endsWith(path, ".vsh") || endsWith(path, ".vs") )
+		type = kGlslOptShaderVertex;
+	else if( endsWith(path, ".frag") || endsWith(path, ".fsh") || endsWith(path, ".fs") )
+		type = kGlslOptShaderFragment;
+	else
+		return false;
+	return true;
+}
+
+static bool isDirectory(const char* path)
+{
+	#ifdef _WIN32
+	const DWORD attributes = GetFileAttributesA(path);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+	#else
+	struct stat st;
+	return 0 == stat(path, &st) && S_ISDIR(st.st_mode);
+	#endif
+}
+
+static bool isAbsolutePath(const std::string& path)
+{
+	return !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+}
+
+// Part of the path after the last separator.
+static std::string getFileName(const std::string& path)
+{
+	const size_t pos = path.find_last_of("/\\");
+	return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// Part of the path up to and including the last separator.
+static std::string getDirectory(const std::string& path)
+{
+	const size_t pos = path.find_last_of("/\\");
+	return pos == std::string::npos ? std::string() : path.substr(0, pos + 1);
+}
+
+// Path with "." components and repeated separators removed, for comparing.
+static std::string normalizePath(const std::string& path)
+{
+	std::string result;
+	for( size_t pos = 0; pos < path.size(); )
+	{
+		size_t end = path.find_first_of("/\\", pos);
+		if( end == std::string::npos )
+			end = path.size();
+		const std::string part = path.substr(pos, end - pos);
+		if( part == "." || (part.empty() && pos > 0) )
+		{
+			pos = end + 1;
+			continue;
+		}
+		if( !result.empty() && result[result.size()-1] != '/' )
+			result += '/';
+		result += part.empty() ? "/" : part;
+		pos = end + 1;
+	}
+	return result;
+}
+
+// Output for an input at relativePath (as listed, relative to the directory
+// or manifest): [input].out, or the same relative path under outputDir. Paths
+// that would leave outputDir only keep their file name.
+static std::string getOutputPath(const std::string& input, const std::string& relativePath, const char* outputDir)
+{
+	if( !outputDir )
+		return input + ".out";
+	const bool escapes = isAbsolutePath(relativePath) || relativePath.find("..") != std::string::npos;
+	return normalizePath(std::string(outputDir) + "/" + (escapes ? getFileName(relativePath) : relativePath));
+}
+
+// Creates the directories on the way to a file, where missing.
+static void makeParentDirectories(const std::string& path)
+{
+	for( size_t pos = path.find_first_of("/\\", 1); pos != std::string::npos; pos = path.find_first_of("/\\", pos + 1) )
+	{
+		const std::string dir = path.substr(0, pos);
+		#ifdef _WIN32
+		_mkdir(dir.c_str());
+		#else
+		mkdir(dir.c_str(), 0777);
+		#endif
+	}
+}
+
+// Fails, naming the files, when two shaders would be written to the same
+// output, or an output would overwrite an input.
+static bool checkOutputPaths(const std::vector<BatchJob>& jobs)
+{
+	std::vector<std::pair<std::string, size_t> > paths;
+	for( size_t i = 0; i < jobs.size(); ++i )
+		paths.push_back(std::make_pair(normalizePath(jobs[i].output), i));
+	std::sort(paths.begin(), paths.end());
+
+	bool result = true;
+	for( size_t i = 1; i < paths.size(); ++i )
+	{
+		if( paths[i].first != paths[i-1].first )
+			continue;
+		printf("%s and %s would both be written to %s\n", jobs[paths[i-1].second].input.c_str(), jobs[paths[i].second].input.c_str(), paths[i].first.c_str());
+		result = false;
+	}
+	for( size_t i = 0; i < jobs.size(); ++i )
+	{
+		const std::string input = normalizePath(jobs[i].input);
+		std::vector<std::pair<std::string, size_t> >::const_iterator it = std::lower_bound(paths.begin(), paths.end(), std::make_pair(input, (size_t)0));
+		if( it != paths.end() && it->first == input )
+		{
+			printf("Output of %s would overwrite the input %s\n", jobs[it->second].input.c_str(), jobs[i].input.c_str());
+			result = false;
+		}
+	}
+
+	#ifndef _WIN32
+	// the same files spelled differently (links, "..")
+	std::vector<std::pair<dev_t, ino_t> > inputFiles;
+	struct stat st;
+	for( size_t i = 0; i < jobs.size(); ++i )
+		if( 0 == stat(jobs[i].input.c_str(), &st) )
+			inputFiles.push_back(std::make_pair(st.st_dev, st.st_ino));
+	std::sort(inputFiles.begin(), inputFiles.end());
+	for( size_t i = 0; i < jobs.size() && result; ++i )
+	{
+		if( 0 == stat(jobs[i].output.c_str(), &st) &&
+			std::binary_search(inputFiles.begin(), inputFiles.end(), std::make_pair(st.st_dev, st.st_ino)) )
+		{
+			printf("Output %s of %s is one of the inputs\n", jobs[i].output.c_str(), jobs[i].input.c_str());
+			result = false;
+		}
+	}
+	#endif
+	return result;
+}
+
+static bool listDirectory(const char* dir, glslopt_target target, const char* outputDir, std::vector<BatchJob>& jobs)
+{
+	std::vector<std::string> names;
+
+	#ifdef _WIN32
+	WIN32_FIND_DATAA findData;
+	HANDLE find = FindFirstFileA((std::string(dir) + "/*").c_str(), &findData);
+	if( find == INVALID_HANDLE_VALUE )
+	{
+		printf("Failed to list %s\n", dir);
+		return false;
+	}
+	do {
+		if( !(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) )
+			names.push_back(findData.cFileName);
+	} while( FindNextFileA(find, &findData) );
+	FindClose(find);
+	#else
+	DIR* dirp = opendir(dir);
+	if( !dirp )
+	{
+		printf("Failed to list %s\n", dir);
+		return false;
+	}
+	while( struct dirent* dp = readdir(dirp) )
+		names.push_back(dp->d_name);
+	closedir(dirp);
+	#endif
+
+	std::sort(names.begin(), names.end());
+	for( size_t i = 0; i < names.size(); ++i )
+	{
+		BatchJob job;
+		if( !getShaderType(names[i], job.type) )
+			continue;
+		job.input = std::string(dir) + "/" + names[i];
+		job.output = getOutputPath(job.input, names[i], outputDir);
+		job.target = target;
+		jobs.push_back(job);
+	}
+	return true;
+}
+
+static bool loadManifest(const char* filename, glslopt_target target, const char* outputDir, std::vector<BatchJob>& jobs)
+{
+	char* text = loadFile(filename);
+	if( !text )
+		return false;
+
+	const std::string baseDir = getDirectory(filename);
+	bool result = true;
+	int lineNumber = 0;
+	for( char* line = text; line && result; )
+	{
+		char* lineEnd = strchr(line, '\n');
+		if( lineEnd )
+			*lineEnd = 0;
+		++lineNumber;
+
+		BatchJob job;
+		job.target = target;
+		bool typeGiven = false;
+		std::string input, output;
+		for( char* token = strtok(line, " \t\r"); token && *token != '#'; token = strtok(NULL, " \t\r") )
+		{
+			if( 0 == strcmp(token, "-v") || 0 == strcmp(token, "-f") )
+			{
+				job.type = token[1] == 'v' ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+				typeGiven = true;
+			}
+			else if( 0 == strcmp(token, "-1") )
+				job.target = kGlslTargetOpenGL;
+			else if( 0 == strcmp(token, "-2") )
+				job.target = kGlslTargetOpenGLES20;
+			else if( 0 == strcmp(token, "-3") )
+				job.target = kGlslTargetOpenGLES30;
+			else if( 0 == strcmp(token, "-m") )
+				job.target = kGlslTargetMetal;
+			else if( input.empty() )
+				input = token;
+			else if( output.empty() )
+				output = token;
+			else
+			{
+				printf("%s:%d: unexpected %s\n", filename, lineNumber, token);
+				result = false;
+			}
+		}
+		line = lineEnd ? lineEnd + 1 : 0;
+		if( input.empty() || !result )
+			continue;
+
+		if( !typeGiven && !getShaderType(input, job.type) )
+		{
+			printf("%s:%d: can not tell the shader stage of %s, give -v or -f\n", filename, lineNumber, input.c_str());
+			result = false;
+			continue;
+		}
+		job.input = isAbsolutePath(input) ? input : baseDir + input;
+		if( output.empty() )
+			job.output = getOutputPath(job.input, input, outputDir);
+		else
+			job.output = isAbsolutePath(output) ? output : baseDir + output;
+		jobs.push_back(job);
+	}
+
+	delete[] text;
+	return result;
+}
+
+static void runBatchJob(BatchJob& job, glslopt_ctx* ctx)
+{
+	job.status = false;
+	job.ioFailed = false;
+	job.timeMs = 0.0;
+
+	char* source = readFile(job.input.c_str());
+	if( !source )
+	{
+		job.error = "Failed to open " + job.input + " for reading";
+		job.ioFailed = true;
+		return;
+	}
+
+	const double startTime = getTimeMs();
+	glslopt_shader* shader = glslopt_optimize(ctx, job.type, source, 0);
+	job.timeMs = getTimeMs() - startTime;
+	delete[] source;
+
+	if( !glslopt_get_status(shader) )
+		job.error = glslopt_get_log(shader);
+	else
+	{
+		FILE* file = fopen(job.output.c_str(), "wt");
+		const char* output = glslopt_get_output(shader);
+		const size_t size = strlen(output);
+		if( !file || (size && 1 != fwrite(output, size, 1, file)) )
+		{
+			job.error = "Failed to write to " + job.output;
+			job.ioFailed = true;
+		}
+		else
+			job.status = true;
+		if( file )
+			fclose(file);
+	}
+	glslopt_shader_delete(shader);
+}
+
+static int batchWorker(void* data)
+{
+	BatchState* state = (BatchState*)data;
+	for( ;; )
+	{
+		mtx_lock(&state->mutex);
+		const size_t index = state->next++;
+		mtx_unlock(&state->mutex);
+		if( index >= state->jobs->size() )
+			return 0;
+
+		BatchJob& job = (*state->jobs)[index];
+		runBatchJob(job, state->contexts[job.target]);
+	}
+}
+
+static bool saveBatchSummary(const char* filename, const std::vector<BatchJob>& jobs, int failed, int threads, double initTime, double wallTime, double compileTime)
+{
+	const bool toStdout = 0 == strcmp(filename, "-");
+	FILE* file = toStdout ? stdout : fopen(filename, "wt");
+	if( !file )
+	{
+		printf( "Failed to open %s for writing\n", filename);
+		return false;
+	}
+
+	fprintf(file, "{\n\t\"shaders\": %d,\n\t\"failed\": %d,\n\t\"threads\": %d,\n", (int)jobs.size(), failed, threads);
+	fprintf(file, "\t\"initTime\": %.4f,\n\t\"wallTime\": %.4f,\n\t\"compileTime\": %.4f,\n", initTime, wallTime, compileTime);
+	fprintf(file, "\t\"results\": [");
+	for( size_t i = 0; i < jobs.size(); ++i )
+	{
+		const BatchJob& job = jobs[i];
+		fprintf(file, "%s\n\t\t{ \"shader\": ", i ? "," : "");
+		writeJsonString(file, job.input.c_str());
+		fprintf(file, ", \"status\": %s, \"time\": %.4f", job.status ? "true" : "false", job.timeMs);
+		if( !job.status )
+		{
+			fprintf(file, ", \"error\": ");
+			writeJsonString(file, job.error.c_str());
+		}
+		fprintf(file, " }");
+	}
+	fprintf(file, "\n\t]\n}\n");
+
+	if( !toStdout )
+		fclose(file);
+	return true;
+}
+
+static int runBatch(const char* batchSource, const char* outputDir, glslopt_target target, int level, const char* pipeline, int threads, const char* summary)
+{
+	std::vector<BatchJob> jobs;
+	const bool listed = isDirectory(batchSource) ?
+		listDirectory(batchSource, target, outputDir, jobs) :
+		loadManifest(batchSource, target, outputDir, jobs);
+	if( !listed || !checkOutputPaths(jobs) )
+		return 1;
+	for( size_t i = 0; i < jobs.size(); ++i )
+		makeParentDirectories(jobs[i].output);
+
+	const double startTime = getTimeMs();
+
+	BatchState state;
+	state.jobs = &jobs;
+	state.next = 0;
+	memset(state.contexts, 0, sizeof(state.contexts));
+	bool initialized = true;
+	for( size_t i = 0; i < jobs.size() && initialized; ++i )
+	{
+		glslopt_ctx*& ctx = state.contexts[jobs[i].target];
+		if( !ctx )
+			initialized = 0 != (ctx = createContext(jobs[i].target, level, pipeline));
+	}
+
+	const bool summaryToStdout = summary && 0 == strcmp(summary, "-");
+	int failed = 0;
+	double initTime = 0.0, compileTime = 0.0;
+	if( initialized )
+	{
+		initTime = getTimeMs() - startTime;
+
+		if( threads <= 0 )
+			threads = getHardwareThreadCount();
+		if( threads > (int)jobs.size() )
+			threads = (int)jobs.size();
+		if( threads < 1 )
+			threads = 1;
+
+		mtx_init(&state.mutex, mtx_plain);
+		std::vector<thrd_t> workers(threads > 1 ? threads - 1 : 0);
+		std::vector<bool> started(workers.size());
+		for( size_t i = 0; i < workers.size(); ++i )
+			started[i] = thrd_success == thrd_create(&workers[i], batchWorker, &state);
+		batchWorker(&state);
+		for( size_t i = 0; i < workers.size(); ++i )
+			if( started[i] )
+				thrd_join(workers[i], NULL);
+		mtx_destroy(&state.mutex);
+
+		for( size_t i = 0; i < jobs.size(); ++i )
+		{
+			const BatchJob& job = jobs[i];
+			compileTime += job.timeMs;
+			if( job.status )
+				continue;
+			++failed;
+			if( summaryToStdout )
+				continue;
+			if( job.ioFailed )
+				printf("%s\n", job.error.c_str());
+			else
+				printf("Failed to compile %s:\n\n%s\n", job.input.c_str(), job.error.c_str());
+		}
+	}
+	else
+		printf("Failed to initialize glslopt!\n");
+
+	for( int i = 0; i <= kGlslTargetMetal; ++i )
+		if( state.contexts[i] )
+			glslopt_cleanup(state.contexts[i]);
+	if( !initialized )
+		return 1;
+
+	const double wallTime = getTimeMs() - startTime;
+	if( summary && !saveBatchSummary(summary, jobs, failed, threads, initTime, wallTime, compileTime) )
+		return 1;
+	if( !summaryToStdout )
+		printf("%d shaders, %d failed, %d threads: %.1f ms total, %.1f ms init, %.1f ms compiling\n",
+			(int)jobs.size(), failed, threads, wallTime, initTime, compileTime);
+	return failed ? 1 : 0;
+}
+
 int main(int argc, char* argv[])
 {
 	if( argc < 3 )
@@ -107,6 +693,13 @@ int main(int argc, char* argv[])
 	bool vertexShader = false, freename = false;
 	glslopt_target languageTarget = kGlslTargetOpenGL;
 	const char* source = 0;
+	const char* profile = 0;
+	const char* pipeline = 0;
+	const char* batch = 0;
+	const char* outputDir = 0;
+	const char* summary = 0;
+	int level = kGlslOptLevel3;
+	int threads = 0;
 	char* dest = 0;
 
 	for( int i=1; i < argc; i++ )
@@ -123,6 +716,22 @@ int main(int argc, char* argv[])
 				languageTarget = kGlslTargetOpenGLES20;
 			else if( 0 == strcmp("-3", argv[i]) )
 				languageTarget = kGlslTargetOpenGLES30;
+			else if( 0 == strcmp("-m", argv[i]) )
+				languageTarget = kGlslTargetMetal;
+			else if( 0 == strcmp("-b", argv[i]) && i + 1 < argc )
+				batch = argv[++i];
+			else if( 0 == strcmp("-o", argv[i]) && i + 1 < argc )
+				outputDir = argv[++i];
+			else if( 0 == strcmp("-j", argv[i]) && i + 1 < argc )
+				threads = atoi(argv[++i]);
+			else if( 0 == strcmp("-s", argv[i]) && i + 1 < argc )
+				summary = argv[++i];
+			else if( 0 == strcmp("-p", argv[i]) && i + 1 < argc )
+				profile = argv[++i];
+			else if( 0 == strcmp("-P", argv[i]) && i + 1 < argc )
+				pipeline = argv[++i];
+			else if( argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == 0 )
+				level = argv[i][2] - '0';
 		}
 		else
 		{
@@ -133,10 +742,13 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	if( batch )
+		return runBatch(batch, outputDir, languageTarget, level, pipeline, threads, summary);
+
 	if( !source )
 		return printhelp("Must give a source");
 
-	if( !init(languageTarget) )
+	if( !init(languageTarget, level, pipeline) )
 	{
 		printf("Failed to initialize glslopt!\n");
 		return 1;
@@ -149,7 +761,7 @@ int main(int argc, char* argv[])
 	}
 
 	int result = 0;
-	if( !compileShader(dest, source, vertexShader) )
+	if( !compileShader(dest, source, vertexShader, profile) )
 		result = 1;
 
 	if( freename ) free(dest);
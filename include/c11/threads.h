@@ -0,0 +1,311 @@
+#ifndef EMULATED_THREADS_H_INCLUDED_
+#define EMULATED_THREADS_H_INCLUDED_
+
+/*
+ * C11 <threads.h> emulation.
+ *
+ * Subset of the C11 threads API used by the compiler: plain mutexes,
+ * condition variables, once flags and joinable threads.  Everything is
+ * implemented inline on top of Win32 or POSIX threads, so no extra
+ * translation units are needed.
+ */
+
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+
+#ifndef _MTX_INITIALIZER_NP
+#if defined(_WIN32)
+#  define _MTX_INITIALIZER_NP SRWLOCK_INIT
+#else
+#  define _MTX_INITIALIZER_NP PTHREAD_MUTEX_INITIALIZER
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+   mtx_plain = 0
+};
+
+enum {
+   thrd_success = 0,
+   thrd_busy = 1,
+   thrd_error = 2,
+   thrd_nomem = 3
+};
+
+typedef int (*thrd_start_t)(void *);
+
+
+#if defined(_WIN32) /*----------------------------- Win32 ----------------------------*/
+
+typedef SRWLOCK mtx_t;
+typedef CONDITION_VARIABLE cnd_t;
+typedef HANDLE thrd_t;
+typedef INIT_ONCE once_flag;
+#define ONCE_FLAG_INIT INIT_ONCE_STATIC_INIT
+
+static inline int
+mtx_init(mtx_t *mtx, int type)
+{
+   (void) type;
+   InitializeSRWLock(mtx);
+   return thrd_success;
+}
+
+static inline void
+mtx_destroy(mtx_t *mtx)
+{
+   (void) mtx;
+}
+
+static inline int
+mtx_lock(mtx_t *mtx)
+{
+   AcquireSRWLockExclusive(mtx);
+   return thrd_success;
+}
+
+static inline int
+mtx_trylock(mtx_t *mtx)
+{
+   return TryAcquireSRWLockExclusive(mtx) ? thrd_success : thrd_busy;
+}
+
+static inline int
+mtx_unlock(mtx_t *mtx)
+{
+   ReleaseSRWLockExclusive(mtx);
+   return thrd_success;
+}
+
+static inline int
+cnd_init(cnd_t *cond)
+{
+   InitializeConditionVariable(cond);
+   return thrd_success;
+}
+
+static inline void
+cnd_destroy(cnd_t *cond)
+{
+   (void) cond;
+}
+
+static inline int
+cnd_wait(cnd_t *cond, mtx_t *mtx)
+{
+   return SleepConditionVariableSRW(cond, mtx, INFINITE, 0) ? thrd_success : thrd_error;
+}
+
+static inline int
+cnd_signal(cnd_t *cond)
+{
+   WakeConditionVariable(cond);
+   return thrd_success;
+}
+
+static inline int
+cnd_broadcast(cnd_t *cond)
+{
+   WakeAllConditionVariable(cond);
+   return thrd_success;
+}
+
+struct impl_thrd_param {
+   thrd_start_t func;
+   void *arg;
+};
+
+static inline DWORD WINAPI
+impl_thrd_routine(LPVOID p)
+{
+   struct impl_thrd_param pack = *((struct impl_thrd_param *) p);
+   free(p);
+   return (DWORD) pack.func(pack.arg);
+}
+
+static inline int
+thrd_create(thrd_t *thr, thrd_start_t func, void *arg)
+{
+   struct impl_thrd_param *pack =
+      (struct impl_thrd_param *) malloc(sizeof(struct impl_thrd_param));
+   if (!pack)
+      return thrd_nomem;
+   pack->func = func;
+   pack->arg = arg;
+   *thr = CreateThread(NULL, 0, impl_thrd_routine, pack, 0, NULL);
+   if (*thr == NULL) {
+      free(pack);
+      return thrd_error;
+   }
+   return thrd_success;
+}
+
+static inline int
+thrd_join(thrd_t thr, int *res)
+{
+   DWORD code;
+   if (WaitForSingleObject(thr, INFINITE) != WAIT_OBJECT_0)
+      return thrd_error;
+   if (res) {
+      if (!GetExitCodeThread(thr, &code)) {
+         CloseHandle(thr);
+         return thrd_error;
+      }
+      *res = (int) code;
+   }
+   CloseHandle(thr);
+   return thrd_success;
+}
+
+static inline BOOL CALLBACK
+impl_call_once_callback(PINIT_ONCE once, PVOID param, PVOID *ctx)
+{
+   (void) once;
+   (void) ctx;
+   ((void (*)(void)) param)();
+   return TRUE;
+}
+
+static inline void
+call_once(once_flag *flag, void (*func)(void))
+{
+   InitOnceExecuteOnce(flag, impl_call_once_callback, (PVOID) func, NULL);
+}
+
+
+#else /*------------------------------------------- POSIX -------------------------------------------*/
+
+typedef pthread_mutex_t mtx_t;
+typedef pthread_cond_t cnd_t;
+typedef pthread_t thrd_t;
+typedef pthread_once_t once_flag;
+#define ONCE_FLAG_INIT PTHREAD_ONCE_INIT
+
+static inline int
+mtx_init(mtx_t *mtx, int type)
+{
+   (void) type;
+   return pthread_mutex_init(mtx, NULL) == 0 ? thrd_success : thrd_error;
+}
+
+static inline void
+mtx_destroy(mtx_t *mtx)
+{
+   pthread_mutex_destroy(mtx);
+}
+
+static inline int
+mtx_lock(mtx_t *mtx)
+{
+   return pthread_mutex_lock(mtx) == 0 ? thrd_success : thrd_error;
+}
+
+static inline int
+mtx_trylock(mtx_t *mtx)
+{
+   return pthread_mutex_trylock(mtx) == 0 ? thrd_success : thrd_busy;
+}
+
+static inline int
+mtx_unlock(mtx_t *mtx)
+{
+   return pthread_mutex_unlock(mtx) == 0 ? thrd_success : thrd_error;
+}
+
+static inline int
+cnd_init(cnd_t *cond)
+{
+   return pthread_cond_init(cond, NULL) == 0 ? thrd_success : thrd_error;
+}
+
+static inline void
+cnd_destroy(cnd_t *cond)
+{
+   pthread_cond_destroy(cond);
+}
+
+static inline int
+cnd_wait(cnd_t *cond, mtx_t *mtx)
+{
+   return pthread_cond_wait(cond, mtx) == 0 ? thrd_success : thrd_error;
+}
+
+static inline int
+cnd_signal(cnd_t *cond)
+{
+   return pthread_cond_signal(cond) == 0 ? thrd_success : thrd_error;
+}
+
+static inline int
+cnd_broadcast(cnd_t *cond)
+{
+   return pthread_cond_broadcast(cond) == 0 ? thrd_success : thrd_error;
+}
+
+struct impl_thrd_param {
+   thrd_start_t func;
+   void *arg;
+};
+
+static inline void *
+impl_thrd_routine(void *p)
+{
+   struct impl_thrd_param pack = *((struct impl_thrd_param *) p);
+   free(p);
+   return (void *) (size_t) pack.func(pack.arg);
+}
+
+static inline int
+thrd_create(thrd_t *thr, thrd_start_t func, void *arg)
+{
+   struct impl_thrd_param *pack =
+      (struct impl_thrd_param *) malloc(sizeof(struct impl_thrd_param));
+   if (!pack)
+      return thrd_nomem;
+   pack->func = func;
+   pack->arg = arg;
+   if (pthread_create(thr, NULL, impl_thrd_routine, pack) != 0) {
+      free(pack);
+      return thrd_error;
+   }
+   return thrd_success;
+}
+
+static inline int
+thrd_join(thrd_t thr, int *res)
+{
+   void *code;
+   if (pthread_join(thr, &code) != 0)
+      return thrd_error;
+   if (res)
+      *res = (int) (size_t) code;
+   return thrd_success;
+}
+
+static inline void
+call_once(once_flag *flag, void (*func)(void))
+{
+   pthread_once(flag, func);
+}
+
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EMULATED_THREADS_H_INCLUDED_ */
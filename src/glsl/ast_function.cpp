@@ -44,7 +44,7 @@ process_parameters(exec_list *instructions, exec_list *actual_parameters,
    foreach_list_typed(ast_node, ast, link, parameters) {
       ir_rvalue *result = ast->hir(instructions, state);
 
-      ir_constant *const constant = result->constant_expression_value();
+      ir_constant *const constant = result->constant_expression_value(state);
       if (constant != NULL)
 	 result = constant;
 
@@ -453,7 +453,7 @@ generate_call(exec_list *instructions, ir_function_signature *sig,
     * 1.20 and GLSL ES 3.00.
     */
    if (state->is_version(120, 300)) {
-      ir_constant *value = sig->constant_expression_value(actual_parameters, NULL);
+      ir_constant *value = sig->constant_expression_value(state, actual_parameters, NULL);
       if (value != NULL) {
 	 return value;
       }
@@ -675,7 +675,7 @@ convert_component(ir_rvalue *src, const glsl_type *desired_type)
    assert(result->type == desired_type);
 
    /* Try constant folding; it may fold in the conversion we just added. */
-   ir_constant *const constant = result->constant_expression_value();
+   ir_constant *const constant = result->constant_expression_value(ctx);
    return (constant != NULL) ? (ir_rvalue *) constant : (ir_rvalue *) result;
 }
 
@@ -800,7 +800,7 @@ process_vec_mat_constructor(exec_list *instructions,
        * After doing so, track whether or not all the parameters to the
        * constructor are trivially constant valued expressions.
        */
-      ir_rvalue *const constant = result->constant_expression_value();
+      ir_rvalue *const constant = result->constant_expression_value(state);
 
       if (constant != NULL)
          result = constant;
@@ -930,7 +930,7 @@ process_array_constructor(exec_list *instructions,
        * After doing so, track whether or not all the parameters to the
        * constructor are trivially constant valued expressions.
        */
-      ir_rvalue *const constant = result->constant_expression_value();
+      ir_rvalue *const constant = result->constant_expression_value(state);
 
       if (constant != NULL)
          result = constant;
@@ -1726,7 +1726,7 @@ ast_function_expression::hir(exec_list *instructions,
 	    instructions->push_tail(var);
 	    instructions->push_tail(new(ctx) ir_assignment(new(ctx)
 	       ir_dereference_variable(var), matrix, NULL));
-	    var->constant_value = matrix->constant_expression_value();
+	    var->constant_value = matrix->constant_expression_value(state);
 
 	    /* Replace the matrix with dereferences of its columns. */
 	    for (int i = 0; i < (int)matrix->type->matrix_columns; i++) {
@@ -1751,7 +1751,7 @@ ast_function_expression::hir(exec_list *instructions,
 	  * After doing so, track whether or not all the parameters to the
 	  * constructor are trivially constant valued expressions.
 	  */
-	 ir_rvalue *const constant = result->constant_expression_value();
+	 ir_rvalue *const constant = result->constant_expression_value(state);
 
 	 if (constant != NULL)
 	    result = constant;
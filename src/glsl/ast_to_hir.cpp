@@ -1623,9 +1623,9 @@ ast_expression::do_hir(exec_list *instructions,
          error_emitted = true;
       }
 
-      ir_constant *cond_val = op[0]->constant_expression_value();
-      ir_constant *then_val = op[1]->constant_expression_value();
-      ir_constant *else_val = op[2]->constant_expression_value();
+      ir_constant *cond_val = op[0]->constant_expression_value(state);
+      ir_constant *then_val = op[1]->constant_expression_value(state);
+      ir_constant *else_val = op[2]->constant_expression_value(state);
 
       if (then_instructions.is_empty()
           && else_instructions.is_empty()
@@ -1911,7 +1911,7 @@ process_array_size(exec_node *node,
       return 0;
    }
 
-   ir_constant *const size = ir->constant_expression_value();
+   ir_constant *const size = ir->constant_expression_value(state);
    if (size == NULL) {
       _mesa_glsl_error(& loc, state, "array size must be a "
                        "constant valued expression");
@@ -3044,7 +3044,7 @@ process_initializer(ir_variable *var, ast_declaration *decl,
 
    /* Propagate precision qualifier for constant value */
    if (type->qualifier.flags.q.constant) {
-      ir_constant *constant_value = rhs->constant_expression_value();
+      ir_constant *constant_value = rhs->constant_expression_value(state);
       constant_value->set_precision((glsl_precision)type->qualifier.precision);
       if (constant_value->type->is_array()) {
          for (unsigned i = 0; i < constant_value->type->length; i++) {
@@ -3063,7 +3063,7 @@ process_initializer(ir_variable *var, ast_declaration *decl,
       if (new_rhs != NULL) {
          rhs = new_rhs;
 
-         ir_constant *constant_value = rhs->constant_expression_value();
+         ir_constant *constant_value = rhs->constant_expression_value(state);
          if (!constant_value) {
             /* If ARB_shading_language_420pack is enabled, initializers of
              * const-qualified local variables do not have to be constant
@@ -3114,7 +3114,7 @@ process_initializer(ir_variable *var, ast_declaration *decl,
       } else
          initializer_type = rhs->type;
 
-      var->constant_initializer = rhs->constant_expression_value();
+      var->constant_initializer = rhs->constant_expression_value(state);
       var->data.has_initializer = true;
 
       /* If the declared variable is an unsized array, it must inherrit
@@ -4791,7 +4791,7 @@ ast_case_label::hir(exec_list *instructions,
        * comparison of cached test expression value to case label.
        */
       ir_rvalue *const label_rval = this->test_value->hir(instructions, state);
-      ir_constant *label_const = label_rval->constant_expression_value();
+      ir_constant *label_const = label_rval->constant_expression_value(state);
 
       if (!label_const) {
          YYLTYPE loc = this->test_value->get_location();
@@ -55,6 +55,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include "c11/threads.h"
 #include "main/core.h" /* for struct gl_shader */
 #include "standalone_scaffolding.h"
 #include "ir_builder.h"
@@ -4625,14 +4626,15 @@ builtin_builder::_memory_barrier(builtin_available_predicate avail)
 
 /******************************************************************************/
 
-//@TODO: implement
-typedef int mtx_t;
-#define _MTX_INITIALIZER_NP 0
-#define mtx_lock(name)
-#define mtx_unlock(name)
 
-
-/* The singleton instance of builtin_builder. */
+/**
+ * The singleton instance of builtin_builder.
+ *
+ * Once built, the module is never modified again until it is released:
+ * lookups, linking and constant expression evaluation only ever read it
+ * (anything they allocate goes into the caller's memory context).  The
+ * lock therefore only guards building and releasing it.
+ */
 static builtin_builder builtins;
 static mtx_t builtins_lock = _MTX_INITIALIZER_NP;
 
@@ -4660,11 +4662,7 @@ ir_function_signature *
 _mesa_glsl_find_builtin_function(_mesa_glsl_parse_state *state,
                                  const char *name, exec_list *actual_parameters)
 {
-   ir_function_signature * s;
-   mtx_lock(&builtins_lock);
-   s = builtins.find(state, name, actual_parameters);
-   mtx_unlock(&builtins_lock);
-   return s;
+   return builtins.find(state, name, actual_parameters);
 }
 
 gl_shader *
@@ -31,7 +31,8 @@
  *
  * This also contains _mesa_glsl_initialize_types(), a function which populates
  * a symbol table with the available built-in types for a particular language
- * version and set of enabled extensions.
+ * version and set of enabled extensions.  With builtin snapshots, that table
+ * is made once and shared, see _mesa_glsl_get_builtin_types().
  */
 
 #include "glsl_types.h"
@@ -264,8 +265,22 @@ add_type(glsl_symbol_table *symbols, const glsl_type *const type)
 void
 _mesa_glsl_initialize_types(struct _mesa_glsl_parse_state *state)
 {
-   struct glsl_symbol_table *symbols = state->symbols;
+   const glsl_symbol_table *types = _mesa_glsl_get_builtin_types(state);
+   if (types != NULL) {
+      state->symbols->base = types;
+      return;
+   }
+
+   _mesa_glsl_add_builtin_types(state->symbols, state);
+}
 
+/**
+ * Add the built-in types available to the shader to a symbol table.
+ */
+void
+_mesa_glsl_add_builtin_types(glsl_symbol_table *symbols,
+                             const struct _mesa_glsl_parse_state *state)
+{
    for (unsigned i = 0; i < ARRAY_SIZE(builtin_type_versions); i++) {
       const struct builtin_type_versions *const t = &builtin_type_versions[i];
       if (state->is_version(t->min_gl, t->min_es)) {
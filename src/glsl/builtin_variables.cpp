@@ -1080,7 +1080,11 @@ void
 _mesa_glsl_initialize_variables(exec_list *instructions,
 				struct _mesa_glsl_parse_state *state)
 {
-   builtin_variable_generator gen(instructions, state);
+   if (_mesa_glsl_clone_builtin_variables(instructions, state))
+      return;
+
+   exec_list variables;
+   builtin_variable_generator gen(&variables, state);
 
    gen.generate_constants();
    gen.generate_uniforms();
@@ -1101,4 +1105,7 @@ _mesa_glsl_initialize_variables(exec_list *instructions,
       gen.generate_cs_special_vars();
       break;
    }
+
+   _mesa_glsl_store_builtin_variables(&variables, state);
+   instructions->append_list(&variables);
 }
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <stdarg.h>
 
 #include "glcpp.h"
 #include "main/core.h" /* for struct gl_extensions */
@@ -132,6 +133,13 @@ static void
 _glcpp_parser_print_expanded_token_list (glcpp_parser_t *parser,
 					 token_list_t *list);
 
+static void
+_glcpp_parser_output_append (glcpp_parser_t *parser, const char *str,
+			     size_t len);
+
+static void
+_glcpp_parser_output_printf (glcpp_parser_t *parser, const char *fmt, ...);
+
 static void
 _glcpp_parser_skip_stack_push_if (glcpp_parser_t *parser, YYLTYPE *loc,
 				  int condition);
@@ -212,7 +220,7 @@ line:
 |	SPACE control_line
 |	text_line {
 		_glcpp_parser_print_expanded_token_list (parser, $1);
-		ralloc_asprintf_rewrite_tail (&parser->output, &parser->output_length, "\n");
+		_glcpp_parser_output_append (parser, "\n", 1);
 		ralloc_free ($1);
 	}
 |	expanded_line
@@ -232,20 +240,18 @@ expanded_line:
 |	LINE_EXPANDED integer_constant NEWLINE {
 		parser->has_new_line_number = 1;
 		parser->new_line_number = $2;
-		ralloc_asprintf_rewrite_tail (&parser->output,
-					      &parser->output_length,
-					      "#line %" PRIiMAX "\n",
-					      $2);
+		_glcpp_parser_output_printf (parser,
+					     "#line %" PRIiMAX "\n",
+					     $2);
 	}
 |	LINE_EXPANDED integer_constant integer_constant NEWLINE {
 		parser->has_new_line_number = 1;
 		parser->new_line_number = $2;
 		parser->has_new_source_number = 1;
 		parser->new_source_number = $3;
-		ralloc_asprintf_rewrite_tail (&parser->output,
-					      &parser->output_length,
-					      "#line %" PRIiMAX " %" PRIiMAX "\n",
-					      $2, $3);
+		_glcpp_parser_output_printf (parser,
+					     "#line %" PRIiMAX " %" PRIiMAX "\n",
+					     $2, $3);
 	}
 ;
 
@@ -263,7 +269,7 @@ define:
 
 control_line:
 	control_line_success {
-		ralloc_asprintf_rewrite_tail (&parser->output, &parser->output_length, "\n");
+		_glcpp_parser_output_append (parser, "\n", 1);
 	}
 |	control_line_error
 |	HASH_TOKEN LINE {
@@ -426,7 +432,7 @@ control_line_success:
 		glcpp_parser_resolve_implicit_version(parser);
 	}
 |	HASH_TOKEN PRAGMA NEWLINE {
-		ralloc_asprintf_rewrite_tail (&parser->output, &parser->output_length, "#%s", $2);
+		_glcpp_parser_output_printf (parser, "#%s", $2);
 	}
 ;
 
@@ -1109,70 +1115,169 @@ _token_list_equal_ignoring_space (token_list_t *a, token_list_t *b)
 	return 1;
 }
 
-static void
-_token_print (char **out, size_t *len, token_t *token)
+/**
+ * Return the text of a token and store its length in \c len.
+ *
+ * Single character and integer tokens are formatted into \c buf, which
+ * must have room for at least 32 characters.
+ */
+static const char *
+_token_text (token_t *token, char *buf, size_t *len)
 {
+	const char *text;
+
 	if (token->type < 256) {
-		ralloc_asprintf_rewrite_tail (out, len, "%c", token->type);
-		return;
+		buf[0] = (char) token->type;
+		buf[1] = '\0';
+		*len = 1;
+		return buf;
 	}
 
 	switch (token->type) {
 	case INTEGER:
-		ralloc_asprintf_rewrite_tail (out, len, "%" PRIiMAX, token->value.ival);
-		break;
+		*len = snprintf (buf, 32, "%" PRIiMAX, token->value.ival);
+		return buf;
 	case IDENTIFIER:
 	case INTEGER_STRING:
 	case OTHER:
-		ralloc_asprintf_rewrite_tail (out, len, "%s", token->value.str);
+		text = token->value.str;
 		break;
 	case SPACE:
-		ralloc_asprintf_rewrite_tail (out, len, " ");
+		text = " ";
 		break;
 	case LEFT_SHIFT:
-		ralloc_asprintf_rewrite_tail (out, len, "<<");
+		text = "<<";
 		break;
 	case RIGHT_SHIFT:
-		ralloc_asprintf_rewrite_tail (out, len, ">>");
+		text = ">>";
 		break;
 	case LESS_OR_EQUAL:
-		ralloc_asprintf_rewrite_tail (out, len, "<=");
+		text = "<=";
 		break;
 	case GREATER_OR_EQUAL:
-		ralloc_asprintf_rewrite_tail (out, len, ">=");
+		text = ">=";
 		break;
 	case EQUAL:
-		ralloc_asprintf_rewrite_tail (out, len, "==");
+		text = "==";
 		break;
 	case NOT_EQUAL:
-		ralloc_asprintf_rewrite_tail (out, len, "!=");
+		text = "!=";
 		break;
 	case AND:
-		ralloc_asprintf_rewrite_tail (out, len, "&&");
+		text = "&&";
 		break;
 	case OR:
-		ralloc_asprintf_rewrite_tail (out, len, "||");
+		text = "||";
 		break;
 	case PASTE:
-		ralloc_asprintf_rewrite_tail (out, len, "##");
+		text = "##";
 		break;
         case PLUS_PLUS:
-		ralloc_asprintf_rewrite_tail (out, len, "++");
+		text = "++";
 		break;
         case MINUS_MINUS:
-		ralloc_asprintf_rewrite_tail (out, len, "--");
+		text = "--";
 		break;
 	case DEFINED:
-		ralloc_asprintf_rewrite_tail (out, len, "defined");
+		text = "defined";
 		break;
 	case PLACEHOLDER:
 		/* Nothing to print. */
+		text = "";
 		break;
 	default:
 		assert(!"Error: Don't know how to print token.");
-
+		text = "";
 		break;
 	}
+
+	*len = strlen (text);
+	return text;
+}
+
+static void
+_token_print (char **out, size_t *len, token_t *token)
+{
+	char buf[32];
+	size_t text_len;
+	const char *text = _token_text (token, buf, &text_len);
+
+	ralloc_asprintf_rewrite_tail (out, len, "%s", text);
+}
+
+/**
+ * Make room for at least \c len more characters (plus the terminator) in
+ * the parser output, growing it geometrically so that appending a token
+ * at a time stays linear in the output size.
+ */
+static void
+_glcpp_parser_output_reserve (glcpp_parser_t *parser, size_t len)
+{
+	size_t needed = parser->output_length + len + 1;
+	size_t capacity = parser->output_capacity;
+	char *output;
+
+	if (needed <= capacity)
+		return;
+
+	while (capacity < needed)
+		capacity = capacity ? capacity * 2 : 256;
+
+	output = reralloc_size (parser, parser->output, capacity);
+	if (output == NULL)
+		return;
+
+	parser->output = output;
+	parser->output_capacity = capacity;
+}
+
+static void
+_glcpp_parser_output_append (glcpp_parser_t *parser, const char *str,
+			     size_t len)
+{
+	_glcpp_parser_output_reserve (parser, len);
+	if (parser->output_length + len >= parser->output_capacity)
+		return;
+
+	memcpy (parser->output + parser->output_length, str, len);
+	parser->output_length += len;
+	parser->output[parser->output_length] = '\0';
+}
+
+static void
+_glcpp_parser_output_printf (glcpp_parser_t *parser, const char *fmt, ...)
+{
+	va_list args;
+	size_t avail;
+	int len;
+
+	/* Format straight into the free space; only when that is too small
+	 * grow the buffer and format once more.
+	 */
+	_glcpp_parser_output_reserve (parser, 0);
+	avail = parser->output_capacity - parser->output_length;
+
+	va_start (args, fmt);
+	len = vsnprintf (parser->output + parser->output_length, avail,
+			 fmt, args);
+	va_end (args);
+	if (len < 0)
+		return;
+
+	if ((size_t) len >= avail) {
+		_glcpp_parser_output_reserve (parser, len);
+		if (parser->output_length + len >= parser->output_capacity) {
+			parser->output[parser->output_length] = '\0';
+			return;
+		}
+
+		va_start (args, fmt);
+		vsnprintf (parser->output + parser->output_length, len + 1,
+			   fmt, args);
+		va_end (args);
+	}
+
+	parser->output_length += len;
 }
 
 /* Return a new token (ralloc()ed off of 'token') formed by pasting
@@ -1312,8 +1417,13 @@ _token_list_print (glcpp_parser_t *parser, token_list_t *list)
 	if (list == NULL)
 		return;
 
-	for (node = list->head; node; node = node->next)
-		_token_print (&parser->output, &parser->output_length, node->token);
+	for (node = list->head; node; node = node->next) {
+		char buf[32];
+		size_t len;
+		const char *text = _token_text (node->token, buf, &len);
+
+		_glcpp_parser_output_append (parser, text, len);
+	}
 }
 
 void
@@ -1336,11 +1446,14 @@ static void add_builtin_define(glcpp_parser_t *parser,
 }
 
 glcpp_parser_t *
-glcpp_parser_create (const struct gl_extensions *extensions, gl_api api)
+glcpp_parser_create (void *ralloc_ctx, const struct gl_extensions *extensions, gl_api api)
 {
 	glcpp_parser_t *parser;
 
-	parser = ralloc (NULL, glcpp_parser_t);
+	/* Under the caller's context, so that an arena context there is used
+	 * for all the tokens and lists.
+	 */
+	parser = ralloc (ralloc_ctx, glcpp_parser_t);
 
 	glcpp_lex_init_extra (parser, &parser->scanner);
 	parser->defines = hash_table_ctor (32, hash_table_string_hash,
@@ -1362,8 +1475,10 @@ glcpp_parser_create (const struct gl_extensions *extensions, gl_api api)
 	parser->lex_from_list = NULL;
 	parser->lex_from_node = NULL;
 
-	parser->output = ralloc_strdup(parser, "");
+	parser->output = NULL;
 	parser->output_length = 0;
+	parser->output_capacity = 0;
+	_glcpp_parser_output_reserve (parser, 0);
 	parser->info_log = ralloc_strdup(parser, "");
 	parser->info_log_length = 0;
 	parser->error = 0;
@@ -1388,6 +1503,88 @@ glcpp_parser_destroy (glcpp_parser_t *parser)
 	ralloc_free (parser);
 }
 
+void
+glcpp_parser_define (glcpp_parser_t *parser, const char *name,
+		     const char *value)
+{
+	yyscan_t saved_scanner;
+	int saved_first_non_space_token_this_line;
+	int saved_last_token_was_newline;
+	int saved_last_token_was_space;
+	int saved_lexing_directive;
+	int saved_commented_newlines;
+	token_list_t *replacements;
+	token_t *tok;
+	YYSTYPE yylval;
+	YYLTYPE yylloc;
+	int ret;
+
+	/* The value is lexed by a scanner of its own, exactly like the
+	 * replacement list of a #define in the source would be, so save
+	 * everything the lexer tracks and restore it afterwards.
+	 */
+	saved_scanner = parser->scanner;
+	saved_first_non_space_token_this_line =
+		parser->first_non_space_token_this_line;
+	saved_last_token_was_newline = parser->last_token_was_newline;
+	saved_last_token_was_space = parser->last_token_was_space;
+	saved_lexing_directive = parser->lexing_directive;
+	saved_commented_newlines = parser->commented_newlines;
+
+	glcpp_lex_init_extra (parser, &parser->scanner);
+	glcpp_lex_set_source_string (parser, value ? value : "");
+
+	/* A '#' in the value never introduces a directive. */
+	parser->first_non_space_token_this_line = 0;
+	parser->last_token_was_newline = 0;
+	parser->last_token_was_space = 0;
+
+	memset (&yylloc, 0, sizeof (yylloc));
+	replacements = _token_list_create (parser);
+	while ((ret = glcpp_lex (&yylval, &yylloc, parser->scanner)) != 0 &&
+	       ret != NEWLINE) {
+		switch (ret) {
+		case IDENTIFIER:
+		case INTEGER_STRING:
+		case OTHER:
+			tok = _token_create_str (parser, ret, yylval.str);
+			break;
+		case SPACE:
+			if (replacements->head == NULL)
+				continue;
+			tok = _token_create_ival (parser, SPACE, SPACE);
+			break;
+		case HASH_TOKEN:
+			tok = _token_create_str (parser, OTHER,
+						 ralloc_strdup (parser, "#"));
+			break;
+		default:
+			tok = _token_create_ival (parser, ret, ret);
+			break;
+		}
+		tok->location = yylloc;
+		_token_list_append (replacements, tok);
+	}
+	_token_list_trim_trailing_space (replacements);
+
+	glcpp_lex_destroy (parser->scanner);
+	parser->scanner = saved_scanner;
+	parser->first_non_space_token_this_line =
+		saved_first_non_space_token_this_line;
+	parser->last_token_was_newline = saved_last_token_was_newline;
+	parser->last_token_was_space = saved_last_token_was_space;
+	parser->lexing_directive = saved_lexing_directive;
+	parser->commented_newlines = saved_commented_newlines;
+
+	if (replacements->head == NULL) {
+		ralloc_free (replacements);
+		replacements = NULL;
+	}
+
+	memset (&yylloc, 0, sizeof (yylloc));
+	_define_object_macro (parser, &yylloc, name, replacements);
+}
+
 typedef enum function_status
 {
 	FUNCTION_STATUS_SUCCESS,
@@ -2495,10 +2692,10 @@ _glcpp_parser_handle_version_declaration(glcpp_parser_t *parser, intmax_t versio
 		add_builtin_define (parser, "GL_FRAGMENT_PRECISION_HIGH", 1);
 
 	if (explicitly_set) {
-	   ralloc_asprintf_rewrite_tail (&parser->output, &parser->output_length,
-					 "#version %" PRIiMAX "%s%s", version,
-					 es_identifier ? " " : "",
-					 es_identifier ? es_identifier : "");
+	   _glcpp_parser_output_printf (parser,
+					"#version %" PRIiMAX "%s%s", version,
+					es_identifier ? " " : "",
+					es_identifier ? es_identifier : "");
 	}
 }
 
@@ -193,6 +193,7 @@ struct glcpp_parser {
 	char *output;
 	char *info_log;
 	size_t output_length;
+	size_t output_capacity;
 	size_t info_log_length;
 	int error;
 	const struct gl_extensions *extensions;
@@ -208,7 +209,7 @@ struct glcpp_parser {
 struct gl_extensions;
 
 glcpp_parser_t *
-glcpp_parser_create (const struct gl_extensions *extensions, gl_api api);
+glcpp_parser_create (void *ralloc_ctx, const struct gl_extensions *extensions, gl_api api);
 
 int
 glcpp_parser_parse (glcpp_parser_t *parser);
@@ -216,6 +217,12 @@ glcpp_parser_parse (glcpp_parser_t *parser);
 void
 glcpp_parser_destroy (glcpp_parser_t *parser);
 
+/* Defines an object-like macro as if by "#define name value" ahead of the
+ * shader source. A NULL value defines an empty macro. */
+void
+glcpp_parser_define (glcpp_parser_t *parser, const char *name,
+		     const char *value);
+
 void
 glcpp_parser_resolve_implicit_version(glcpp_parser_t *parser);
 
@@ -223,6 +230,22 @@ int
 glcpp_preprocess(void *ralloc_ctx, const char **shader, char **info_log,
 	   const struct gl_extensions *extensions, struct gl_context *g_ctx);
 
+/* Same as glcpp_preprocess, with num_defines object-like macros defined
+ * before the shader. If continuations_removed is set, the shader has
+ * already been through glcpp_remove_line_continuations. */
+int
+glcpp_preprocess_defines(void *ralloc_ctx, const char **shader,
+			 char **info_log,
+			 const struct gl_extensions *extensions,
+			 struct gl_context *g_ctx,
+			 const char * const *names,
+			 const char * const *values,
+			 unsigned num_defines,
+			 bool continuations_removed);
+
+char *
+glcpp_remove_line_continuations(void *ralloc_ctx, const char *shader);
+
 /* Functions for writing to the info log */
 
 void
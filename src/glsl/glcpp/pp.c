@@ -106,40 +106,29 @@ skip_newline (const char *str)
 	return ret;
 }
 
-/* Remove any line continuation characters in the shader, (whether in
- * preprocessing directives or in GLSL code).
+/* Determine what flavor of newlines this shader is using. GLSL
+ * provides for 4 different possible ways to separate lines, (using
+ * one or two characters):
+ *
+ *	"\n" (line-feed, like Linux, Unix, and new Mac OS)
+ *	"\r" (carriage-return, like old Mac files)
+ *	"\r\n" (carriage-return + line-feed, like DOS files)
+ *	"\n\r" (line-feed + carriage-return, like nothing, really)
+ *
+ * glcpp_remove_line_continuations explicitly supports a shader that uses
+ * a mixture of newline terminators and will properly handle line
+ * continuation backslashes followed by any of the above.
+ *
+ * But, since we must also insert additional newlines in the output
+ * (for any collapsed lines) we attempt to maintain consistency by
+ * examining the first encountered newline terminator, and using the
+ * same terminator for any newlines we insert.
  */
-static char *
-remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
+static void
+find_newline_separator(const char *shader, char *newline_separator)
 {
-	char *clean = ralloc_strdup(ctx, "");
-	const char *backslash, *newline, *search_start;
-        const char *cr, *lf;
-        char newline_separator[3];
-	int collapsed_newlines = 0;
-
-	search_start = shader;
-
-	/* Determine what flavor of newlines this shader is using. GLSL
-	 * provides for 4 different possible ways to separate lines, (using
-	 * one or two characters):
-	 *
-	 *	"\n" (line-feed, like Linux, Unix, and new Mac OS)
-	 *	"\r" (carriage-return, like old Mac files)
-	 *	"\r\n" (carriage-return + line-feed, like DOS files)
-	 *	"\n\r" (line-feed + carriage-return, like nothing, really)
-	 *
-	 * This code explicitly supports a shader that uses a mixture of
-	 * newline terminators and will properly handle line continuation
-	 * backslashes followed by any of the above.
-	 *
-	 * But, since we must also insert additional newlines in the output
-	 * (for any collapsed lines) we attempt to maintain consistency by
-	 * examining the first encountered newline terminator, and using the
-	 * same terminator for any newlines we insert.
-	 */
-	cr = strchr(search_start, '\r');
-	lf = strchr(search_start, '\n');
+	const char *cr = strchr(shader, '\r');
+	const char *lf = strchr(shader, '\n');
 
 	newline_separator[0] = '\n';
 	newline_separator[1] = '\0';
@@ -156,58 +145,75 @@ remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
 		newline_separator[0] = '\n';
 		newline_separator[1] = '\r';
 	}
+}
 
-	while (true) {
-		backslash = strchr(search_start, '\\');
+/* Remove any line continuation characters in the shader, (whether in
+ * preprocessing directives or in GLSL code).
+ *
+ * This is a single pass over the shader into one buffer: every collapsed
+ * line continuation drops at least two characters and later adds back
+ * one newline of at most two, so the result is never longer than the
+ * input.
+ */
+char *
+glcpp_remove_line_continuations(void *ctx, const char *shader)
+{
+	const char *start = shader;
+	const char *special;
+	char *clean = ralloc_size(ctx, strlen(shader) + 1);
+	char *out = clean;
+	char newline_separator[3] = { 0 };
+	int collapsed_newlines = 0;
 
-		/* If we have previously collapsed any line-continuations,
-		 * then we want to insert additional newlines at the next
-		 * occurrence of a newline character to avoid changing any
-		 * line numbers.
+	while (true) {
+		/* Only backslashes matter, until a line continuation has
+		 * been collapsed; then so does the next newline.
 		 */
-		if (collapsed_newlines) {
-			cr = strchr (search_start, '\r');
-			lf = strchr (search_start, '\n');
-			if (cr && lf)
-				newline = cr < lf ? cr : lf;
-			else if (cr)
-				newline = cr;
-			else
-				newline = lf;
-			if (newline &&
-			    (backslash == NULL || newline < backslash))
-			{
-				ralloc_strncat(&clean, shader,
-					       newline - shader + 1);
-				while (collapsed_newlines) {
-					ralloc_strcat(&clean, newline_separator);
-					collapsed_newlines--;
-				}
-				shader = skip_newline (newline);
-				search_start = shader;
-			}
-		}
-
-		search_start = backslash + 1;
+		if (collapsed_newlines)
+			special = strpbrk(shader, "\\\r\n");
+		else
+			special = strchr(shader, '\\');
 
-		if (backslash == NULL)
+		if (special == NULL)
 			break;
 
-		/* At each line continuation, (backslash followed by a
-		 * newline), copy all preceding text to the output, then
-		 * advance the shader pointer to the character after the
-		 * newline.
+		memcpy(out, shader, special - shader);
+		out += special - shader;
+
+		if (*special == '\\') {
+			/* At each line continuation, (backslash followed
+			 * by a newline), skip to the character after the
+			 * newline.
+			 */
+			if (special[1] == '\r' || special[1] == '\n') {
+				collapsed_newlines++;
+				shader = skip_newline(special + 1);
+			} else {
+				*out++ = '\\';
+				shader = special + 1;
+			}
+			continue;
+		}
+
+		/* If we have previously collapsed any line-continuations,
+		 * then insert additional newlines at the next occurrence
+		 * of a newline character to avoid changing any line
+		 * numbers.
 		 */
-		if (backslash[1] == '\r' || backslash[1] == '\n')
-		{
-			collapsed_newlines++;
-			ralloc_strncat(&clean, shader, backslash - shader);
-			shader = skip_newline (backslash + 1);
-			search_start = shader;
+		if (newline_separator[0] == '\0')
+			find_newline_separator(start, newline_separator);
+
+		*out++ = *special;
+		while (collapsed_newlines) {
+			*out++ = newline_separator[0];
+			if (newline_separator[1])
+				*out++ = newline_separator[1];
+			collapsed_newlines--;
 		}
+		shader = skip_newline(special);
 	}
 
-	ralloc_strcat(&clean, shader);
+	memcpy(out, shader, strlen(shader) + 1);
 
 	return clean;
 }
@@ -215,12 +221,36 @@ remove_line_continuations(glcpp_parser_t *ctx, const char *shader)
 int
 glcpp_preprocess(void *ralloc_ctx, const char **shader, char **info_log,
 	   const struct gl_extensions *extensions, struct gl_context *gl_ctx)
+{
+	return glcpp_preprocess_defines(ralloc_ctx, shader, info_log,
+					extensions, gl_ctx, NULL, NULL, 0,
+					false);
+}
+
+int
+glcpp_preprocess_defines(void *ralloc_ctx, const char **shader,
+			 char **info_log,
+			 const struct gl_extensions *extensions,
+			 struct gl_context *gl_ctx,
+			 const char * const *names,
+			 const char * const *values,
+			 unsigned num_defines,
+			 bool continuations_removed)
 {
 	int errors;
-	glcpp_parser_t *parser = glcpp_parser_create (extensions, gl_ctx->API);
+	unsigned i;
+	/* The preprocessor gets an arena of its own, so that its slabs can be
+	 * reused for the rest of the compile once it is done.
+	 */
+	void *pp_ctx = ralloc_arena_context(NULL, ralloc_arena_pool(ralloc_ctx));
+	glcpp_parser_t *parser = glcpp_parser_create (pp_ctx, extensions, gl_ctx->API);
+
+	if (! gl_ctx->Const.DisableGLSLLineContinuations &&
+	    ! continuations_removed)
+		*shader = glcpp_remove_line_continuations(parser, *shader);
 
-	if (! gl_ctx->Const.DisableGLSLLineContinuations)
-		*shader = remove_line_continuations(parser, *shader);
+	for (i = 0; i < num_defines; i++)
+		glcpp_parser_define (parser, names[i], values[i]);
 
 	glcpp_lex_set_source_string (parser, *shader);
 
@@ -233,10 +263,10 @@ glcpp_preprocess(void *ralloc_ctx, const char **shader, char **info_log,
 
 	ralloc_strcat(info_log, parser->info_log);
 
-	ralloc_steal(ralloc_ctx, parser->output);
-	*shader = parser->output;
+	*shader = ralloc_strdup(ralloc_ctx, parser->output);
 
 	errors = parser->error;
 	glcpp_parser_destroy (parser);
+	ralloc_free (pp_ctx);
 	return errors;
 }
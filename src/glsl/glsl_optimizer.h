@@ -19,8 +19,18 @@
    glslopt_shader_delete (shader);
  }
  glslopt_cleanup (ctx);
+
+ Threading:
+
+ glslopt_optimize can be called from several threads at once, either with
+ a separate context per thread or with one context shared by all of them.
+ Creating, configuring (glslopt_set_max_unroll_iterations,
+ glslopt_set_optimization_level etc.) and cleaning up a context must not
+ happen while other threads are using that same context.
 */
 
+#include <stddef.h>
+
 struct glslopt_shader;
 struct glslopt_ctx;
 
@@ -33,6 +43,11 @@ enum glslopt_shader_type {
 enum glslopt_options {
 	kGlslOptionSkipPreprocessor = (1<<0), // Skip preprocessing shader source. Saves some time if you know you don't need it.
 	kGlslOptionNotFullShader = (1<<1), // Passed shader is not the full shader source. This makes some optimizations weaker.
+	kGlslOptionProfile = (1<<2), // Collect compile phase and optimization pass timings, see glslopt_shader_get_pass_stats. Profiled compiles bypass the cache.
+	kGlslOptionPackVaryings = (1<<3), // glslopt_optimize_program only: pack float varyings into as few vec4s as possible.
+	kGlslOptionSkipRawOutput = (1<<4), // Don't print the unoptimized shader; glslopt_get_raw_output returns NULL.
+	kGlslOptionSkipReflection = (1<<5), // Don't collect inputs, uniforms and textures; their counts are zero.
+	kGlslOptionSkipStats = (1<<6), // Don't compute glslopt_shader_get_stats; they are all zero.
 };
 
 // Optimizer target language
@@ -68,13 +83,125 @@ void glslopt_cleanup (glslopt_ctx* ctx);
 
 void glslopt_set_max_unroll_iterations (glslopt_ctx* ctx, unsigned iterations);
 
+// Optimization level: trades output quality for optimization time.
+enum glslopt_optimization_level {
+	kGlslOptLevel0 = 0, // No optimizations; output is the linked, unoptimized shader.
+	kGlslOptLevel1 = 1, // Inlining and dead code removal only. Fast; good for live reloading.
+	kGlslOptLevel2 = 2, // Most optimizations, but no loop unrolling, vectorization, CSE, min/max pruning or expression tree rebalancing.
+	kGlslOptLevel3 = 3, // Everything (default).
+};
+void glslopt_set_optimization_level (glslopt_ctx* ctx, glslopt_optimization_level level);
+
+// Advanced: explicit optimization pass pipeline, replacing the level's one.
+// Comma separated pass names (as reported by glslopt_shader_get_pass_stats,
+// or one of the aliases inline, dce, copyprop, constprop, constfold,
+// precision, unroll); "pass*" or "(pass,pass,...)*" repeats until nothing
+// changes anymore. E.g. "inline,dce,copyprop,constfold*".
+// Returns false, leaving the current pipeline in place, if the string has
+// errors. glslopt_get_optimization_pipeline returns the current pipeline.
+bool glslopt_set_optimization_pipeline (glslopt_ctx* ctx, const char* pipeline);
+const char* glslopt_get_optimization_pipeline (glslopt_ctx* ctx);
+
+// Optional on-disk cache of optimization results. When set, results are
+// looked up by preprocessed source and preprocessor warnings, target,
+// shader type, options and max unroll iterations; a hit skips compilation
+// entirely. The directory can be shared by several processes. Pass NULL to
+// turn caching off.
+void glslopt_set_cache_dir (glslopt_ctx* ctx, const char* path);
+void glslopt_get_cache_stats (glslopt_ctx* ctx, int* outHits, int* outMisses);
+
+// Optional sink for optimized output, so it can go straight into the
+// caller's own buffers: every shader that an optimize call returns
+// successfully has its optimized output passed to writer (size bytes, not
+// null terminated), before that call returns; glslopt_optimize_batch calls
+// it from its worker threads. The data is only valid during the call: the
+// shader does not keep its output (glslopt_get_output returns NULL), so
+// while a writer is set, results are not shared between compiles (see
+// glslopt_shader_is_shared); the disk cache still works. Only change the
+// writer while no optimize calls are running. Pass NULL to turn it off.
+typedef void (*glslopt_output_writer) (void* user, glslopt_shader* shader, const char* data, size_t size);
+void glslopt_set_output_writer (glslopt_ctx* ctx, glslopt_output_writer writer, void* user);
+
 glslopt_shader* glslopt_optimize (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options);
+
+// Optimizes many shaders at once, spread across numThreads worker threads
+// (numThreads <= 0 uses one thread per CPU core; the calling thread is one of
+// the workers). outShaders must have room for count shaders; each is
+// what glslopt_optimize would have returned for that item, in input order,
+// and must be deleted with glslopt_shader_delete. All workers compile in
+// ctx, so batch items share results with each other and with other
+// compiles; each worker allocates its scratch memory on its own.
+struct glslopt_batch_item {
+	glslopt_shader_type type;
+	const char* shaderSource;
+	unsigned options;
+};
+void glslopt_optimize_batch (glslopt_ctx* ctx, const glslopt_batch_item* items, glslopt_shader** outShaders, int count, int numThreads);
+
+// Optimizes a vertex and a fragment shader that go together as one program.
+// Each stage is optimized like glslopt_optimize would, and then across stages:
+// vertex shader outputs the fragment shader does not use are removed, along
+// with the math computing them, and outputs that are always the same
+// constant are folded into the fragment shader. Builtin varyings and
+// interface blocks are left alone; varyings with explicit locations on both
+// sides match by location, and are never folded or packed.
+// Returns whether both stages compiled and link together; link errors are
+// in the logs of both shaders. Both shaders must be deleted with
+// glslopt_shader_delete. Results are not cached.
+bool glslopt_optimize_program (glslopt_ctx* ctx, const char* vertexSource, const char* fragmentSource, unsigned options, glslopt_shader** outVertex, glslopt_shader** outFragment);
+
+// Optimizes variants of one shader that only differ in preprocessor defines,
+// e.g. the keyword permutations of an uber-shader. Each variant lists its
+// defines as "NAME" or "NAME=VALUE" strings, which act like #defines placed
+// before the source; variants with invalid names or with line breaks in a
+// value fail. Work is shared between variants: line continuations are
+// removed once, variants whose defines only differ in macros the source
+// never uses are preprocessed once, and variants that preprocess to the same
+// text are optimized once and share one shader (see glslopt_shader_is_shared).
+// kGlslOptionSkipPreprocessor is ignored.
+// outShaders must have room for count shaders, in input order; each must be
+// deleted with glslopt_shader_delete.
+struct glslopt_variant {
+	const char* const* defines;
+	int defineCount;
+};
+void glslopt_optimize_variants (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options, const glslopt_variant* variants, glslopt_shader** outShaders, int count);
+
+// Optimizes a shader for both OpenGL ES 3.0 and Metal, with the same
+// results as glslopt_optimize in an ES3 and in a Metal context. The shader
+// is preprocessed, parsed, linked and (mostly) optimized once, and both
+// outputs are printed from that. Needs an OpenGL ES 3.0 or Metal context.
+// Both shaders must be deleted with glslopt_shader_delete.
+void glslopt_optimize_es3_metal (glslopt_ctx* ctx, glslopt_shader_type type, const char* shaderSource, unsigned options, glslopt_shader** outES3, glslopt_shader** outMetal);
+
 bool glslopt_get_status (glslopt_shader* shader);
 const char* glslopt_get_output (glslopt_shader* shader);
 const char* glslopt_get_raw_output (glslopt_shader* shader);
 const char* glslopt_get_log (glslopt_shader* shader);
 void glslopt_shader_delete (glslopt_shader* shader);
 
+// Compiles that come down to the same preprocessed source and preprocessor
+// warnings, shader type and options in one context (e.g. permutations that
+// only differ in unused defines) share one result: as long as an earlier
+// shader for it is not deleted, the same shader is handed out again instead
+// of being optimized once more. Each time a shader is returned, it must be
+// deleted once. Profiled compiles, and compiles while an output writer is
+// set, are never shared. Tells whether a shader was handed out more than
+// once.
+bool glslopt_shader_is_shared (glslopt_shader* shader);
+
+// Shader inputs, uniforms and textures. Location is -1 when none is assigned.
+struct glslopt_shader_var
+{
+	const char* name;
+	glslopt_basic_type type;
+	glslopt_precision prec;
+	int vectorSize;
+	int matrixSize;
+	int arraySize;
+	int location;
+};
+
 int glslopt_shader_get_input_count (glslopt_shader* shader);
 void glslopt_shader_get_input_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation);
 int glslopt_shader_get_uniform_count (glslopt_shader* shader);
@@ -83,9 +210,38 @@ void glslopt_shader_get_uniform_desc (glslopt_shader* shader, int index, const c
 int glslopt_shader_get_texture_count (glslopt_shader* shader);
 void glslopt_shader_get_texture_desc (glslopt_shader* shader, int index, const char** outName, glslopt_basic_type* outType, glslopt_precision* outPrec, int* outVecSize, int* outMatSize, int* outArraySize, int* outLocation);
 
+// The same variables as arrays of *outCount entries (NULL when there are
+// none), owned by the shader, to walk with a pointer:
+//   int count;
+//   const glslopt_shader_var* var = glslopt_shader_get_inputs (shader, &count);
+//   for (const glslopt_shader_var* end = var + count; var != end; ++var) ...
+const glslopt_shader_var* glslopt_shader_get_inputs (glslopt_shader* shader, int* outCount);
+const glslopt_shader_var* glslopt_shader_get_uniforms (glslopt_shader* shader, int* outCount);
+const glslopt_shader_var* glslopt_shader_get_textures (glslopt_shader* shader, int* outCount);
+
 // Get *very* approximate shader stats:
 // Number of math, texture and flow control instructions.
 void glslopt_shader_get_stats (glslopt_shader* shader, int* approxMath, int* approxTex, int* approxFlow);
 
+// Profiling info, for shaders optimized with kGlslOptionProfile (otherwise
+// all times are zero and there are no passes). Times are wall clock milliseconds.
+enum glslopt_phase {
+	kGlslPhasePreprocess = 0,
+	kGlslPhaseParse,
+	kGlslPhaseAstToHir,
+	kGlslPhaseLink,
+	kGlslPhaseOptimize,
+	kGlslPhasePrint,
+	kGlslPhaseCount
+};
+const char* glslopt_get_phase_name (glslopt_phase phase);
+double glslopt_shader_get_phase_time (glslopt_shader* shader, glslopt_phase phase);
+// Number of times the optimization pipeline, or repeated parts of it, ran (0 for cached results).
+int glslopt_shader_get_optimization_iterations (glslopt_shader* shader);
+// Per optimization pass: how many times it ran, how many of those made
+// progress, and total time spent in it.
+int glslopt_shader_get_pass_count (glslopt_shader* shader);
+void glslopt_shader_get_pass_stats (glslopt_shader* shader, int index, const char** outName, int* outCalls, int* outProgressCalls, double* outTimeMs);
+
 
 #endif /* GLSL_OPTIMIZER_H */
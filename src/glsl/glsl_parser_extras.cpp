@@ -24,6 +24,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include "c11/threads.h"
 
 extern "C" {
 #include "main/core.h" /* for struct gl_context */
@@ -65,6 +66,7 @@ _mesa_glsl_parse_state::_mesa_glsl_parse_state(struct gl_context *_ctx,
    this->scanner = NULL;
    this->translation_unit.make_empty();
    this->symbols = new(mem_ctx) glsl_symbol_table;
+   this->builtin_snapshots = NULL;
 
    this->info_log = ralloc_strdup(mem_ctx, "");
    this->error = false;
@@ -691,6 +693,168 @@ _mesa_glsl_process_extension(const char *name, YYLTYPE *name_locp,
 }
 
 
+/* Two bits per extension: enabled, and warn. */
+#define EXTENSION_BIT_WORDS \
+   ((2 * Elements(_mesa_glsl_supported_extensions) + 31) / 32)
+
+/**
+ * Builtin types and variables for one stage, language version and set of
+ * extension flags.  Nothing in a snapshot changes once it is visible to
+ * other compiles.
+ */
+struct glsl_builtin_snapshot {
+   glsl_builtin_snapshot *next;
+
+   gl_shader_stage stage;
+   unsigned language_version;
+   bool es_shader;
+   bool metal_target;
+   uint32_t extension_bits[EXTENSION_BIT_WORDS];
+
+   /** Base table for the shaders' symbol tables. */
+   glsl_symbol_table *types;
+
+   /**
+    * Builtin variable declarations, as made; only valid once
+    * has_variables is set.
+    */
+   exec_list variables;
+   bool has_variables;
+};
+
+struct glsl_builtin_snapshot_cache {
+   /** Guards the snapshot list and has_variables. */
+   mtx_t mutex;
+   glsl_builtin_snapshot *snapshots;
+};
+
+glsl_builtin_snapshot_cache *
+_mesa_glsl_builtin_snapshot_cache_create(void)
+{
+   glsl_builtin_snapshot_cache *cache =
+      rzalloc(NULL, glsl_builtin_snapshot_cache);
+   if (cache != NULL)
+      mtx_init(&cache->mutex, mtx_plain);
+   return cache;
+}
+
+void
+_mesa_glsl_builtin_snapshot_cache_destroy(glsl_builtin_snapshot_cache *cache)
+{
+   if (cache == NULL)
+      return;
+   mtx_destroy(&cache->mutex);
+   ralloc_free(cache);
+}
+
+static void
+get_extension_bits(const _mesa_glsl_parse_state *state, uint32_t *bits)
+{
+   memset(bits, 0, EXTENSION_BIT_WORDS * sizeof(uint32_t));
+   for (unsigned i = 0; i < Elements(_mesa_glsl_supported_extensions); ++i) {
+      const _mesa_glsl_extension *extension =
+         &_mesa_glsl_supported_extensions[i];
+      if (state->*(extension->enable_flag))
+         bits[(2 * i) / 32] |= 1u << ((2 * i) % 32);
+      if (state->*(extension->warn_flag))
+         bits[(2 * i + 1) / 32] |= 1u << ((2 * i + 1) % 32);
+   }
+}
+
+/**
+ * Find the snapshot for the shader's current version and extensions, or
+ * make one with just the types.  NULL if the shader has no cache.
+ */
+static glsl_builtin_snapshot *
+find_builtin_snapshot(_mesa_glsl_parse_state *state)
+{
+   glsl_builtin_snapshot_cache *cache = state->builtin_snapshots;
+   if (cache == NULL)
+      return NULL;
+
+   uint32_t bits[EXTENSION_BIT_WORDS];
+   get_extension_bits(state, bits);
+
+   mtx_lock(&cache->mutex);
+   glsl_builtin_snapshot *snapshot;
+   for (snapshot = cache->snapshots; snapshot != NULL;
+        snapshot = snapshot->next) {
+      if (snapshot->stage == state->stage &&
+          snapshot->language_version == state->language_version &&
+          snapshot->es_shader == state->es_shader &&
+          snapshot->metal_target == state->metal_target &&
+          memcmp(snapshot->extension_bits, bits, sizeof(bits)) == 0)
+         break;
+   }
+
+   if (snapshot == NULL) {
+      snapshot = rzalloc(cache, glsl_builtin_snapshot);
+      snapshot->stage = state->stage;
+      snapshot->language_version = state->language_version;
+      snapshot->es_shader = state->es_shader;
+      snapshot->metal_target = state->metal_target;
+      memcpy(snapshot->extension_bits, bits, sizeof(bits));
+      snapshot->types = new(snapshot) glsl_symbol_table;
+      _mesa_glsl_add_builtin_types(snapshot->types, state);
+      snapshot->variables.make_empty();
+      snapshot->next = cache->snapshots;
+      cache->snapshots = snapshot;
+   }
+   mtx_unlock(&cache->mutex);
+
+   return snapshot;
+}
+
+const glsl_symbol_table *
+_mesa_glsl_get_builtin_types(_mesa_glsl_parse_state *state)
+{
+   glsl_builtin_snapshot *snapshot = find_builtin_snapshot(state);
+   return snapshot != NULL ? snapshot->types : NULL;
+}
+
+bool
+_mesa_glsl_clone_builtin_variables(exec_list *instructions,
+                                   _mesa_glsl_parse_state *state)
+{
+   glsl_builtin_snapshot *snapshot = find_builtin_snapshot(state);
+   if (snapshot == NULL)
+      return false;
+
+   mtx_lock(&state->builtin_snapshots->mutex);
+   bool has_variables = snapshot->has_variables;
+   mtx_unlock(&state->builtin_snapshots->mutex);
+   if (!has_variables)
+      return false;
+
+   /* The shader modifies its builtins (redeclarations, array sizes, usage),
+    * so it gets copies.
+    */
+   foreach_in_list(ir_variable, var, &snapshot->variables) {
+      ir_variable *clone = var->clone(state->symbols, NULL);
+      instructions->push_tail(clone);
+      state->symbols->add_variable(clone);
+   }
+   return true;
+}
+
+void
+_mesa_glsl_store_builtin_variables(const exec_list *variables,
+                                   _mesa_glsl_parse_state *state)
+{
+   glsl_builtin_snapshot *snapshot = find_builtin_snapshot(state);
+   if (snapshot == NULL)
+      return;
+
+   mtx_lock(&state->builtin_snapshots->mutex);
+   if (!snapshot->has_variables) {
+      foreach_in_list(ir_variable, var, variables)
+         snapshot->variables.push_tail(var->clone(snapshot, NULL));
+      snapshot->has_variables = true;
+   }
+   mtx_unlock(&state->builtin_snapshots->mutex);
+}
+
+
 /**
  * Recurses through <type> and <expr> if <expr> is an aggregate initializer
  * and sets <expr>'s <constructor_type> field to <type>. Gives later functions
@@ -1362,9 +1526,12 @@ ast_struct_specifier::ast_struct_specifier(const char *identifier,
 					   ast_declarator_list *declarator_list)
 {
    if (identifier == NULL) {
+      static mtx_t anon_lock = _MTX_INITIALIZER_NP;
       static unsigned anon_count = 1;
-      identifier = ralloc_asprintf(this, "#anon_struct_%04x", anon_count);
-      anon_count++;
+      mtx_lock(&anon_lock);
+      const unsigned count = anon_count++;
+      mtx_unlock(&anon_lock);
+      identifier = ralloc_asprintf(this, "#anon_struct_%04x", count);
    }
    name = identifier;
    this->declarations.push_degenerate_list_at_head(&declarator_list->link);
@@ -211,6 +211,12 @@ struct _mesa_glsl_parse_state {
    exec_list translation_unit;
    glsl_symbol_table *symbols;
 
+   /**
+    * Builtin types and variables made by earlier compiles, to start this
+    * one from; NULL to make them from scratch.
+    */
+   struct glsl_builtin_snapshot_cache *builtin_snapshots;
+
    unsigned num_supported_versions;
    struct {
       unsigned ver;
@@ -568,6 +574,52 @@ extern bool _mesa_glsl_process_extension(const char *name, YYLTYPE *name_locp,
 					 YYLTYPE *behavior_locp,
 					 _mesa_glsl_parse_state *state);
 
+/**
+ * \name Builtin snapshots
+ *
+ * The builtin types and variables only depend on the stage, language version
+ * and enabled extensions of a shader (and on the gl_context).  A snapshot
+ * cache keeps them per combination of those, so that compiles with the same
+ * combination share the types and clone the variables instead of making
+ * them again.  Caches are thread safe; one must only be used with one
+ * gl_context.
+ */
+/*@{*/
+struct glsl_builtin_snapshot_cache;
+
+extern glsl_builtin_snapshot_cache *
+_mesa_glsl_builtin_snapshot_cache_create(void);
+
+extern void
+_mesa_glsl_builtin_snapshot_cache_destroy(glsl_builtin_snapshot_cache *cache);
+
+/**
+ * Read-only symbol table with the builtin types for the shader, or NULL if
+ * the shader has no snapshot cache.
+ */
+extern const glsl_symbol_table *
+_mesa_glsl_get_builtin_types(_mesa_glsl_parse_state *state);
+
+extern void
+_mesa_glsl_add_builtin_types(glsl_symbol_table *symbols,
+                             const _mesa_glsl_parse_state *state);
+
+/**
+ * Add clones of the builtin variables stored for the shader to
+ * \c instructions and the symbol table.  Returns false if none are stored.
+ */
+extern bool
+_mesa_glsl_clone_builtin_variables(exec_list *instructions,
+                                   _mesa_glsl_parse_state *state);
+
+/**
+ * Store copies of freshly made builtin \c variables for later shaders.
+ */
+extern void
+_mesa_glsl_store_builtin_variables(const exec_list *variables,
+                                   _mesa_glsl_parse_state *state);
+/*@}*/
+
 #endif /* __cplusplus */
 
 
@@ -588,6 +640,17 @@ _mesa_shader_stage_to_string(unsigned stage);
 extern int glcpp_preprocess(void *ctx, const char **shader, char **info_log,
                       const struct gl_extensions *extensions, struct gl_context *gl_ctx);
 
+extern int glcpp_preprocess_defines(void *ctx, const char **shader,
+                      char **info_log,
+                      const struct gl_extensions *extensions,
+                      struct gl_context *gl_ctx,
+                      const char * const *names,
+                      const char * const *values,
+                      unsigned num_defines,
+                      bool continuations_removed);
+
+extern char *glcpp_remove_line_continuations(void *ctx, const char *shader);
+
 extern void _mesa_destroy_shader_compiler(void);
 extern void _mesa_destroy_shader_compiler_caches(void);
 
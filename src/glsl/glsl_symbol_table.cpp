@@ -97,8 +97,10 @@ public:
 glsl_symbol_table::glsl_symbol_table()
 {
    this->separate_function_namespace = false;
+   this->base = NULL;
    this->table = _mesa_symbol_table_ctor();
    this->mem_ctx = ralloc_context(NULL);
+   this->depth = 0;
 }
 
 glsl_symbol_table::~glsl_symbol_table()
@@ -110,16 +112,30 @@ glsl_symbol_table::~glsl_symbol_table()
 void glsl_symbol_table::push_scope()
 {
    _mesa_symbol_table_push_scope(table);
+   depth++;
 }
 
 void glsl_symbol_table::pop_scope()
 {
    _mesa_symbol_table_pop_scope(table);
+   depth--;
 }
 
 bool glsl_symbol_table::name_declared_this_scope(const char *name)
 {
-   return _mesa_symbol_table_symbol_scope(table, -1, name) == 0;
+   int scope = _mesa_symbol_table_symbol_scope(table, -1, name);
+   if (scope != -1)
+      return scope == 0;
+   return base_declares(name);
+}
+
+/**
+ * Whether \c name is in the base table, and so taken in the outermost scope
+ * while that is the current one.
+ */
+bool glsl_symbol_table::base_declares(const char *name) const
+{
+   return depth == 0 && base != NULL && base->get_entry(name) != NULL;
 }
 
 bool glsl_symbol_table::add_variable(ir_variable *v)
@@ -154,12 +170,16 @@ bool glsl_symbol_table::add_variable(ir_variable *v)
    }
 
    /* 1.20+ rules: */
+   if (base_declares(v->name))
+      return false;
    symbol_table_entry *entry = new(mem_ctx) symbol_table_entry(v);
    return _mesa_symbol_table_add_symbol(table, -1, v->name, entry) == 0;
 }
 
 bool glsl_symbol_table::add_type(const char *name, const glsl_type *t)
 {
+   if (base_declares(name))
+      return false;
    symbol_table_entry *entry = new(mem_ctx) symbol_table_entry(t);
    return _mesa_symbol_table_add_symbol(table, -1, name, entry) == 0;
 }
@@ -168,7 +188,15 @@ bool glsl_symbol_table::add_interface(const char *name, const glsl_type *i,
                                       enum ir_variable_mode mode)
 {
    assert(i->is_interface());
-   symbol_table_entry *entry = get_entry(name);
+   symbol_table_entry *entry = get_local_entry(name);
+   if (entry == NULL && base != NULL) {
+      /* Don't modify the shared base; shadow its entry instead. */
+      symbol_table_entry *base_entry = base->get_entry(name);
+      if (base_entry != NULL) {
+         entry = new(mem_ctx) symbol_table_entry(*base_entry);
+         _mesa_symbol_table_add_symbol(table, -1, name, entry);
+      }
+   }
    if (entry == NULL) {
       symbol_table_entry *entry =
          new(mem_ctx) symbol_table_entry(i, mode);
@@ -191,6 +219,8 @@ bool glsl_symbol_table::add_function(ir_function *f)
 	 return true;
       }
    }
+   if (base_declares(f->name))
+      return false;
    symbol_table_entry *entry = new(mem_ctx) symbol_table_entry(f);
    return _mesa_symbol_table_add_symbol(table, -1, f->name, entry) == 0;
 }
@@ -228,7 +258,15 @@ ir_function *glsl_symbol_table::get_function(const char *name)
    return entry != NULL ? entry->f : NULL;
 }
 
-symbol_table_entry *glsl_symbol_table::get_entry(const char *name)
+symbol_table_entry *glsl_symbol_table::get_entry(const char *name) const
+{
+   symbol_table_entry *entry = get_local_entry(name);
+   if (entry == NULL && base != NULL)
+      entry = base->get_entry(name);
+   return entry;
+}
+
+symbol_table_entry *glsl_symbol_table::get_local_entry(const char *name) const
 {
    return (symbol_table_entry *)
       _mesa_symbol_table_find_symbol(table, -1, name);
@@ -243,7 +281,7 @@ glsl_symbol_table::disable_variable(const char *name)
     * the variable later, so all we really need to do is to make sure that
     * further attempts to access it using get_variable() will return NULL.
     */
-   symbol_table_entry *entry = get_entry(name);
+   symbol_table_entry *entry = get_local_entry(name);
    if (entry != NULL) {
       entry->v = NULL;
    }
@@ -51,6 +51,13 @@ struct glsl_symbol_table {
    /* In 1.10, functions and variables have separate namespaces. */
    bool separate_function_namespace;
 
+   /**
+    * Read-only table that names not found in this one are looked up in, or
+    * NULL.  Its names count as declared in this table's outermost scope.
+    * Several tables can share one base, see _mesa_glsl_initialize_types.
+    */
+   const glsl_symbol_table *base;
+
    void push_scope();
    void pop_scope();
 
@@ -99,10 +106,15 @@ struct glsl_symbol_table {
    void disable_variable(const char *name);
 
 private:
-   symbol_table_entry *get_entry(const char *name);
+   symbol_table_entry *get_entry(const char *name) const;
+   symbol_table_entry *get_local_entry(const char *name) const;
+   bool base_declares(const char *name) const;
 
    struct _mesa_symbol_table *table;
    void *mem_ctx;
+
+   /* Number of scopes pushed on top of the outermost one. */
+   unsigned depth;
 };
 
 #endif /* GLSL_SYMBOL_TABLE */
@@ -34,6 +34,7 @@ hash_table *glsl_type::array_types = NULL;
 hash_table *glsl_type::record_types = NULL;
 hash_table *glsl_type::interface_types = NULL;
 void *glsl_type::mem_ctx = NULL;
+mtx_t glsl_type::mutex = _MTX_INITIALIZER_NP;
 
 void
 glsl_type::init_ralloc_type_ctx(void)
@@ -288,6 +289,8 @@ const glsl_type *glsl_type::get_scalar_type() const
 void
 _mesa_glsl_release_types(void)
 {
+   mtx_lock(&glsl_type::mutex);
+
    if (glsl_type::array_types != NULL) {
       hash_table_dtor(glsl_type::array_types);
       glsl_type::array_types = NULL;
@@ -297,6 +300,13 @@ _mesa_glsl_release_types(void)
       hash_table_dtor(glsl_type::record_types);
       glsl_type::record_types = NULL;
    }
+
+   if (glsl_type::interface_types != NULL) {
+      hash_table_dtor(glsl_type::interface_types);
+      glsl_type::interface_types = NULL;
+   }
+
+   mtx_unlock(&glsl_type::mutex);
 }
 
 
@@ -455,6 +465,7 @@ glsl_type::get_instance(unsigned base_type, unsigned rows, unsigned columns)
 const glsl_type *
 glsl_type::get_array_instance(const glsl_type *base, unsigned array_size)
 {
+   mtx_lock(&glsl_type::mutex);
 
    if (array_types == NULL) {
       array_types = hash_table_ctor(64, hash_table_string_hash,
@@ -480,6 +491,8 @@ glsl_type::get_array_instance(const glsl_type *base, unsigned array_size)
    assert(t->length == array_size);
    assert(t->fields.array == base);
 
+   mtx_unlock(&glsl_type::mutex);
+
    return t;
 }
 
@@ -579,6 +592,8 @@ glsl_type::get_record_instance(const glsl_struct_field *fields,
 			       unsigned num_fields,
 			       const char *name)
 {
+   mtx_lock(&glsl_type::mutex);
+
    const glsl_type key(fields, num_fields, name);
 
    if (record_types == NULL) {
@@ -596,6 +611,8 @@ glsl_type::get_record_instance(const glsl_struct_field *fields,
    assert(t->length == num_fields);
    assert(strcmp(t->name, name) == 0);
 
+   mtx_unlock(&glsl_type::mutex);
+
    return t;
 }
 
@@ -606,6 +623,8 @@ glsl_type::get_interface_instance(const glsl_struct_field *fields,
 				  enum glsl_interface_packing packing,
 				  const char *block_name)
 {
+   mtx_lock(&glsl_type::mutex);
+
    const glsl_type key(fields, num_fields, packing, block_name);
 
    if (interface_types == NULL) {
@@ -623,6 +642,8 @@ glsl_type::get_interface_instance(const glsl_struct_field *fields,
    assert(t->length == num_fields);
    assert(strcmp(t->name, block_name) == 0);
 
+   mtx_unlock(&glsl_type::mutex);
+
    return t;
 }
 
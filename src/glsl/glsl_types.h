@@ -110,6 +110,7 @@ enum glsl_matrix_layout {
 #ifdef __cplusplus
 #include "../mesa/main/glminimal.h"
 #include "util/ralloc.h"
+#include "c11/threads.h"
 
 struct glsl_type {
    GLenum gl_type;
@@ -628,6 +629,15 @@ struct glsl_type {
    bool record_compare(const glsl_type *b) const;
 
 private:
+   /**
+    * Mutex protecting the type caches and \c mem_ctx below
+    *
+    * Every non-builtin type is constructed from one of the
+    * \c get_*_instance functions while holding this lock, so the
+    * constructors and \c glsl_type::new can touch the shared state freely.
+    */
+   static mtx_t mutex;
+
    /**
     * ralloc context for all glsl_type allocations
     *
@@ -392,7 +392,7 @@ unpack_half_1x16(uint16_t u)
  * The offset is used when the reference is to a specific column of a matrix.
  */
 static bool
-constant_referenced(const ir_dereference *deref,
+constant_referenced(void *mem_ctx, const ir_dereference *deref,
                     struct hash_table *variable_context,
                     ir_constant *&store, int &offset)
 {
@@ -408,7 +408,7 @@ constant_referenced(const ir_dereference *deref,
          (const ir_dereference_array *) deref;
 
       ir_constant *const index_c =
-         da->array_index->constant_expression_value(variable_context);
+         da->array_index->constant_expression_value(mem_ctx, variable_context);
 
       if (!index_c || !index_c->type->is_scalar() || !index_c->type->is_integer())
          break;
@@ -424,7 +424,7 @@ constant_referenced(const ir_dereference *deref,
       if (!deref)
          break;
 
-      if (!constant_referenced(deref, variable_context, substore, suboffset))
+      if (!constant_referenced(mem_ctx, deref, variable_context, substore, suboffset))
          break;
 
       const glsl_type *const vt = da->array->type;
@@ -453,7 +453,7 @@ constant_referenced(const ir_dereference *deref,
       ir_constant *substore;
       int suboffset;
 
-      if (!constant_referenced(deref, variable_context, substore, suboffset))
+      if (!constant_referenced(mem_ctx, deref, variable_context, substore, suboffset))
          break;
 
       /* Since we're dropping it on the floor...
@@ -482,14 +482,14 @@ constant_referenced(const ir_dereference *deref,
 
 
 ir_constant *
-ir_rvalue::constant_expression_value(struct hash_table *)
+ir_rvalue::constant_expression_value(void *mem_ctx, struct hash_table *)
 {
    assert(this->type->is_error());
    return NULL;
 }
 
 ir_constant *
-ir_expression::constant_expression_value(struct hash_table *variable_context)
+ir_expression::constant_expression_value(void *mem_ctx, struct hash_table *variable_context)
 {
    if (this->type->is_error())
       return NULL;
@@ -500,7 +500,7 @@ ir_expression::constant_expression_value(struct hash_table *variable_context)
    memset(&data, 0, sizeof(data));
 
    for (unsigned operand = 0; operand < this->get_num_operands(); operand++) {
-      op[operand] = this->operands[operand]->constant_expression_value(variable_context);
+      op[operand] = this->operands[operand]->constant_expression_value(mem_ctx, variable_context);
       if (!op[operand])
 	 return NULL;
    }
@@ -537,16 +537,15 @@ ir_expression::constant_expression_value(struct hash_table *variable_context)
       components = op[1]->type->components();
    }
 
-   void *ctx = ralloc_parent(this);
 
    /* Handle array operations here, rather than below. */
    if (op[0]->type->is_array()) {
       assert(op[1] != NULL && op[1]->type->is_array());
       switch (this->operation) {
       case ir_binop_all_equal:
-	 return new(ctx) ir_constant(op[0]->has_value(op[1]));
+	 return new(mem_ctx) ir_constant(op[0]->has_value(op[1]));
       case ir_binop_any_nequal:
-	 return new(ctx) ir_constant(!op[0]->has_value(op[1]));
+	 return new(mem_ctx) ir_constant(!op[0]->has_value(op[1]));
       default:
 	 break;
       }
@@ -1653,12 +1652,12 @@ ir_expression::constant_expression_value(struct hash_table *variable_context)
       return NULL;
    }
 
-   return new(ctx) ir_constant(this->type, &data);
+   return new(mem_ctx) ir_constant(this->type, &data);
 }
 
 
 ir_constant *
-ir_texture::constant_expression_value(struct hash_table *)
+ir_texture::constant_expression_value(void *mem_ctx, struct hash_table *)
 {
    /* texture lookups aren't constant expressions */
    return NULL;
@@ -1666,9 +1665,9 @@ ir_texture::constant_expression_value(struct hash_table *)
 
 
 ir_constant *
-ir_swizzle::constant_expression_value(struct hash_table *variable_context)
+ir_swizzle::constant_expression_value(void *mem_ctx, struct hash_table *variable_context)
 {
-   ir_constant *v = this->val->constant_expression_value(variable_context);
+   ir_constant *v = this->val->constant_expression_value(mem_ctx, variable_context);
 
    if (v != NULL) {
       ir_constant_data data = { { 0 } };
@@ -1687,15 +1686,14 @@ ir_swizzle::constant_expression_value(struct hash_table *variable_context)
 	 }
       }
 
-      void *ctx = ralloc_parent(this);
-      return new(ctx) ir_constant(this->type, &data);
+      return new(mem_ctx) ir_constant(this->type, &data);
    }
    return NULL;
 }
 
 
 ir_constant *
-ir_dereference_variable::constant_expression_value(struct hash_table *variable_context)
+ir_dereference_variable::constant_expression_value(void *mem_ctx, struct hash_table *variable_context)
 {
    /* This may occur during compile and var->type is glsl_type::error_type */
    if (!var)
@@ -1717,18 +1715,17 @@ ir_dereference_variable::constant_expression_value(struct hash_table *variable_c
    if (!var->constant_value)
       return NULL;
 
-   return var->constant_value->clone(ralloc_parent(var), NULL);
+   return var->constant_value->clone(mem_ctx, NULL);
 }
 
 
 ir_constant *
-ir_dereference_array::constant_expression_value(struct hash_table *variable_context)
+ir_dereference_array::constant_expression_value(void *mem_ctx, struct hash_table *variable_context)
 {
-   ir_constant *array = this->array->constant_expression_value(variable_context);
-   ir_constant *idx = this->array_index->constant_expression_value(variable_context);
+   ir_constant *array = this->array->constant_expression_value(mem_ctx, variable_context);
+   ir_constant *idx = this->array_index->constant_expression_value(mem_ctx, variable_context);
 
    if ((array != NULL) && (idx != NULL)) {
-      void *ctx = ralloc_parent(this);
       if (array->type->is_matrix()) {
 	 /* Array access of a matrix results in a vector.
 	  */
@@ -1762,14 +1759,14 @@ ir_dereference_array::constant_expression_value(struct hash_table *variable_cont
 	    break;
 	 }
 
-	 return new(ctx) ir_constant(column_type, &data);
+	 return new(mem_ctx) ir_constant(column_type, &data);
       } else if (array->type->is_vector()) {
 	 const unsigned component = idx->value.u[0];
 
-	 return new(ctx) ir_constant(array, component);
+	 return new(mem_ctx) ir_constant(array, component);
       } else {
 	 const unsigned index = idx->value.u[0];
-	 return array->get_array_element(index)->clone(ctx, NULL);
+	 return array->get_array_element(index)->clone(mem_ctx, NULL);
       }
    }
    return NULL;
@@ -1777,16 +1774,16 @@ ir_dereference_array::constant_expression_value(struct hash_table *variable_cont
 
 
 ir_constant *
-ir_dereference_record::constant_expression_value(struct hash_table *)
+ir_dereference_record::constant_expression_value(void *mem_ctx, struct hash_table *)
 {
-   ir_constant *v = this->record->constant_expression_value();
+   ir_constant *v = this->record->constant_expression_value(mem_ctx);
 
    return (v != NULL) ? v->get_record_field(this->field) : NULL;
 }
 
 
 ir_constant *
-ir_assignment::constant_expression_value(struct hash_table *)
+ir_assignment::constant_expression_value(void *mem_ctx, struct hash_table *)
 {
    /* FINISHME: Handle CEs involving assignment (return RHS) */
    return NULL;
@@ -1794,20 +1791,21 @@ ir_assignment::constant_expression_value(struct hash_table *)
 
 
 ir_constant *
-ir_constant::constant_expression_value(struct hash_table *)
+ir_constant::constant_expression_value(void *mem_ctx, struct hash_table *)
 {
    return this;
 }
 
 
 ir_constant *
-ir_call::constant_expression_value(struct hash_table *variable_context)
+ir_call::constant_expression_value(void *mem_ctx, struct hash_table *variable_context)
 {
-   return this->callee->constant_expression_value(&this->actual_parameters, variable_context);
+   return this->callee->constant_expression_value(mem_ctx, &this->actual_parameters, variable_context);
 }
 
 
-bool ir_function_signature::constant_expression_evaluate_expression_list(const struct exec_list &body,
+bool ir_function_signature::constant_expression_evaluate_expression_list(void *mem_ctx,
+									 const struct exec_list &body,
 									 struct hash_table *variable_context,
 									 ir_constant **result)
 {
@@ -1817,7 +1815,7 @@ bool ir_function_signature::constant_expression_evaluate_expression_list(const s
 	 /* (declare () type symbol) */
       case ir_type_variable: {
 	 ir_variable *var = inst->as_variable();
-	 hash_table_insert(variable_context, ir_constant::zero(this, var->type), var);
+	 hash_table_insert(variable_context, ir_constant::zero(mem_ctx, var->type), var);
 	 break;
       }
 
@@ -1825,7 +1823,7 @@ bool ir_function_signature::constant_expression_evaluate_expression_list(const s
       case ir_type_assignment: {
 	 ir_assignment *asg = inst->as_assignment();
 	 if (asg->condition) {
-	    ir_constant *cond = asg->condition->constant_expression_value(variable_context);
+	    ir_constant *cond = asg->condition->constant_expression_value(mem_ctx, variable_context);
 	    if (!cond)
 	       return false;
 	    if (!cond->get_bool_component(0))
@@ -1835,10 +1833,10 @@ bool ir_function_signature::constant_expression_evaluate_expression_list(const s
 	 ir_constant *store = NULL;
 	 int offset = 0;
 
-	 if (!constant_referenced(asg->lhs, variable_context, store, offset))
+	 if (!constant_referenced(mem_ctx, asg->lhs, variable_context, store, offset))
 	    return false;
 
-	 ir_constant *value = asg->rhs->constant_expression_value(variable_context);
+	 ir_constant *value = asg->rhs->constant_expression_value(mem_ctx, variable_context);
 
 	 if (!value)
 	    return false;
@@ -1850,7 +1848,7 @@ bool ir_function_signature::constant_expression_evaluate_expression_list(const s
 	 /* (return (expression)) */
       case ir_type_return:
 	 assert (result);
-	 *result = inst->as_return()->value->constant_expression_value(variable_context);
+	 *result = inst->as_return()->value->constant_expression_value(mem_ctx, variable_context);
 	 return *result != NULL;
 
 	 /* (call name (ref) (params))*/
@@ -1867,11 +1865,11 @@ bool ir_function_signature::constant_expression_evaluate_expression_list(const s
 	 ir_constant *store = NULL;
 	 int offset = 0;
 
-	 if (!constant_referenced(call->return_deref, variable_context,
+	 if (!constant_referenced(mem_ctx, call->return_deref, variable_context,
                                   store, offset))
 	    return false;
 
-	 ir_constant *value = call->constant_expression_value(variable_context);
+	 ir_constant *value = call->constant_expression_value(mem_ctx, variable_context);
 
 	 if(!value)
 	    return false;
@@ -1884,14 +1882,14 @@ bool ir_function_signature::constant_expression_evaluate_expression_list(const s
       case ir_type_if: {
 	 ir_if *iif = inst->as_if();
 
-	 ir_constant *cond = iif->condition->constant_expression_value(variable_context);
+	 ir_constant *cond = iif->condition->constant_expression_value(mem_ctx, variable_context);
 	 if (!cond || !cond->type->is_boolean())
 	    return false;
 
 	 exec_list &branch = cond->get_bool_component(0) ? iif->then_instructions : iif->else_instructions;
 
 	 *result = NULL;
-	 if (!constant_expression_evaluate_expression_list(branch, variable_context, result))
+	 if (!constant_expression_evaluate_expression_list(mem_ctx, branch, variable_context, result))
 	    return false;
 
 	 /* If there was a return in the branch chosen, drop out now. */
@@ -1915,7 +1913,7 @@ bool ir_function_signature::constant_expression_evaluate_expression_list(const s
 }
 
 ir_constant *
-ir_function_signature::constant_expression_value(exec_list *actual_parameters, struct hash_table *variable_context)
+ir_function_signature::constant_expression_value(void *mem_ctx, exec_list *actual_parameters, struct hash_table *variable_context)
 {
    const glsl_type *type = this->return_type;
    if (type == glsl_type::void_type)
@@ -1951,7 +1949,7 @@ ir_function_signature::constant_expression_value(exec_list *actual_parameters, s
    const exec_node *parameter_info = origin ? origin->parameters.head : parameters.head;
 
    foreach_in_list(ir_rvalue, n, actual_parameters) {
-      ir_constant *constant = n->constant_expression_value(variable_context);
+      ir_constant *constant = n->constant_expression_value(mem_ctx, variable_context);
       if (constant == NULL) {
          hash_table_dtor(deref_hash);
          return NULL;
@@ -1967,10 +1965,11 @@ ir_function_signature::constant_expression_value(exec_list *actual_parameters, s
    ir_constant *result = NULL;
 
    /* Now run the builtin function until something non-constant
-    * happens or we get the result.
+    * happens or we get the result.  Every temporary lives in mem_ctx, so
+    * the shared built-in IR is only ever read here.
     */
-   if (constant_expression_evaluate_expression_list(origin ? origin->body : body, deref_hash, &result) && result)
-      result = result->clone(ralloc_parent(this), NULL);
+   if (constant_expression_evaluate_expression_list(mem_ctx, origin ? origin->body : body, deref_hash, &result) && result)
+      result = result->clone(mem_ctx, NULL);
 
    hash_table_dtor(deref_hash);
 
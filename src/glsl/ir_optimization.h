@@ -76,7 +76,7 @@ bool do_rebalance_tree(exec_list *instructions);
 bool do_algebraic(exec_list *instructions, bool native_integers,
                   const struct gl_shader_compiler_options *options);
 bool do_constant_folding(exec_list *instructions);
-bool do_constant_variable(exec_list *instructions);
+bool do_constant_variable(exec_list *instructions, class ir_variable_refcount_visitor *refs = NULL);
 bool do_constant_variable_unlinked(exec_list *instructions);
 bool do_copy_propagation(exec_list *instructions);
 bool do_copy_propagation_elements(exec_list *instructions);
@@ -86,8 +86,9 @@ void do_dead_builtin_varyings(struct gl_context *ctx,
                               gl_shader *producer, gl_shader *consumer,
                               unsigned num_tfeedback_decls,
                               class tfeedback_decl *tfeedback_decls);
-bool do_dead_code(exec_list *instructions, bool uniform_locations_assigned);
-bool do_dead_code_local(exec_list *instructions);
+bool do_dead_code(exec_list *instructions, bool uniform_locations_assigned,
+                  class ir_variable_refcount_visitor *refs = NULL);
+bool do_dead_code_local(exec_list *instructions, class ir_variable_refcount_visitor *refs = NULL);
 bool do_dead_code_unlinked(exec_list *instructions);
 bool do_dead_functions(exec_list *instructions);
 bool opt_flip_matrices(exec_list *instructions);
@@ -103,7 +104,7 @@ bool do_noop_swizzle(exec_list *instructions);
 bool do_structure_splitting(exec_list *instructions);
 bool do_swizzle_swizzle(exec_list *instructions);
 bool do_vectorize(exec_list *instructions);
-bool do_tree_grafting(exec_list *instructions);
+bool do_tree_grafting(exec_list *instructions, class ir_variable_refcount_visitor *refs = NULL);
 bool do_vec_index_to_cond_assign(exec_list *instructions);
 bool do_vec_index_to_swizzle(exec_list *instructions);
 bool lower_discard(exec_list *instructions);
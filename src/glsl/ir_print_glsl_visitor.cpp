@@ -294,9 +294,9 @@ _mesa_print_ir_glsl(exec_list *instructions,
 	print_texlod_workarounds(uses_texlod_impl, uses_texlodproj_impl, str);
 	
 	// Add the optimized glsl code
-	str.asprintf_append("%s", body.c_str());
+	str.append(body);
 
-	return ralloc_strdup(buffer, str.c_str());
+	return str.release();
 }
 
 
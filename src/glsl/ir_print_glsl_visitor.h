@@ -59,6 +59,31 @@ public:
 	bool empty() const { return m_Size == 0; }
 	
 	const char* c_str() const { return m_Ptr; }
+
+	size_t size() const { return m_Size; }
+
+	// Hands over the string, parented to the buffer's memory context; the
+	// buffer is empty (and unusable) afterwards.
+	char* release()
+	{
+		char* ptr = m_Ptr;
+		m_Ptr = NULL;
+		m_Size = m_Capacity = 0;
+		return ptr;
+	}
+	
+	void append(const char* str, size_t length)
+	{
+		assert (m_Ptr != NULL);
+		reserve (m_Size + length + 1);
+		memcpy (m_Ptr + m_Size, str, length);
+		m_Size += length;
+		m_Ptr[m_Size] = 0;
+	}
+
+	void append(const char* str) { append(str, strlen(str)); }
+
+	void append(const string_buffer& other) { append(other.m_Ptr, other.m_Size); }
 	
 	void asprintf_append(const char *fmt, ...) PRINTFLIKE(2, 3)
 	{
@@ -77,21 +102,40 @@ public:
 	void vasprintf_rewrite_tail (size_t *start, const char *fmt, va_list args)
 	{
 		assert (m_Ptr != NULL);
-		
-		size_t new_length = printf_length(fmt, args);
-		size_t needed_length = m_Size + new_length + 1;
-		
-		if (m_Capacity < needed_length)
+
+		// Most of what gets printed is plain tokens and punctuation
+		if (!strchr(fmt, '%'))
 		{
-			m_Capacity = MAX2 (m_Capacity + m_Capacity/2, needed_length);
-			m_Ptr = (char*)reralloc_size(ralloc_parent(m_Ptr), m_Ptr, m_Capacity);
+			append(fmt);
+			return;
+		}
+
+		// Format straight into the free space, and only when that is too
+		// small grow and format again
+		va_list args_copy;
+		va_copy(args_copy, args);
+		int new_length = vsnprintf(m_Ptr + m_Size, m_Capacity - m_Size, fmt, args_copy);
+		va_end(args_copy);
+		assert (new_length >= 0);
+		if (m_Size + new_length + 1 > m_Capacity)
+		{
+			reserve(m_Size + new_length + 1);
+			vsnprintf(m_Ptr + m_Size, new_length+1, fmt, args);
 		}
-		
-		vsnprintf(m_Ptr + m_Size, new_length+1, fmt, args);
 		m_Size += new_length;
 		assert (m_Capacity >= m_Size);
 	}
 	
+private:
+	void reserve(size_t needed_length)
+	{
+		if (m_Capacity < needed_length)
+		{
+			m_Capacity = MAX2 (m_Capacity + m_Capacity/2, needed_length);
+			m_Ptr = (char*)reralloc_size(ralloc_parent(m_Ptr), m_Ptr, m_Capacity);
+		}
+	}
+
 private:
 	char* m_Ptr;
 	size_t m_Size;
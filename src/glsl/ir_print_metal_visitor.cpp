@@ -288,8 +288,8 @@ _mesa_print_ir_metal(exec_list *instructions,
 	// append inout variables to both input & output structs
 	if (!ctx.inoutStr.empty())
 	{
-		ctx.inputStr.asprintf_append("%s", ctx.inoutStr.c_str());
-		ctx.outputStr.asprintf_append("%s", ctx.inoutStr.c_str());
+		ctx.inputStr.append(ctx.inoutStr);
+		ctx.outputStr.append(ctx.inoutStr);
 	}
 	ctx.inputStr.asprintf_append("};\n");
 	ctx.outputStr.asprintf_append("};\n");
@@ -297,7 +297,7 @@ _mesa_print_ir_metal(exec_list *instructions,
 
 	// emit global array/struct constants
 	
-	ctx.prefixStr.asprintf_append("%s", ctx.typedeclStr.c_str());
+	ctx.prefixStr.append(ctx.typedeclStr);
 	foreach_in_list_safe(gconst_entry_metal, node, &gtracker.global_constants)
 	{
 		ir_constant* c = node->ir;
@@ -335,14 +335,16 @@ _mesa_print_ir_metal(exec_list *instructions,
 	}
 
 
-	ctx.prefixStr.asprintf_append("%s", ctx.inputStr.c_str());
-	ctx.prefixStr.asprintf_append("%s", ctx.outputStr.c_str());
-	ctx.prefixStr.asprintf_append("%s", ctx.uniformStr.c_str());
-	ctx.prefixStr.asprintf_append("%s", ctx.str.c_str());
+	ctx.prefixStr.append(ctx.inputStr);
+	ctx.prefixStr.append(ctx.outputStr);
+	ctx.prefixStr.append(ctx.uniformStr);
+	ctx.prefixStr.append(ctx.str);
 
 	*outUniformsSize = ctx.uniformLocationCounter;
 
-	return ralloc_strdup(buffer, ctx.prefixStr.c_str());
+	char* result = ctx.prefixStr.release();
+	ralloc_steal(buffer, result);
+	return result;
 }
 
 
@@ -406,6 +408,31 @@ void ir_print_metal_visitor::print_var_name (ir_variable* v)
 
 
 
+void
+_mesa_assign_metal_output_locations(exec_list *instructions, PrintGlslMode mode)
+{
+	if (mode != kPrintGlslFragment)
+		return;
+
+	// same order and rules as _mesa_print_ir_metal and visit(ir_variable*)
+	int colorCounter = 0;
+	foreach_in_list(ir_instruction, ir, instructions)
+	{
+		ir_variable *var = ir->as_variable();
+		if (!var)
+			continue;
+		if (strstr(var->name, "gl_") == var->name && !var->data.used && !var->data.assigned)
+			continue;
+		if ((var->data.mode == ir_var_shader_out || var->data.mode == ir_var_shader_inout) && !var->data.explicit_location)
+		{
+			var->data.explicit_location = 1;
+			var->data.location = FRAG_RESULT_DATA0 + colorCounter;
+			++colorCounter;
+		}
+	}
+}
+
+
 static void print_type_precision(string_buffer& buffer, const glsl_type *t, glsl_precision prec, bool arraySize)
 {
 	const bool halfPrec = (prec == glsl_precision_medium || prec == glsl_precision_low);
@@ -730,7 +757,7 @@ void ir_print_metal_visitor::visit(ir_function_signature *ir)
 		buffer.asprintf_append ("xlatMtlShaderOutput xlatMtlMain (xlatMtlShaderInput _mtl_i [[stage_in]], constant xlatMtlShaderUniform& _mtl_u [[buffer(0)]]");
 		if (!ctx.paramsStr.empty())
 		{
-			buffer.asprintf_append ("%s", ctx.paramsStr.c_str());
+			buffer.append(ctx.paramsStr);
 		}
 	}
 
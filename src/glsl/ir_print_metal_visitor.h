@@ -33,4 +33,8 @@ extern char* _mesa_print_ir_metal(exec_list *instructions,
 			struct _mesa_glsl_parse_state *state,
 			char* buf, PrintGlslMode mode, int* outUniformsSize);
 
+// Gives fragment shader outputs the color locations that printing them would,
+// without printing anything.
+extern void _mesa_assign_metal_output_locations(exec_list *instructions, PrintGlslMode mode);
+
 #endif /* IR_PRINT_GLSL_VISITOR_H */
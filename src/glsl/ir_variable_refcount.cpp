@@ -37,9 +37,10 @@
 
 ir_variable_refcount_visitor::ir_variable_refcount_visitor()
 {
-   this->mem_ctx = ralloc_context(NULL);
+   this->mem_ctx = ralloc_arena_context(NULL, NULL);
    this->ht = _mesa_hash_table_create(NULL, _mesa_key_pointer_equal);
    this->current_lhs = NULL;
+   this->count_delta = 1;
 }
 
 static void
@@ -61,6 +62,9 @@ ir_variable_refcount_entry::ir_variable_refcount_entry(ir_variable *var)
    this->var = var;
    assign = NULL;
    assigned_count = 0;
+   assigns = NULL;
+   assigns_capacity = 0;
+   call_assigned_count = 0;
    declaration = false;
    referenced_count = 0;
    referenced_count_noself = 0;
@@ -117,9 +121,9 @@ ir_variable_refcount_visitor::visit(ir_dereference_variable *ir)
    ir_variable *const var = ir->variable_referenced();
    ir_variable_refcount_entry *entry = this->get_variable_entry(var);
    if (entry) {
-      entry->referenced_count++;
+      entry->referenced_count += this->count_delta;
       if (this->in_assignee || var != this->current_lhs)
-         entry->referenced_count_noself++;
+         entry->referenced_count_noself += this->count_delta;
    }
    return visit_continue;
 }
@@ -147,14 +151,92 @@ ir_variable_refcount_visitor::visit_enter(ir_assignment *ir)
 ir_visitor_status
 ir_variable_refcount_visitor::visit_leave(ir_assignment *ir)
 {
-	this->current_lhs = NULL;
+   this->current_lhs = NULL;
    ir_variable_refcount_entry *entry;
    entry = this->get_variable_entry(ir->lhs->variable_referenced());
-   if (entry) {
-      entry->assigned_count++;
-      if (entry->assign == NULL)
-	 entry->assign = ir;
+   if (!entry)
+      return visit_continue;
+
+   if (this->count_delta > 0) {
+      if (entry->assigned_count == entry->assigns_capacity) {
+         entry->assigns_capacity = entry->assigns_capacity ? entry->assigns_capacity * 2 : 2;
+         entry->assigns = reralloc(this->mem_ctx, entry->assigns, ir_assignment *,
+                                   entry->assigns_capacity);
+      }
+      entry->assigns[entry->assigned_count++] = ir;
+   } else {
+      unsigned i = 0;
+      while (i < entry->assigned_count && entry->assigns[i] != ir)
+         i++;
+      assert(i < entry->assigned_count);
+      entry->assigned_count--;
+      memmove(entry->assigns + i, entry->assigns + i + 1,
+              (entry->assigned_count - i) * sizeof(entry->assigns[0]));
    }
+   entry->assign = entry->assigned_count ? entry->assigns[0] : NULL;
 
    return visit_continue;
 }
+
+
+ir_visitor_status
+ir_variable_refcount_visitor::visit_enter(ir_call *ir)
+{
+   foreach_two_lists(formal_node, &ir->callee->parameters,
+                     actual_node, &ir->actual_parameters) {
+      ir_variable *param = (ir_variable *) formal_node;
+      ir_rvalue *param_rval = (ir_rvalue *) actual_node;
+
+      if (param->data.mode == ir_var_function_out ||
+          param->data.mode == ir_var_function_inout) {
+         ir_variable *var = param_rval->variable_referenced();
+         if (var)
+            this->get_variable_entry(var)->call_assigned_count++;
+      }
+   }
+
+   if (ir->return_deref != NULL)
+      this->get_variable_entry(ir->return_deref->variable_referenced())->call_assigned_count++;
+
+   return visit_continue;
+}
+
+
+void
+ir_variable_refcount_visitor::remove_assignment(ir_assignment *ir)
+{
+   assert(this->current_lhs == NULL);
+   this->count_delta = -1;
+   ir->accept(this);
+   this->count_delta = 1;
+}
+
+
+void
+ir_variable_refcount_visitor::replace_rvalue(ir_rvalue *from, ir_rvalue *to,
+                                             ir_variable *lhs, bool in_assignee)
+{
+   assert(this->current_lhs == NULL);
+   this->current_lhs = lhs;
+   this->in_assignee = in_assignee;
+   this->count_delta = -1;
+   from->accept(this);
+   this->count_delta = 1;
+   to->accept(this);
+   this->in_assignee = false;
+   this->current_lhs = NULL;
+}
+
+
+void
+ir_variable_refcount_visitor::remove_variable(ir_variable *var)
+{
+   struct hash_entry *e = _mesa_hash_table_search(this->ht,
+						    _mesa_hash_pointer(var),
+						    var);
+   if (!e)
+      return;
+
+   delete (ir_variable_refcount_entry *) e->data;
+   _mesa_hash_table_remove(this->ht, e);
+}
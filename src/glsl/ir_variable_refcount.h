@@ -51,13 +51,23 @@ public:
    /** Number of times the variable is assigned. */
    unsigned assigned_count;
 
+   /** All assignments to the variable, in instruction stream order. */
+   ir_assignment **assigns;
+   unsigned assigns_capacity;
+
+   /**
+    * Number of times the variable is written by a call: as an out or inout
+    * parameter, or as the return value storage.
+    */
+   unsigned call_assigned_count;
+
    bool declaration; /* If the variable had a decl in the instruction stream */
 };
 
 class ir_variable_refcount_visitor : public ir_hierarchical_visitor {
 public:
    ir_variable_refcount_visitor(void);
-   ~ir_variable_refcount_visitor(void);
+   virtual ~ir_variable_refcount_visitor(void);
 
    virtual ir_visitor_status visit(ir_variable *);
    virtual ir_visitor_status visit(ir_dereference_variable *);
@@ -65,12 +75,33 @@ public:
    virtual ir_visitor_status visit_enter(ir_function_signature *);
    virtual ir_visitor_status visit_enter(ir_assignment *);
    virtual ir_visitor_status visit_leave(ir_assignment *);
+   virtual ir_visitor_status visit_enter(ir_call *);
 
    ir_variable_refcount_entry *get_variable_entry(ir_variable *var);
    ir_variable_refcount_entry *find_variable_entry(ir_variable *var);
 
+   /**
+    * Passes that keep using the counts after changing the instruction
+    * stream update them with these: an assignment that was counted has
+    * been removed, or the declaration of a variable has been removed.
+    */
+   void remove_assignment(ir_assignment *ir);
+   void remove_variable(ir_variable *var);
+
+   /**
+    * Keeps the counts up to date when \c from, that was counted, has been
+    * replaced by \c to, that is not counted, in an instruction assigning
+    * \c lhs (NULL if it is not an assignment). \c in_assignee tells if the
+    * replaced value is part of the assignment's left hand side.
+    */
+   void replace_rvalue(ir_rvalue *from, ir_rvalue *to, ir_variable *lhs,
+                       bool in_assignee);
+
    struct hash_table *ht;
    ir_variable* current_lhs;
 
+   /** 1 while counting, -1 while taking a removed assignment out of the counts. */
+   int count_delta;
+
    void *mem_ctx;
 };
@@ -317,7 +317,7 @@ lower_ubo_reference_visitor::handle_rvalue(ir_rvalue **rvalue)
             array_index = i2u(array_index);
 
 	 ir_constant *const_index =
-            array_index->constant_expression_value(NULL);
+            array_index->constant_expression_value(mem_ctx);
 	 if (const_index) {
 	    const_offset += array_stride * const_index->value.u[0];
 	 } else {
@@ -69,11 +69,11 @@ ir_vec_index_to_swizzle_visitor::convert_vector_extract_to_swizzle(ir_rvalue *ir
    if (expr == NULL || expr->operation != ir_binop_vector_extract)
       return ir;
 
-   ir_constant *const idx = expr->operands[1]->constant_expression_value();
+   void *ctx = ralloc_parent(ir);
+   ir_constant *const idx = expr->operands[1]->constant_expression_value(ctx);
    if (idx == NULL)
       return ir;
 
-   void *ctx = ralloc_parent(ir);
    this->progress = true;
 
    /* Page 40 of the GLSL 1.20 spec says:
@@ -247,8 +247,8 @@ ir_algebraic_visitor::reassociate_constant(ir_expression *ir1, int const_index,
       return false;
 
    ir_constant *ir2_const[2];
-   ir2_const[0] = ir2->operands[0]->constant_expression_value();
-   ir2_const[1] = ir2->operands[1]->constant_expression_value();
+   ir2_const[0] = ir2->operands[0]->constant_expression_value(mem_ctx);
+   ir2_const[1] = ir2->operands[1]->constant_expression_value(mem_ctx);
 
    if (ir2_const[0] && ir2_const[1])
       return false;
@@ -298,18 +298,18 @@ ir_algebraic_visitor::handle_expression(ir_expression *ir)
    ir_expression *op_expr[4] = {NULL, NULL, NULL, NULL};
    unsigned int i;
 
+   if (this->mem_ctx == NULL)
+      this->mem_ctx = ralloc_parent(ir);
+
    assert(ir->get_num_operands() <= 4);
    for (i = 0; i < ir->get_num_operands(); i++) {
       if (ir->operands[i]->type->is_matrix())
 	 return ir;
 
-      op_const[i] = ir->operands[i]->constant_expression_value();
+      op_const[i] = ir->operands[i]->constant_expression_value(mem_ctx);
       op_expr[i] = ir->operands[i]->as_expression();
    }
 
-   if (this->mem_ctx == NULL)
-      this->mem_ctx = ralloc_parent(ir);
-
    switch (ir->operation) {
    case ir_unop_bit_not:
       if (op_expr[0] && op_expr[0]->operation == ir_unop_bit_not)
@@ -84,7 +84,7 @@ ir_constant_folding_visitor::handle_rvalue(ir_rvalue **rvalue)
    if (swiz && !swiz->val->as_constant())
       return;
 
-   ir_constant *constant = (*rvalue)->constant_expression_value();
+   ir_constant *constant = (*rvalue)->constant_expression_value(ralloc_parent(*rvalue));
    if (constant) {
       *rvalue = constant;
       this->progress = true;
@@ -144,7 +144,7 @@ ir_constant_folding_visitor::visit_enter(ir_call *ir)
    }
 
    /* Next, see if the call can be replaced with an assignment of a constant */
-   ir_constant *const_val = ir->constant_expression_value();
+   ir_constant *const_val = ir->constant_expression_value(ralloc_parent(ir));
 
    if (const_val != NULL) {
       ir_assignment *assignment =
@@ -40,51 +40,99 @@
 #include "ir_basic_block.h"
 #include "ir_optimization.h"
 #include "glsl_types.h"
+#include "util/hash_table.h"
 
 namespace {
 
-class acp_entry : public exec_node
+class acp_entry;
+
+/** What is known about a vector or scalar variable. */
+class acp_var
+{
+public:
+   acp_var()
+   {
+      this->version = 0;
+      memset(this->written, 0, sizeof(this->written));
+      this->constants = NULL;
+   }
+
+   DECLARE_RALLOC_CXX_OPERATORS(acp_var)
+
+   /** Bumped whenever any channel of the variable is killed. */
+   unsigned version;
+
+   /** Version of the last kill of each channel. */
+   unsigned written[4];
+
+   /**
+    * The constants assigned to channels of the variable, newest first;
+    * only the channels that are still current are available.
+    */
+   acp_entry *constants;
+};
+
+class acp_entry
 {
 public:
-   acp_entry(ir_variable *var, unsigned write_mask, ir_constant *constant)
+   acp_entry(acp_var *var, unsigned write_mask, ir_constant *constant,
+             unsigned serial)
    {
       assert(var);
       assert(constant);
-      this->var = var;
       this->write_mask = write_mask;
       this->constant = constant;
       this->initial_values = write_mask;
+      this->version = var->version;
+      this->serial = serial;
+      this->next = NULL;
    }
 
-   acp_entry(const acp_entry *src)
+   DECLARE_RALLOC_CXX_OPERATORS(acp_entry)
+
+   /** Mask of the channels of the entry that are still current. */
+   unsigned live_mask(const acp_var *var) const
    {
-      this->var = src->var;
-      this->write_mask = src->write_mask;
-      this->constant = src->constant;
-      this->initial_values = src->initial_values;
+      unsigned mask = write_mask;
+      for (int i = 0; i < 4; i++) {
+	 if (var->written[i] > version)
+	    mask &= ~(1 << i);
+      }
+      return mask;
    }
 
-   ir_variable *var;
    ir_constant *constant;
    unsigned write_mask;
 
    /** Mask of values initially available in the constant. */
    unsigned initial_values;
-};
 
+   /** Version of the variable when the constant was assigned. */
+   unsigned version;
+
+   /** Order the entry was added in, see ir_constant_propagation_visitor::floor. */
+   unsigned serial;
 
-class kill_entry : public exec_node
+   /** Next older constant assigned to the same variable. */
+   acp_entry *next;
+};
+
+/** A change to acp_var::constants, undone when leaving the block it was made in. */
+class acp_undo
 {
 public:
-   kill_entry(ir_variable *var, unsigned write_mask)
+   acp_undo(acp_var *var, acp_undo *prev)
    {
-      assert(var);
       this->var = var;
-      this->write_mask = write_mask;
+      this->constants = var->constants;
+      this->prev = prev;
    }
 
-   ir_variable *var;
-   unsigned write_mask;
+   DECLARE_RALLOC_CXX_OPERATORS(acp_undo)
+
+   acp_var *var;
+   acp_entry *constants;
+   acp_undo *prev;
 };
 
 class ir_constant_propagation_visitor : public ir_rvalue_visitor {
@@ -93,9 +141,11 @@ public:
    {
       progress = false;
       killed_all = false;
-      mem_ctx = ralloc_context(0);
-      this->acp = new(mem_ctx) exec_list;
-      this->kills = new(mem_ctx) exec_list;
+      mem_ctx = ralloc_arena_context(NULL, NULL);
+      this->vars = _mesa_hash_table_create(mem_ctx, _mesa_key_pointer_equal);
+      this->undo = NULL;
+      this->serial = 0;
+      this->floor = 0;
    }
    ~ir_constant_propagation_visitor()
    {
@@ -111,17 +161,30 @@ public:
 
    void add_constant(ir_assignment *ir);
    void kill(ir_variable *ir, unsigned write_mask);
-   void handle_if_block(exec_list *instructions);
+   void kill_all();
+   acp_var *get_var(ir_variable *var, bool create);
+   acp_entry *prune(acp_entry *constants, const acp_var *var);
+   void handle_block(exec_list *instructions, bool inherit_acp);
    void handle_rvalue(ir_rvalue **rvalue);
 
-   /** List of acp_entry: The available constants to propagate */
-   exec_list *acp;
+   /**
+    * acp_var by ir_variable.  The available constants to propagate are the
+    * current channels of the acp_var::constants entries; a kill just bumps
+    * versions, so it costs the same however many constants are available.
+    */
+   struct hash_table *vars;
+
+   /** Changes to undo when leaving the current block. */
+   acp_undo *undo;
+
+   /** Serial of the last entry added. */
+   unsigned serial;
 
    /**
-    * List of kill_entry: The masks of variables whose values were
-    * killed in this block.
+    * Entries added before this serial are not available in the current
+    * block (it is a loop or function body, or everything was killed).
     */
-   exec_list *kills;
+   unsigned floor;
 
    bool progress;
 
@@ -131,6 +194,22 @@ public:
 };
 
 
+acp_var *
+ir_constant_propagation_visitor::get_var(ir_variable *var, bool create)
+{
+   const uint32_t hash = _mesa_hash_pointer(var);
+   struct hash_entry *e = _mesa_hash_table_search(this->vars, hash, var);
+
+   if (e)
+      return (acp_var *) e->data;
+   if (!create)
+      return NULL;
+
+   acp_var *state = new(this->mem_ctx) acp_var();
+   _mesa_hash_table_insert(this->vars, hash, var, state);
+   return state;
+}
+
 void
 ir_constant_propagation_visitor::handle_rvalue(ir_rvalue **rvalue)
 {
@@ -153,6 +232,13 @@ ir_constant_propagation_visitor::handle_rvalue(ir_rvalue **rvalue)
 	 return;
    }
 
+   if (this->serial < this->floor)
+      return;
+
+   acp_var *state = get_var(deref->var, false);
+   if (!state)
+      return;
+
    ir_constant_data data;
    memset(&data, 0, sizeof(data));
 
@@ -172,8 +258,10 @@ ir_constant_propagation_visitor::handle_rvalue(ir_rvalue **rvalue)
 	 channel = i;
       }
 
-      foreach_in_list(acp_entry, entry, this->acp) {
-	 if (entry->var == deref->var && entry->write_mask & (1 << channel)) {
+      /* The current channels of the entries never overlap. */
+      for (acp_entry *entry = state->constants;
+	   entry && entry->serial >= this->floor; entry = entry->next) {
+	 if (entry->live_mask(state) & (1 << channel)) {
 	    found = entry;
 	    break;
 	 }
@@ -220,18 +308,12 @@ ir_constant_propagation_visitor::visit_enter(ir_function_signature *ir)
     * block.  Any instructions at global scope will be shuffled into
     * main() at link time, so they're irrelevant to us.
     */
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
+   const unsigned orig_floor = this->floor;
    bool orig_killed_all = this->killed_all;
 
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
-   this->killed_all = false;
-
-   visit_list_elements(this, &ir->body);
+   handle_block(&ir->body, false);
 
-   this->kills = orig_kills;
-   this->acp = orig_acp;
+   this->floor = orig_floor;
    this->killed_all = orig_killed_all;
 
    return visit_continue_with_parent;
@@ -300,43 +382,41 @@ ir_constant_propagation_visitor::visit_enter(ir_call *ir)
 	* they are side effect free.
     */
    if (!ir->callee->is_builtin()) {
-      acp->make_empty();
-      this->killed_all = true;
+      kill_all();
    }
 
    return visit_continue_with_parent;
 }
 
+/**
+ * Visits a nested block, which starts with the constants available here
+ * when inherit_acp is set, and with none otherwise.  The kills of the block
+ * stay in effect after it; the constants added in it are removed.
+ */
 void
-ir_constant_propagation_visitor::handle_if_block(exec_list *instructions)
+ir_constant_propagation_visitor::handle_block(exec_list *instructions,
+					      bool inherit_acp)
 {
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
+   acp_undo *orig_undo = this->undo;
+   const unsigned orig_floor = this->floor;
    bool orig_killed_all = this->killed_all;
 
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
    this->killed_all = false;
-
-   /* Populate the initial acp with a constant of the original */
-   foreach_in_list(acp_entry, a, orig_acp) {
-      this->acp->push_tail(new(this->mem_ctx) acp_entry(a));
-   }
+   if (!inherit_acp)
+      this->floor = this->serial + 1;
 
    visit_list_elements(this, instructions);
 
-   if (this->killed_all) {
-      orig_acp->make_empty();
+   while (this->undo != orig_undo) {
+      this->undo->var->constants = this->undo->constants;
+      this->undo = this->undo->prev;
    }
 
-   exec_list *new_kills = this->kills;
-   this->kills = orig_kills;
-   this->acp = orig_acp;
+   if (this->killed_all)
+      this->floor = this->serial + 1;
+   else
+      this->floor = orig_floor;
    this->killed_all = this->killed_all || orig_killed_all;
-
-   foreach_in_list(kill_entry, k, new_kills) {
-      kill(k->var, k->write_mask);
-   }
 }
 
 ir_visitor_status
@@ -345,42 +425,21 @@ ir_constant_propagation_visitor::visit_enter(ir_if *ir)
    ir->condition->accept(this);
    handle_rvalue(&ir->condition);
 
-   handle_if_block(&ir->then_instructions);
-   handle_if_block(&ir->else_instructions);
+   handle_block(&ir->then_instructions, true);
+   handle_block(&ir->else_instructions, true);
 
-   /* handle_if_block() already descended into the children. */
+   /* handle_block() already descended into the children. */
    return visit_continue_with_parent;
 }
 
 ir_visitor_status
 ir_constant_propagation_visitor::visit_enter(ir_loop *ir)
 {
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
-   bool orig_killed_all = this->killed_all;
-
    /* FINISHME: For now, the initial acp for loops is totally empty.
     * We could go through once, then go through again with the acp
     * cloned minus the killed entries after the first run through.
     */
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
-   this->killed_all = false;
-
-   visit_list_elements(this, &ir->body_instructions);
-
-   if (this->killed_all) {
-      orig_acp->make_empty();
-   }
-
-   exec_list *new_kills = this->kills;
-   this->kills = orig_kills;
-   this->acp = orig_acp;
-   this->killed_all = this->killed_all || orig_killed_all;
-
-   foreach_in_list(kill_entry, k, new_kills) {
-      kill(k->var, k->write_mask);
-   }
+   handle_block(&ir->body_instructions, false);
 
    /* already descended into the children. */
    return visit_continue_with_parent;
@@ -395,26 +454,43 @@ ir_constant_propagation_visitor::kill(ir_variable *var, unsigned write_mask)
    if (!var->type->is_vector() && !var->type->is_scalar())
       return;
 
-   /* Remove any entries currently in the ACP for this kill. */
-   foreach_in_list_safe(acp_entry, entry, this->acp) {
-      if (entry->var == var) {
-	 entry->write_mask &= ~write_mask;
-	 if (entry->write_mask == 0)
-	    entry->remove();
-      }
-   }
+   /* Remove the channels in write_mask from the ACP entries of var. */
+   acp_var *state = get_var(var, true);
 
-   /* Add this writemask of the variable to the list of killed
-    * variables in this block.
-    */
-   foreach_in_list(kill_entry, entry, this->kills) {
-      if (entry->var == var) {
-	 entry->write_mask |= write_mask;
-	 return;
-      }
+   state->version++;
+   for (int i = 0; i < 4; i++) {
+      if (write_mask & (1 << i))
+	 state->written[i] = state->version;
    }
-   /* Not already in the list.  Make new entry. */
-   this->kills->push_tail(new(this->mem_ctx) kill_entry(var, write_mask));
+}
+
+void
+ir_constant_propagation_visitor::kill_all()
+{
+   this->floor = this->serial + 1;
+   this->killed_all = true;
+}
+
+/**
+ * Returns the list of constants without the entries that were killed
+ * entirely, sharing the unchanged tail of the list.
+ */
+acp_entry *
+ir_constant_propagation_visitor::prune(acp_entry *constants,
+				       const acp_var *var)
+{
+   if (!constants)
+      return NULL;
+
+   acp_entry *next = prune(constants->next, var);
+   if (!constants->live_mask(var))
+      return next;
+   if (next == constants->next)
+      return constants;
+
+   acp_entry *entry = new(this->mem_ctx) acp_entry(*constants);
+   entry->next = next;
+   return entry;
 }
 
 /**
@@ -444,8 +520,14 @@ ir_constant_propagation_visitor::add_constant(ir_assignment *ir)
    if (!deref->var->type->is_vector() && !deref->var->type->is_scalar())
       return;
 
-   entry = new(this->mem_ctx) acp_entry(deref->var, ir->write_mask, constant);
-   this->acp->push_tail(entry);
+   acp_var *state = get_var(deref->var, true);
+
+   entry = new(this->mem_ctx) acp_entry(state, ir->write_mask, constant,
+					++this->serial);
+   entry->next = prune(state->constants, state);
+
+   this->undo = new(this->mem_ctx) acp_undo(state, this->undo);
+   state->constants = entry;
 }
 
 } /* unnamed namespace */
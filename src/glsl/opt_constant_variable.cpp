@@ -35,7 +35,9 @@
 #include "ir.h"
 #include "ir_visitor.h"
 #include "ir_optimization.h"
+#include "ir_variable_refcount.h"
 #include "glsl_types.h"
+#include "util/hash_table.h"
 
 namespace {
 
@@ -116,7 +118,7 @@ ir_constant_variable_visitor::visit_enter(ir_assignment *ir)
    if (!var)
       return visit_continue;
 
-   constval = ir->rhs->constant_expression_value();
+   constval = ir->rhs->constant_expression_value(ralloc_parent(ir));
    if (!constval)
       return visit_continue;
 
@@ -178,12 +180,51 @@ ir_constant_variable_visitor::visit_enter(ir_function_signature *ir)
 }
 
 
+/**
+ * Finds the variables assigned once with a constant from reference counts of
+ * the whole instruction stream, instead of walking it.
+ */
+static bool
+do_constant_variable_refs(ir_variable_refcount_visitor *refs)
+{
+   bool progress = false;
+
+   struct hash_entry *e;
+   hash_table_foreach(refs->ht, e) {
+      ir_variable_refcount_entry *entry = (ir_variable_refcount_entry *)e->data;
+
+      if (!entry->declaration ||
+          entry->assigned_count + entry->call_assigned_count != 1 ||
+          !entry->assign || entry->var->constant_value)
+         continue;
+
+      ir_assignment *ir = entry->assign;
+      if (ir->condition || !ir->whole_variable_written())
+         continue;
+
+      ir_constant *constval = ir->rhs->constant_expression_value(ralloc_parent(ir));
+      if (!constval)
+         continue;
+
+      entry->var->constant_value = constval;
+      progress = true;
+   }
+
+   return progress;
+}
+
 /**
  * Does a copy propagation pass on the code present in the instruction stream.
+ *
+ * \param refs  Reference counts of \c instructions to use instead of walking
+ *               them, or NULL.
  */
 bool
-do_constant_variable(exec_list *instructions)
+do_constant_variable(exec_list *instructions, ir_variable_refcount_visitor *refs)
 {
+   if (refs)
+      return do_constant_variable_refs(refs);
+
    bool progress = false;
    ir_constant_variable_visitor v;
 
@@ -37,35 +37,79 @@
 #include "ir_basic_block.h"
 #include "ir_optimization.h"
 #include "glsl_types.h"
+#include "util/hash_table.h"
 
 namespace {
 
-class acp_entry : public exec_node
+class acp_entry;
+
+/** What is known about a variable. */
+class acp_var
+{
+public:
+   acp_var()
+   {
+      this->version = 0;
+      this->copy = NULL;
+   }
+
+   DECLARE_RALLOC_CXX_OPERATORS(acp_var)
+
+   /** Bumped whenever the variable is killed. */
+   unsigned version;
+
+   /** The last copy into the variable; only available if still current. */
+   acp_entry *copy;
+};
+
+class acp_entry
 {
 public:
-   acp_entry(ir_variable *lhs, ir_variable *rhs)
+   acp_entry(ir_variable *rhs, acp_var *lhs_state, acp_var *rhs_state,
+             unsigned serial)
    {
-      assert(lhs);
       assert(rhs);
-      this->lhs = lhs;
       this->rhs = rhs;
+      this->lhs_state = lhs_state;
+      this->rhs_state = rhs_state;
+      this->lhs_version = lhs_state->version;
+      this->rhs_version = rhs_state->version;
+      this->serial = serial;
    }
 
-   ir_variable *lhs;
+   DECLARE_RALLOC_CXX_OPERATORS(acp_entry)
+
    ir_variable *rhs;
-};
+   acp_var *lhs_state;
+   acp_var *rhs_state;
 
+   /**
+    * Versions of the variables when the copy was made: a kill of either
+    * one removes the entry from the ACP.
+    */
+   unsigned lhs_version;
+   unsigned rhs_version;
+
+   /** Order the entry was added in, see ir_copy_propagation_visitor::floor. */
+   unsigned serial;
+};
 
-class kill_entry : public exec_node
+/** A change to acp_var::copy, undone when leaving the block it was made in. */
+class acp_undo
 {
 public:
-   kill_entry(ir_variable *var)
+   acp_undo(acp_var *var, acp_undo *prev)
    {
-      assert(var);
       this->var = var;
+      this->copy = var->copy;
+      this->prev = prev;
    }
 
-   ir_variable *var;
+   DECLARE_RALLOC_CXX_OPERATORS(acp_undo)
+
+   acp_var *var;
+   acp_entry *copy;
+   acp_undo *prev;
 };
 
 class ir_copy_propagation_visitor : public ir_hierarchical_visitor {
@@ -73,9 +117,12 @@ public:
    ir_copy_propagation_visitor()
    {
       progress = false;
-      mem_ctx = ralloc_context(0);
-      this->acp = new(mem_ctx) exec_list;
-      this->kills = new(mem_ctx) exec_list;
+      killed_all = false;
+      mem_ctx = ralloc_arena_context(NULL, NULL);
+      this->vars = _mesa_hash_table_create(mem_ctx, _mesa_key_pointer_equal);
+      this->undo = NULL;
+      this->serial = 0;
+      this->floor = 0;
    }
    ~ir_copy_propagation_visitor()
    {
@@ -92,15 +139,29 @@ public:
 
    void add_copy(ir_assignment *ir);
    void kill(ir_variable *ir);
-   void handle_if_block(exec_list *instructions);
+   void kill_all();
+   acp_var *get_var(ir_variable *var, bool create);
+   acp_entry *find_copy(ir_variable *lhs);
+   void handle_block(exec_list *instructions, bool inherit_acp);
+
+   /**
+    * acp_var by ir_variable.  The available copies to propagate are the
+    * current acp_var::copy entries; a kill just bumps the version of the
+    * variable, so it costs the same however many copies are available.
+    */
+   struct hash_table *vars;
+
+   /** Changes to undo when leaving the current block. */
+   acp_undo *undo;
+
+   /** Serial of the last entry added. */
+   unsigned serial;
 
-   /** List of acp_entry: The available copies to propagate */
-   exec_list *acp;
    /**
-    * List of kill_entry: The variables whose values were killed in this
-    * block.
+    * Entries added before this serial are not available in the current
+    * block (it is a loop or function body, or everything was killed).
     */
-   exec_list *kills;
+   unsigned floor;
 
    bool progress;
 
@@ -111,6 +172,42 @@ public:
 
 } /* unnamed namespace */
 
+acp_var *
+ir_copy_propagation_visitor::get_var(ir_variable *var, bool create)
+{
+   const uint32_t hash = _mesa_hash_pointer(var);
+   struct hash_entry *e = _mesa_hash_table_search(this->vars, hash, var);
+
+   if (e)
+      return (acp_var *) e->data;
+   if (!create)
+      return NULL;
+
+   acp_var *state = new(this->mem_ctx) acp_var();
+   _mesa_hash_table_insert(this->vars, hash, var, state);
+   return state;
+}
+
+/** Returns the available copy into lhs, if any. */
+acp_entry *
+ir_copy_propagation_visitor::find_copy(ir_variable *lhs)
+{
+   if (this->serial < this->floor)
+      return NULL;
+
+   acp_var *state = get_var(lhs, false);
+   if (!state || !state->copy)
+      return NULL;
+
+   acp_entry *entry = state->copy;
+   if (entry->serial < this->floor ||
+       entry->lhs_version != state->version ||
+       entry->rhs_version != entry->rhs_state->version)
+      return NULL;
+
+   return entry;
+}
+
 ir_visitor_status
 ir_copy_propagation_visitor::visit_enter(ir_function_signature *ir)
 {
@@ -118,18 +215,12 @@ ir_copy_propagation_visitor::visit_enter(ir_function_signature *ir)
     * block.  Any instructions at global scope will be shuffled into
     * main() at link time, so they're irrelevant to us.
     */
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
+   const unsigned orig_floor = this->floor;
    bool orig_killed_all = this->killed_all;
 
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
-   this->killed_all = false;
-
-   visit_list_elements(this, &ir->body);
+   handle_block(&ir->body, false);
 
-   this->kills = orig_kills;
-   this->acp = orig_acp;
+   this->floor = orig_floor;
    this->killed_all = orig_killed_all;
 
    return visit_continue_with_parent;
@@ -165,14 +256,10 @@ ir_copy_propagation_visitor::visit(ir_dereference_variable *ir)
    if (this->in_assignee)
       return visit_continue;
 
-   ir_variable *var = ir->var;
-
-   foreach_in_list(acp_entry, entry, this->acp) {
-      if (var == entry->lhs) {
-	 ir->var = entry->rhs;
-	 this->progress = true;
-	 break;
-      }
+   acp_entry *entry = find_copy(ir->var);
+   if (entry) {
+      ir->var = entry->rhs;
+      this->progress = true;
    }
 
    return visit_continue;
@@ -198,43 +285,41 @@ ir_copy_propagation_visitor::visit_enter(ir_call *ir)
 	* For any built-in functions, do not do this; they are side effect-free.
     */
    if (!ir->callee->is_builtin()) {
-      acp->make_empty();
-      this->killed_all = true;
+      kill_all();
    }
 
    return visit_continue_with_parent;
 }
 
+/**
+ * Visits a nested block, which starts with the copies available here when
+ * inherit_acp is set, and with none otherwise.  The kills of the block stay
+ * in effect after it; the copies added in it are removed.
+ */
 void
-ir_copy_propagation_visitor::handle_if_block(exec_list *instructions)
+ir_copy_propagation_visitor::handle_block(exec_list *instructions,
+                                          bool inherit_acp)
 {
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
+   acp_undo *orig_undo = this->undo;
+   const unsigned orig_floor = this->floor;
    bool orig_killed_all = this->killed_all;
 
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
    this->killed_all = false;
-
-   /* Populate the initial acp with a copy of the original */
-   foreach_in_list(acp_entry, a, orig_acp) {
-      this->acp->push_tail(new(this->mem_ctx) acp_entry(a->lhs, a->rhs));
-   }
+   if (!inherit_acp)
+      this->floor = this->serial + 1;
 
    visit_list_elements(this, instructions);
 
-   if (this->killed_all) {
-      orig_acp->make_empty();
+   while (this->undo != orig_undo) {
+      this->undo->var->copy = this->undo->copy;
+      this->undo = this->undo->prev;
    }
 
-   exec_list *new_kills = this->kills;
-   this->kills = orig_kills;
-   this->acp = orig_acp;
+   if (this->killed_all)
+      this->floor = this->serial + 1;
+   else
+      this->floor = orig_floor;
    this->killed_all = this->killed_all || orig_killed_all;
-
-   foreach_in_list(kill_entry, k, new_kills) {
-      kill(k->var);
-   }
 }
 
 ir_visitor_status
@@ -242,42 +327,21 @@ ir_copy_propagation_visitor::visit_enter(ir_if *ir)
 {
    ir->condition->accept(this);
 
-   handle_if_block(&ir->then_instructions);
-   handle_if_block(&ir->else_instructions);
+   handle_block(&ir->then_instructions, true);
+   handle_block(&ir->else_instructions, true);
 
-   /* handle_if_block() already descended into the children. */
+   /* handle_block() already descended into the children. */
    return visit_continue_with_parent;
 }
 
 ir_visitor_status
 ir_copy_propagation_visitor::visit_enter(ir_loop *ir)
 {
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
-   bool orig_killed_all = this->killed_all;
-
    /* FINISHME: For now, the initial acp for loops is totally empty.
     * We could go through once, then go through again with the acp
     * cloned minus the killed entries after the first run through.
     */
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
-   this->killed_all = false;
-
-   visit_list_elements(this, &ir->body_instructions);
-
-   if (this->killed_all) {
-      orig_acp->make_empty();
-   }
-
-   exec_list *new_kills = this->kills;
-   this->kills = orig_kills;
-   this->acp = orig_acp;
-   this->killed_all = this->killed_all || orig_killed_all;
-
-   foreach_in_list(kill_entry, k, new_kills) {
-      kill(k->var);
-   }
+   handle_block(&ir->body_instructions, false);
 
    /* already descended into the children. */
    return visit_continue_with_parent;
@@ -288,16 +352,17 @@ ir_copy_propagation_visitor::kill(ir_variable *var)
 {
    assert(var != NULL);
 
-   /* Remove any entries currently in the ACP for this kill. */
-   foreach_in_list_safe(acp_entry, entry, acp) {
-      if (entry->lhs == var || entry->rhs == var) {
-	 entry->remove();
-      }
-   }
-
-   /* Add the LHS variable to the list of killed variables in this block.
+   /* Removes any entries currently in the ACP for this kill: the copy into
+    * var, and the copies from var.
     */
-   this->kills->push_tail(new(this->mem_ctx) kill_entry(var));
+   get_var(var, true)->version++;
+}
+
+void
+ir_copy_propagation_visitor::kill_all()
+{
+   this->floor = this->serial + 1;
+   this->killed_all = true;
 }
 
 /**
@@ -307,8 +372,6 @@ ir_copy_propagation_visitor::kill(ir_variable *var)
 void
 ir_copy_propagation_visitor::add_copy(ir_assignment *ir)
 {
-   acp_entry *entry;
-
    if (ir->condition)
       return;
 
@@ -329,8 +392,11 @@ ir_copy_propagation_visitor::add_copy(ir_assignment *ir)
 		  // it might eventually leave our rvalue node with a different precision
 		  // than rhs. Which would trip up platforms that need strict casts (like Metal).
 		  if (lhs_var->data.precision == rhs_var->data.precision || lhs_var->data.precision==glsl_precision_undefined) {
-			entry = new(this->mem_ctx) acp_entry(lhs_var, rhs_var);
-			this->acp->push_tail(entry);
+			acp_var *lhs = get_var(lhs_var, true);
+			acp_var *rhs = get_var(rhs_var, true);
+			this->undo = new(this->mem_ctx) acp_undo(lhs, this->undo);
+			lhs->copy = new(this->mem_ctx) acp_entry(rhs_var, lhs, rhs,
+								 ++this->serial);
 		  }
       }
    }
@@ -46,48 +46,108 @@
 #include "ir_basic_block.h"
 #include "ir_optimization.h"
 #include "glsl_types.h"
+#include "util/hash_table.h"
 
 static bool debug = false;
 
 namespace {
 
-class acp_entry : public exec_node
+class acp_entry;
+
+/** What is known about a vector or scalar variable. */
+class acp_var
+{
+public:
+   acp_var()
+   {
+      this->version = 0;
+      memset(this->written, 0, sizeof(this->written));
+      this->copies = NULL;
+   }
+
+   DECLARE_RALLOC_CXX_OPERATORS(acp_var)
+
+   /** Bumped whenever any channel of the variable is killed. */
+   unsigned version;
+
+   /** Version of the last kill of each channel. */
+   unsigned written[4];
+
+   /**
+    * The copies into channels of the variable, newest first; only the
+    * channels that are still current are available.
+    */
+   acp_entry *copies;
+};
+
+class acp_entry
 {
 public:
-   acp_entry(ir_variable *lhs, ir_variable *rhs, int write_mask, int swizzle[4])
+   acp_entry(ir_variable *rhs, acp_var *lhs_state, acp_var *rhs_state,
+             int write_mask, int swizzle[4], unsigned serial)
    {
-      this->lhs = lhs;
       this->rhs = rhs;
+      this->rhs_state = rhs_state;
+      this->lhs_version = lhs_state->version;
+      this->rhs_version = rhs_state->version;
       this->write_mask = write_mask;
       memcpy(this->swizzle, swizzle, sizeof(this->swizzle));
+      this->serial = serial;
+      this->next = NULL;
    }
 
-   acp_entry(acp_entry *a)
+   DECLARE_RALLOC_CXX_OPERATORS(acp_entry)
+
+   /** Mask of the channels of the entry that are still current. */
+   unsigned live_mask(const acp_var *lhs_state) const
    {
-      this->lhs = a->lhs;
-      this->rhs = a->rhs;
-      this->write_mask = a->write_mask;
-      memcpy(this->swizzle, a->swizzle, sizeof(this->swizzle));
+      if (rhs_state->version != rhs_version)
+	 return 0;
+
+      unsigned mask = write_mask;
+      for (int i = 0; i < 4; i++) {
+	 if (lhs_state->written[i] > lhs_version)
+	    mask &= ~(1 << i);
+      }
+      return mask;
    }
 
-   ir_variable *lhs;
    ir_variable *rhs;
+   acp_var *rhs_state;
+
+   /**
+    * Versions of the variables when the copy was made: a kill of a copied
+    * channel removes that channel, a kill of the source the whole entry.
+    */
+   unsigned lhs_version;
+   unsigned rhs_version;
+
    unsigned int write_mask;
    int swizzle[4];
-};
 
+   /** Order the entry was added in, see ir_copy_propagation_elements_visitor::floor. */
+   unsigned serial;
 
-class kill_entry : public exec_node
+   /** Next older copy into the same variable. */
+   acp_entry *next;
+};
+
+/** A change to acp_var::copies, undone when leaving the block it was made in. */
+class acp_undo
 {
 public:
-   kill_entry(ir_variable *var, int write_mask)
+   acp_undo(acp_var *var, acp_undo *prev)
    {
       this->var = var;
-      this->write_mask = write_mask;
+      this->copies = var->copies;
+      this->prev = prev;
    }
 
-   ir_variable *var;
-   unsigned int write_mask;
+   DECLARE_RALLOC_CXX_OPERATORS(acp_undo)
+
+   acp_var *var;
+   acp_entry *copies;
+   acp_undo *prev;
 };
 
 class ir_copy_propagation_elements_visitor : public ir_rvalue_visitor {
@@ -96,10 +156,12 @@ public:
    {
       this->progress = false;
       this->killed_all = false;
-      this->mem_ctx = ralloc_context(NULL);
+      this->mem_ctx = ralloc_arena_context(NULL, NULL);
       this->shader_mem_ctx = NULL;
-      this->acp = new(mem_ctx) exec_list;
-      this->kills = new(mem_ctx) exec_list;
+      this->vars = _mesa_hash_table_create(mem_ctx, _mesa_key_pointer_equal);
+      this->undo = NULL;
+      this->serial = 0;
+      this->floor = 0;
    }
    ~ir_copy_propagation_elements_visitor()
    {
@@ -116,16 +178,30 @@ public:
    void handle_rvalue(ir_rvalue **rvalue);
 
    void add_copy(ir_assignment *ir);
-   void kill(kill_entry *k);
-   void handle_if_block(exec_list *instructions);
+   void kill(ir_variable *var, unsigned write_mask);
+   void kill_all();
+   acp_var *get_var(ir_variable *var, bool create);
+   acp_entry *prune(acp_entry *copies, const acp_var *lhs_state);
+   void handle_block(exec_list *instructions, bool inherit_acp);
+
+   /**
+    * acp_var by ir_variable.  The available copies to propagate are the
+    * current channels of the acp_var::copies entries; a kill just bumps
+    * versions, so it costs the same however many copies are available.
+    */
+   struct hash_table *vars;
+
+   /** Changes to undo when leaving the current block. */
+   acp_undo *undo;
+
+   /** Serial of the last entry added. */
+   unsigned serial;
 
-   /** List of acp_entry: The available copies to propagate */
-   exec_list *acp;
    /**
-    * List of kill_entry: The variables whose values were killed in this
-    * block.
+    * Entries added before this serial are not available in the current
+    * block (it is a loop or function body, or everything was killed).
     */
-   exec_list *kills;
+   unsigned floor;
 
    bool progress;
 
@@ -139,6 +215,22 @@ public:
 
 } /* unnamed namespace */
 
+acp_var *
+ir_copy_propagation_elements_visitor::get_var(ir_variable *var, bool create)
+{
+   const uint32_t hash = _mesa_hash_pointer(var);
+   struct hash_entry *e = _mesa_hash_table_search(this->vars, hash, var);
+
+   if (e)
+      return (acp_var *) e->data;
+   if (!create)
+      return NULL;
+
+   acp_var *state = new(this->mem_ctx) acp_var();
+   _mesa_hash_table_insert(this->vars, hash, var, state);
+   return state;
+}
+
 ir_visitor_status
 ir_copy_propagation_elements_visitor::visit_enter(ir_function_signature *ir)
 {
@@ -146,18 +238,12 @@ ir_copy_propagation_elements_visitor::visit_enter(ir_function_signature *ir)
     * block.  Any instructions at global scope will be shuffled into
     * main() at link time, so they're irrelevant to us.
     */
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
+   const unsigned orig_floor = this->floor;
    bool orig_killed_all = this->killed_all;
 
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
-   this->killed_all = false;
+   handle_block(&ir->body, false);
 
-   visit_list_elements(this, &ir->body);
-
-   this->kills = orig_kills;
-   this->acp = orig_acp;
+   this->floor = orig_floor;
    this->killed_all = orig_killed_all;
 
    return visit_continue_with_parent;
@@ -170,14 +256,10 @@ ir_copy_propagation_elements_visitor::visit_leave(ir_assignment *ir)
    ir_variable *var = ir->lhs->variable_referenced();
 
    if (var->type->is_scalar() || var->type->is_vector()) {
-      kill_entry *k;
-
       if (lhs)
-	 k = new(mem_ctx) kill_entry(var, ir->write_mask);
+	 kill(var, ir->write_mask);
       else
-	 k = new(mem_ctx) kill_entry(var, ~0);
-
-      kill(k);
+	 kill(var, ~0);
    }
 
    add_copy(ir);
@@ -240,21 +322,28 @@ ir_copy_propagation_elements_visitor::handle_rvalue(ir_rvalue **ir)
    if (this->in_assignee)
       return;
 
+   if (this->serial < this->floor)
+      return;
+
    ir_variable *var = deref_var->var;
+   acp_var *state = get_var(var, false);
+   if (!state)
+      return;
 
    /* Try to find ACP entries covering swizzle_chan[], hoping they're
-    * the same source variable.
+    * the same source variable.  The current channels of the entries
+    * never overlap, so their order does not matter.
     */
-   foreach_in_list(acp_entry, entry, this->acp) {
-      if (var == entry->lhs) {
-	 for (int c = 0; c < chans; c++) {
-	    if (entry->write_mask & (1 << swizzle_chan[c])) {
-	       source[c] = entry->rhs;
-	       source_chan[c] = entry->swizzle[swizzle_chan[c]];
-
-               if (source_chan[c] != swizzle_chan[c])
-                  noop_swizzle = false;
-	    }
+   for (acp_entry *entry = state->copies;
+	entry && entry->serial >= this->floor; entry = entry->next) {
+      const unsigned live_mask = entry->live_mask(state);
+      for (int c = 0; c < chans; c++) {
+	 if (live_mask & (1 << swizzle_chan[c])) {
+	    source[c] = entry->rhs;
+	    source_chan[c] = entry->swizzle[swizzle_chan[c]];
+
+	    if (source_chan[c] != swizzle_chan[c])
+	       noop_swizzle = false;
 	 }
       }
    }
@@ -317,46 +406,41 @@ ir_copy_propagation_elements_visitor::visit_enter(ir_call *ir)
 	* they are side effect free.
     */
    if (!ir->callee->is_builtin()) {
-      acp->make_empty();
-      this->killed_all = true;
+      kill_all();
    }
 
    return visit_continue_with_parent;
 }
 
+/**
+ * Visits a nested block, which starts with the copies available here when
+ * inherit_acp is set, and with none otherwise.  The kills of the block stay
+ * in effect after it; the copies added in it are removed.
+ */
 void
-ir_copy_propagation_elements_visitor::handle_if_block(exec_list *instructions)
+ir_copy_propagation_elements_visitor::handle_block(exec_list *instructions,
+						   bool inherit_acp)
 {
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
+   acp_undo *orig_undo = this->undo;
+   const unsigned orig_floor = this->floor;
    bool orig_killed_all = this->killed_all;
 
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
    this->killed_all = false;
-
-   /* Populate the initial acp with a copy of the original */
-   foreach_in_list(acp_entry, a, orig_acp) {
-      this->acp->push_tail(new(this->mem_ctx) acp_entry(a));
-   }
+   if (!inherit_acp)
+      this->floor = this->serial + 1;
 
    visit_list_elements(this, instructions);
 
-   if (this->killed_all) {
-      orig_acp->make_empty();
+   while (this->undo != orig_undo) {
+      this->undo->var->copies = this->undo->copies;
+      this->undo = this->undo->prev;
    }
 
-   exec_list *new_kills = this->kills;
-   this->kills = orig_kills;
-   this->acp = orig_acp;
+   if (this->killed_all)
+      this->floor = this->serial + 1;
+   else
+      this->floor = orig_floor;
    this->killed_all = this->killed_all || orig_killed_all;
-
-   /* Move the new kills into the parent block's list, removing them
-    * from the parent's ACP list in the process.
-    */
-   foreach_in_list_safe(kill_entry, k, new_kills) {
-      kill(k);
-   }
 }
 
 ir_visitor_status
@@ -364,69 +448,70 @@ ir_copy_propagation_elements_visitor::visit_enter(ir_if *ir)
 {
    ir->condition->accept(this);
 
-   handle_if_block(&ir->then_instructions);
-   handle_if_block(&ir->else_instructions);
+   handle_block(&ir->then_instructions, true);
+   handle_block(&ir->else_instructions, true);
 
-   /* handle_if_block() already descended into the children. */
+   /* handle_block() already descended into the children. */
    return visit_continue_with_parent;
 }
 
 ir_visitor_status
 ir_copy_propagation_elements_visitor::visit_enter(ir_loop *ir)
 {
-   exec_list *orig_acp = this->acp;
-   exec_list *orig_kills = this->kills;
-   bool orig_killed_all = this->killed_all;
-
    /* FINISHME: For now, the initial acp for loops is totally empty.
     * We could go through once, then go through again with the acp
     * cloned minus the killed entries after the first run through.
     */
-   this->acp = new(mem_ctx) exec_list;
-   this->kills = new(mem_ctx) exec_list;
-   this->killed_all = false;
-
-   visit_list_elements(this, &ir->body_instructions);
-
-   if (this->killed_all) {
-      orig_acp->make_empty();
-   }
-
-   exec_list *new_kills = this->kills;
-   this->kills = orig_kills;
-   this->acp = orig_acp;
-   this->killed_all = this->killed_all || orig_killed_all;
-
-   foreach_in_list_safe(kill_entry, k, new_kills) {
-      kill(k);
-   }
+   handle_block(&ir->body_instructions, false);
 
    /* already descended into the children. */
    return visit_continue_with_parent;
 }
 
-/* Remove any entries currently in the ACP for this kill. */
+/**
+ * Removes the channels of var in write_mask from the ACP, and all the
+ * entries copying from var.
+ */
 void
-ir_copy_propagation_elements_visitor::kill(kill_entry *k)
+ir_copy_propagation_elements_visitor::kill(ir_variable *var,
+					   unsigned write_mask)
 {
-   foreach_in_list_safe(acp_entry, entry, acp) {
-      if (entry->lhs == k->var) {
-	 entry->write_mask = entry->write_mask & ~k->write_mask;
-	 if (entry->write_mask == 0) {
-	    entry->remove();
-	    continue;
-	 }
-      }
-      if (entry->rhs == k->var) {
-	 entry->remove();
-      }
+   acp_var *state = get_var(var, true);
+
+   state->version++;
+   for (int i = 0; i < 4; i++) {
+      if (write_mask & (1 << i))
+	 state->written[i] = state->version;
    }
+}
 
-   /* If we were on a list, remove ourselves before inserting */
-   if (k->next)
-      k->remove();
+void
+ir_copy_propagation_elements_visitor::kill_all()
+{
+   this->floor = this->serial + 1;
+   this->killed_all = true;
+}
 
-   this->kills->push_tail(k);
+/**
+ * Returns the list of copies without the entries that were killed
+ * entirely, sharing the unchanged tail of the list.
+ */
+acp_entry *
+ir_copy_propagation_elements_visitor::prune(acp_entry *copies,
+					    const acp_var *lhs_state)
+{
+   if (!copies)
+      return NULL;
+
+   acp_entry *next = prune(copies->next, lhs_state);
+   if (!copies->live_mask(lhs_state))
+      return next;
+   if (next == copies->next)
+      return copies;
+
+   acp_entry *entry = new(this->mem_ctx) acp_entry(*copies);
+   entry->next = next;
+   return entry;
 }
 
 /**
@@ -489,9 +574,19 @@ ir_copy_propagation_elements_visitor::add_copy(ir_assignment *ir)
       }
    }
 
-   entry = new(this->mem_ctx) acp_entry(lhs->var, rhs->var, write_mask,
-					swizzle);
-   this->acp->push_tail(entry);
+   /* An entry without channels would never be used. */
+   if (!write_mask)
+      return;
+
+   acp_var *lhs_state = get_var(lhs->var, true);
+   acp_var *rhs_state = get_var(rhs->var, true);
+
+   entry = new(this->mem_ctx) acp_entry(rhs->var, lhs_state, rhs_state,
+					write_mask, swizzle, ++this->serial);
+   entry->next = prune(lhs_state->copies, lhs_state);
+
+   this->undo = new(this->mem_ctx) acp_undo(lhs_state, this->undo);
+   lhs_state->copies = entry;
 }
 
 bool
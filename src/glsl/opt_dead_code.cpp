@@ -29,29 +29,57 @@
 
 #include "ir.h"
 #include "ir_visitor.h"
+#include "ir_optimization.h"
 #include "ir_variable_refcount.h"
 #include "glsl_types.h"
 #include "util/hash_table.h"
 
 static bool debug = false;
 
+static void
+record_removal(void *mem_ctx, ir_instruction ***list, unsigned *count,
+               unsigned *capacity, ir_instruction *ir)
+{
+   if (*count == *capacity) {
+      *capacity = *capacity ? *capacity * 2 : 16;
+      *list = reralloc(mem_ctx, *list, ir_instruction *, *capacity);
+   }
+   (*list)[(*count)++] = ir;
+}
+
 /**
  * Do a dead code pass over instructions and everything that instructions
  * references.
  *
  * Note that this will remove assignments to globals, so it is not suitable
  * for usage on an unlinked instruction stream.
+ *
+ * \param refs  Reference counts of \c instructions to use instead of counting
+ *               them again, or NULL. They are kept up to date with what the
+ *               pass removes.
  */
 bool
-do_dead_code(exec_list *instructions, bool uniform_locations_assigned)
+do_dead_code(exec_list *instructions, bool uniform_locations_assigned,
+             ir_variable_refcount_visitor *refs)
 {
-   ir_variable_refcount_visitor v;
+   ir_variable_refcount_visitor local_refs;
    bool progress = false;
 
-   v.run(instructions);
+   if (!refs) {
+      refs = &local_refs;
+      refs->run(instructions);
+   }
+
+   /* What gets removed is taken out of the counts once all the entries have
+    * been looked at, so that every decision is made on the counts from
+    * before this pass.
+    */
+   void *mem_ctx = ralloc_arena_context(NULL, NULL);
+   ir_instruction **removed = NULL;
+   unsigned removed_count = 0, removed_capacity = 0;
 
    struct hash_entry *e;
-   hash_table_foreach(v.ht, e) {
+   hash_table_foreach(refs->ht, e) {
       ir_variable_refcount_entry *entry = (ir_variable_refcount_entry *)e->data;
 
       /* Since each assignment is a reference, the refereneced count must be
@@ -84,6 +112,7 @@ do_dead_code(exec_list *instructions, bool uniform_locations_assigned)
              entry->var->data.mode != ir_var_shader_out && entry->var->data.mode != ir_var_shader_inout) {
 	    entry->assign->remove();
 	    progress = true;
+	    record_removal(mem_ctx, &removed, &removed_count, &removed_capacity, entry->assign);
 
 	    if (debug) {
 	       printf("Removed assignment to %s@%p\n",
@@ -127,6 +156,7 @@ do_dead_code(exec_list *instructions, bool uniform_locations_assigned)
 
 	 entry->var->remove();
 	 progress = true;
+	 record_removal(mem_ctx, &removed, &removed_count, &removed_capacity, entry->var);
 
 	 if (debug) {
 	    printf("Removed declaration of %s@%p\n",
@@ -135,6 +165,17 @@ do_dead_code(exec_list *instructions, bool uniform_locations_assigned)
       }
    }
 
+   if (refs != &local_refs) {
+      for (unsigned i = 0; i < removed_count; i++) {
+	 ir_assignment *assign = removed[i]->as_assignment();
+	 if (assign)
+	    refs->remove_assignment(assign);
+	 else
+	    refs->remove_variable(removed[i]->as_variable());
+      }
+   }
+   ralloc_free(mem_ctx);
+
    return progress;
 }
 
@@ -36,6 +36,7 @@
 #include "ir.h"
 #include "ir_basic_block.h"
 #include "ir_optimization.h"
+#include "ir_variable_refcount.h"
 #include "glsl_types.h"
 
 static bool debug = false;
@@ -161,7 +162,8 @@ public:
  * of a variable to a variable.
  */
 static bool
-process_assignment(void *ctx, ir_assignment *ir, exec_list *assignments)
+process_assignment(void *ctx, ir_assignment *ir, exec_list *assignments,
+                   ir_variable_refcount_visitor *refs)
 {
    ir_variable *var = NULL;
    bool progress = false;
@@ -218,6 +220,8 @@ process_assignment(void *ctx, ir_assignment *ir, exec_list *assignments)
 	       if (entry->ir->write_mask == 0) {
 		  /* Delete the dead assignment. */
 		  entry->ir->remove();
+		  if (refs)
+		     refs->remove_assignment(entry->ir);
 		  entry->remove();
 	       } else {
 		  void *mem_ctx = ralloc_parent(entry->ir);
@@ -258,6 +262,8 @@ process_assignment(void *ctx, ir_assignment *ir, exec_list *assignments)
 	       if (debug)
 		  printf("removing %s\n", var->name);
 	       entry->ir->remove();
+	       if (refs)
+		  refs->remove_assignment(entry->ir);
 	       entry->remove();
 	       progress = true;
 	    }
@@ -281,6 +287,11 @@ process_assignment(void *ctx, ir_assignment *ir, exec_list *assignments)
    return progress;
 }
 
+struct dead_code_local_info {
+   ir_variable_refcount_visitor *refs;
+   bool progress;
+};
+
 static void
 dead_code_local_basic_block(ir_instruction *first,
 			     ir_instruction *last,
@@ -289,10 +300,10 @@ dead_code_local_basic_block(ir_instruction *first,
    ir_instruction *ir, *ir_next;
    /* List of avaialble_copy */
    exec_list assignments;
-   bool *out_progress = (bool *)data;
+   struct dead_code_local_info *info = (struct dead_code_local_info *)data;
    bool progress = false;
 
-   void *ctx = ralloc_context(NULL);
+   void *ctx = ralloc_arena_context(NULL, NULL);
    /* Safe looping, since process_assignment */
    for (ir = first, ir_next = (ir_instruction *)first->next;;
 	ir = ir_next, ir_next = (ir_instruction *)ir->next) {
@@ -304,7 +315,7 @@ dead_code_local_basic_block(ir_instruction *first,
       }
 
       if (ir_assign) {
-	 progress = process_assignment(ctx, ir_assign, &assignments) || progress;
+	 progress = process_assignment(ctx, ir_assign, &assignments, info->refs) || progress;
       } else {
 	 kill_for_derefs_visitor kill(&assignments);
 	 ir->accept(&kill);
@@ -313,19 +324,24 @@ dead_code_local_basic_block(ir_instruction *first,
       if (ir == last)
 	 break;
    }
-   *out_progress = progress;
+   info->progress = progress;
    ralloc_free(ctx);
 }
 
 /**
  * Does a copy propagation pass on the code present in the instruction stream.
+ *
+ * \param refs  Reference counts of \c instructions to keep up to date with
+ *               the assignments the pass removes, or NULL.
  */
 bool
-do_dead_code_local(exec_list *instructions)
+do_dead_code_local(exec_list *instructions, ir_variable_refcount_visitor *refs)
 {
-   bool progress = false;
+   struct dead_code_local_info info;
+   info.refs = refs;
+   info.progress = false;
 
-   call_for_basic_blocks(instructions, dead_code_local_basic_block, &progress);
+   call_for_basic_blocks(instructions, dead_code_local_basic_block, &info);
 
-   return progress;
+   return info.progress;
 }
@@ -66,6 +66,8 @@ public:
       this->progress = false;
       this->graft_assign = graft_assign;
       this->graft_var = graft_var;
+      this->grafted_deref = NULL;
+      this->grafted_in_assignee = false;
    }
 
    virtual ir_visitor_status visit_leave(class ir_assignment *);
@@ -86,6 +88,12 @@ public:
    bool progress;
    ir_variable *graft_var;
    ir_assignment *graft_assign;
+
+   /* The dereference the graft replaced, and whether it was on the left hand
+    * side of an assignment.
+    */
+   ir_dereference_variable *grafted_deref;
+   bool grafted_in_assignee;
 };
 
 struct find_deref_info {
@@ -143,6 +151,8 @@ ir_tree_grafting_visitor::do_graft(ir_rvalue **rvalue)
 
    this->graft_assign->remove();
    *rvalue = this->graft_assign->rhs;
+   this->grafted_deref = deref;
+   this->grafted_in_assignee = this->in_assignee;
 
    this->progress = true;
    return true;
@@ -318,13 +328,15 @@ ir_tree_grafting_visitor::visit_enter(ir_texture *ir)
 
 struct tree_grafting_info {
    ir_variable_refcount_visitor *refs;
+   bool update_refs;
    bool progress;
 };
 
 static bool
 try_tree_grafting(ir_assignment *start,
 		  ir_variable *lhs_var,
-		  ir_instruction *bb_last)
+		  ir_instruction *bb_last,
+		  ir_variable_refcount_visitor *refs)
 {
    ir_tree_grafting_visitor v(start, lhs_var);
 
@@ -345,8 +357,16 @@ try_tree_grafting(ir_assignment *start,
       }
 
       ir_visitor_status s = ir->accept(&v);
-      if (s == visit_stop)
+      if (s == visit_stop) {
+	 if (v.progress && refs) {
+	    ir_assignment *assign = ir->as_assignment();
+	    refs->remove_assignment(start);
+	    refs->replace_rvalue(v.grafted_deref, start->rhs,
+				 assign ? assign->lhs->variable_referenced() : NULL,
+				 v.grafted_in_assignee);
+	 }
 	 return v.progress;
+      }
    }
 
    return false;
@@ -395,7 +415,8 @@ tree_grafting_basic_block(ir_instruction *bb_first,
        * rest of the BB seeing if the deref is here, and if nothing interfered with
        * pasting its expression's values in between.
        */
-      info->progress |= try_tree_grafting(assign, lhs_var, bb_last);
+      info->progress |= try_tree_grafting(assign, lhs_var, bb_last,
+					  info->update_refs ? info->refs : NULL);
    }
 }
 
@@ -403,17 +424,22 @@ tree_grafting_basic_block(ir_instruction *bb_first,
 
 /**
  * Does a copy propagation pass on the code present in the instruction stream.
+ *
+ * \param refs  Reference counts of \c instructions to use instead of counting
+ *               them again, or NULL. They are kept up to date with the grafts.
  */
 bool
-do_tree_grafting(exec_list *instructions)
+do_tree_grafting(exec_list *instructions, ir_variable_refcount_visitor *refs)
 {
-   ir_variable_refcount_visitor refs;
+   ir_variable_refcount_visitor local_refs;
    struct tree_grafting_info info;
 
    info.progress = false;
-   info.refs = &refs;
+   info.refs = refs ? refs : &local_refs;
+   info.update_refs = refs != NULL;
 
-   visit_list_elements(info.refs, instructions);
+   if (!refs)
+      visit_list_elements(info.refs, instructions);
 
    call_for_basic_blocks(instructions, tree_grafting_basic_block, &info);
 
@@ -51,6 +51,7 @@
 #ifdef __APPLE__
 #include <xlocale.h>
 #endif
+#include "c11/threads.h"
 #endif
 
 
@@ -496,6 +497,19 @@ _mesa_strdup( const char *s )
    }
 }
 
+#if defined(_GNU_SOURCE) && !defined(__CYGWIN__) && !defined(__FreeBSD__) && \
+   !defined(ANDROID) && !defined(__HAIKU__) && !defined(__UCLIBC__) && \
+   !defined(__NetBSD__)
+static locale_t strtof_locale = NULL;
+static once_flag strtof_locale_once = ONCE_FLAG_INIT;
+
+static void
+create_strtof_locale(void)
+{
+   strtof_locale = newlocale(LC_CTYPE_MASK, "C", NULL);
+}
+#endif
+
 /** Wrapper around strtof() */
 float
 _mesa_strtof( const char *s, char **end )
@@ -503,11 +517,9 @@ _mesa_strtof( const char *s, char **end )
 #if defined(_GNU_SOURCE) && !defined(__CYGWIN__) && !defined(__FreeBSD__) && \
    !defined(ANDROID) && !defined(__HAIKU__) && !defined(__UCLIBC__) && \
    !defined(__NetBSD__)
-   static locale_t loc = NULL;
-   if (!loc) {
-      loc = newlocale(LC_CTYPE_MASK, "C", NULL);
-   }
-   return strtof_l(s, end, loc);
+   /* Compilers may run on several threads at once; create the locale once. */
+   call_once(&strtof_locale_once, create_strtof_locale);
+   return strtof_l(s, end, strtof_locale);
 #elif defined(_ISOC99_SOURCE) || (defined(_XOPEN_SOURCE) && _XOPEN_SOURCE >= 600)
    return strtof(s, end);
 #else
@@ -52,11 +52,11 @@ typedef int (*hash_compare_func_t)(const void *key1, const void *key2);
 /**
  * Hash table constructor
  *
- * Creates a hash table with the specified number of buckets.  The supplied
- * \c hash and \c compare routines are used when adding elements to the table
- * and when searching for elements in the table.
+ * Creates an empty hash table.  The supplied \c hash and \c compare routines
+ * are used when adding elements to the table and when searching for elements
+ * in the table.  The table grows as elements are added.
  *
- * \param num_buckets  Number of buckets (bins) in the hash table.
+ * \param num_buckets  Number of slots to start out with (at least 16).
  * \param hash         Function used to compute hash value of input keys.
  * \param compare      Function used to compare keys.
  */
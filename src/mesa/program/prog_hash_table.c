@@ -29,28 +29,180 @@
  */
 
 #include "main/errors.h"
-#include "main/simple_list.h"
 #include "hash_table.h"
 
-struct node {
-   struct node *next;
-   struct node *prev;
+/**
+ * The table is open addressed with linear probing: entries live in one
+ * power-of-two sized array, and a key is in the first slot at or after its
+ * home slot that holds it, before the next empty slot.
+ *
+ * Duplicate keys (see \c hash_table_insert) are kept in the same probe
+ * sequence, most recently added first, so that lookups and removals see the
+ * newest one.  Removed entries leave a tombstone behind until the next
+ * rehash, so that the probe sequences going through them stay intact.
+ */
+struct hash_entry {
+   unsigned hash;
+   const void *key;
+   void *data;
 };
 
 struct hash_table {
-    hash_func_t    hash;
-    hash_compare_func_t  compare;
-
-    unsigned num_buckets;
-    struct node buckets[1];
+   hash_func_t hash;
+   hash_compare_func_t compare;
+
+   unsigned size;          /**< Number of slots, a power of two. */
+   unsigned size_bits;     /**< log2(size) */
+   unsigned entries;       /**< Slots in use. */
+   unsigned deleted;       /**< Tombstones. */
+   struct hash_entry *table;
+
+   /**
+    * Slots of a table that never grew, allocated along with it so that small
+    * tables are a single allocation.
+    */
+   struct hash_entry inline_table[1];
 };
 
+/** Key of removed entries; a NULL key is an empty slot. */
+static const char deleted_key_value;
+#define DELETED_KEY ((const void *) &deleted_key_value)
 
-struct hash_node {
-    struct node link;
-    const void *key;
-    void *data;
-};
+#define MIN_SIZE_BITS 4
+
+static inline unsigned
+home_slot(const struct hash_table *ht, unsigned hash)
+{
+   /* Fibonacci hashing, so that keys whose hashes only differ in the high
+    * bits (pointers, mostly) still spread over all of the slots.
+    */
+   return (unsigned) (((uint32_t) hash * 2654435769u) >> (32 - ht->size_bits));
+}
+
+static inline bool
+entry_is_present(const struct hash_entry *entry)
+{
+   return entry->key != NULL && entry->key != DELETED_KEY;
+}
+
+static struct hash_entry *
+get_entry(struct hash_table *ht, const void *key)
+{
+   const unsigned hash = (*ht->hash)(key);
+   const unsigned mask = ht->size - 1;
+   unsigned i;
+
+   for (i = home_slot(ht, hash); ; i = (i + 1) & mask) {
+      struct hash_entry *entry = &ht->table[i];
+
+      if (entry->key == NULL)
+         return NULL;
+      if (entry->key != DELETED_KEY && entry->hash == hash &&
+          (*ht->compare)(entry->key, key) == 0)
+         return entry;
+   }
+}
+
+/**
+ * Puts an entry into the first free slot of its probe sequence, or, when an
+ * entry with the same key comes first, into that one's slot, carrying the
+ * older entry further along.
+ */
+static void
+put_entry(struct hash_table *ht, unsigned hash, const void *key, void *data)
+{
+   const unsigned mask = ht->size - 1;
+   struct hash_entry pending;
+   unsigned i;
+
+   pending.hash = hash;
+   pending.key = key;
+   pending.data = data;
+
+   for (i = home_slot(ht, hash); ; i = (i + 1) & mask) {
+      struct hash_entry *entry = &ht->table[i];
+
+      if (!entry_is_present(entry)) {
+         if (entry->key == DELETED_KEY)
+            ht->deleted--;
+         *entry = pending;
+         ht->entries++;
+         return;
+      }
+      if (entry->hash == pending.hash &&
+          (*ht->compare)(entry->key, pending.key) == 0) {
+         struct hash_entry older = *entry;
+         *entry = pending;
+         pending = older;
+      }
+   }
+}
+
+static bool
+rehash(struct hash_table *ht, unsigned size_bits)
+{
+   struct hash_entry *old_table = ht->table;
+   const unsigned old_size = ht->size;
+   struct hash_entry *table;
+   unsigned start, i;
+
+   table = calloc(1u << size_bits, sizeof(*table));
+   if (table == NULL) {
+      _mesa_error_no_memory(__func__);
+      return false;
+   }
+
+   ht->table = table;
+   ht->size = 1u << size_bits;
+   ht->size_bits = size_bits;
+   ht->entries = 0;
+   ht->deleted = 0;
+
+   /* Walk the old slots starting right after an empty one, so that every
+    * run of slots is visited in probe order and duplicate keys keep their
+    * most-recent-first order.
+    */
+   for (start = 0; start < old_size; start++) {
+      if (old_table[start].key == NULL)
+         break;
+   }
+   for (i = 1; i <= old_size; i++) {
+      const struct hash_entry *entry = &old_table[(start + i) & (old_size - 1)];
+      unsigned slot;
+
+      if (!entry_is_present(entry))
+         continue;
+      slot = home_slot(ht, entry->hash);
+      while (ht->table[slot].key != NULL)
+         slot = (slot + 1) & (ht->size - 1);
+      ht->table[slot] = *entry;
+      ht->entries++;
+   }
+
+   if (old_table != ht->inline_table)
+      free(old_table);
+   return true;
+}
+
+/**
+ * Makes sure there is room for one more entry, keeping the table at most
+ * 3/4 full (tombstones included) so that probe sequences stay short.
+ */
+static bool
+reserve_entry(struct hash_table *ht)
+{
+   unsigned size_bits = ht->size_bits;
+
+   if ((ht->entries + ht->deleted + 1) * 4 <= ht->size * 3)
+      return true;
+
+   /* Only grow when it is live entries that fill the table; otherwise
+    * getting rid of the tombstones makes enough room.
+    */
+   while ((ht->entries + 1) * 2 > (1u << size_bits))
+      size_bits++;
+   return rehash(ht, size_bits);
+}
 
 
 struct hash_table *
@@ -58,23 +210,20 @@ hash_table_ctor(unsigned num_buckets, hash_func_t hash,
                 hash_compare_func_t compare)
 {
     struct hash_table *ht;
-    unsigned i;
+    unsigned size_bits = MIN_SIZE_BITS;
 
 
-    if (num_buckets < 16) {
-        num_buckets = 16;
-    }
+    while ((1u << size_bits) < num_buckets)
+        size_bits++;
 
-    ht = malloc(sizeof(*ht) + ((num_buckets - 1) 
-				     * sizeof(ht->buckets[0])));
+    ht = calloc(1, sizeof(*ht) + (((1u << size_bits) - 1)
+                                  * sizeof(ht->inline_table[0])));
     if (ht != NULL) {
         ht->hash = hash;
         ht->compare = compare;
-        ht->num_buckets = num_buckets;
-
-        for (i = 0; i < num_buckets; i++) {
-            make_empty_list(& ht->buckets[i]);
-        }
+        ht->size = 1u << size_bits;
+        ht->size_bits = size_bits;
+        ht->table = ht->inline_table;
     }
 
     return ht;
@@ -86,7 +235,8 @@ hash_table_dtor(struct hash_table *ht)
 {
    if (!ht)
       return;
-   hash_table_clear(ht);
+   if (ht->table != ht->inline_table)
+      free(ht->table);
    free(ht);
 }
 
@@ -94,105 +244,54 @@ hash_table_dtor(struct hash_table *ht)
 void
 hash_table_clear(struct hash_table *ht)
 {
-   struct node *node;
-   struct node *temp;
-   unsigned i;
-
-
-   for (i = 0; i < ht->num_buckets; i++) {
-      foreach_s(node, temp, & ht->buckets[i]) {
-	 remove_from_list(node);
-	 free(node);
-      }
-
-      assert(is_empty_list(& ht->buckets[i]));
-   }
+   memset(ht->table, 0, ht->size * sizeof(ht->table[0]));
+   ht->entries = 0;
+   ht->deleted = 0;
 }
 
 
-static struct hash_node *
-get_node(struct hash_table *ht, const void *key)
-{
-    const unsigned hash_value = (*ht->hash)(key);
-    const unsigned bucket = hash_value % ht->num_buckets;
-    struct node *node;
-
-    foreach(node, & ht->buckets[bucket]) {
-       struct hash_node *hn = (struct hash_node *) node;
-
-       if ((*ht->compare)(hn->key, key) == 0) {
-	  return hn;
-       }
-    }
-
-    return NULL;
-}
-
 void *
 hash_table_find(struct hash_table *ht, const void *key)
 {
-   struct hash_node *hn = get_node(ht, key);
+   struct hash_entry *entry = get_entry(ht, key);
 
-   return (hn == NULL) ? NULL : hn->data;
+   return (entry == NULL) ? NULL : entry->data;
 }
 
 void
 hash_table_insert(struct hash_table *ht, void *data, const void *key)
 {
-    const unsigned hash_value = (*ht->hash)(key);
-    const unsigned bucket = hash_value % ht->num_buckets;
-    struct hash_node *node;
+    assert(key != NULL);
 
-    node = calloc(1, sizeof(*node));
-    if (node == NULL) {
-       _mesa_error_no_memory(__func__);
+    if (!reserve_entry(ht))
        return;
-    }
 
-    node->data = data;
-    node->key = key;
-
-    insert_at_head(& ht->buckets[bucket], & node->link);
+    put_entry(ht, (*ht->hash)(key), key, data);
 }
 
 bool
 hash_table_replace(struct hash_table *ht, void *data, const void *key)
 {
-    const unsigned hash_value = (*ht->hash)(key);
-    const unsigned bucket = hash_value % ht->num_buckets;
-    struct node *node;
-    struct hash_node *hn;
-
-    foreach(node, & ht->buckets[bucket]) {
-       hn = (struct hash_node *) node;
-
-       if ((*ht->compare)(hn->key, key) == 0) {
-	  hn->data = data;
-	  return true;
-       }
-    }
+    struct hash_entry *entry = get_entry(ht, key);
 
-    hn = calloc(1, sizeof(*hn));
-    if (hn == NULL) {
-       _mesa_error_no_memory(__func__);
-       return false;
+    if (entry != NULL) {
+       entry->data = data;
+       return true;
     }
 
-    hn->data = data;
-    hn->key = key;
-
-    insert_at_head(& ht->buckets[bucket], & hn->link);
+    hash_table_insert(ht, data, key);
     return false;
 }
 
 void
 hash_table_remove(struct hash_table *ht, const void *key)
 {
-   struct node *node = (struct node *) get_node(ht, key);
-   if (node != NULL) {
-      remove_from_list(node);
-      free(node);
-      return;
+   struct hash_entry *entry = get_entry(ht, key);
+   if (entry != NULL) {
+      entry->key = DELETED_KEY;
+      entry->data = NULL;
+      ht->entries--;
+      ht->deleted++;
    }
 }
 
@@ -203,15 +302,16 @@ hash_table_call_foreach(struct hash_table *ht,
 					 void *closure),
 			void *closure)
 {
-   unsigned bucket;
+   unsigned i;
 
-   for (bucket = 0; bucket < (int)ht->num_buckets; bucket++) {
-      struct node *node, *temp;
-      foreach_s(node, temp, &ht->buckets[bucket]) {
-	 struct hash_node *hn = (struct hash_node *) node;
+   /* Removing entries from the callback only leaves tombstones behind, so
+    * that is fine; adding entries is not.
+    */
+   for (i = 0; i < ht->size; i++) {
+      struct hash_entry *entry = &ht->table[i];
 
-	 callback(hn->key, hn->data, closure);
-      }
+      if (entry_is_present(entry))
+	 callback(entry->key, entry->data, closure);
    }
 }
 
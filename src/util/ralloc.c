@@ -40,6 +40,7 @@ _CRTIMP int _vscprintf(const char *format, va_list argptr);
 #endif
 
 #include "ralloc.h"
+#include "c11/threads.h"
 
 #ifndef va_copy
 #ifdef __va_copy
@@ -58,6 +59,7 @@ struct ralloc_header
    unsigned canary;
 #endif
 
+   /* Tagged with ARENA_BLOCK; use get_parent() and set_parent(). */
    struct ralloc_header *parent;
 
    /* The first child (head of a linked list) */
@@ -72,8 +74,83 @@ struct ralloc_header
 
 typedef struct ralloc_header ralloc_header;
 
+/* Blocks carved out of an arena are preceded by this, and have ARENA_BLOCK
+ * set in their parent pointer; malloc'd blocks pay nothing for arenas.
+ */
+struct arena_block
+{
+   struct ralloc_arena *arena;
+
+   /* Usable size, with ESCAPED set once the block has been stolen out of
+    * its arena.
+    */
+   size_t size;
+};
+
+#define ARENA_BLOCK ((uintptr_t) 1)
+#define ESCAPED ((size_t) 1)
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(size) (((size) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+/* Arenas without a pool start with small slabs, each new one twice the
+ * size of the previous one.
+ */
+#define DEFAULT_SLAB_SIZE (4 * 1024)
+#define MAX_SLAB_SIZE (256 * 1024)
+
+/* Freed arena blocks up to this size are kept for reuse, by size. */
+#define ARENA_FREE_MAX 512
+#define ARENA_FREE_CLASSES (ARENA_FREE_MAX / ARENA_ALIGN + 1)
+
+struct ralloc_slab
+{
+   struct ralloc_slab *next;
+   size_t size;
+};
+
+struct ralloc_slab_pool
+{
+   mtx_t mutex;
+   size_t slab_size;
+   unsigned max_free;
+   unsigned free_count;
+   struct ralloc_slab *free_slabs;
+
+   /* Pool creator plus every arena using the pool. */
+   unsigned refs;
+};
+
+struct ralloc_arena
+{
+   struct ralloc_slab_pool *pool;
+   size_t slab_size;
+
+   /* All slabs; the one being allocated from is first. */
+   struct ralloc_slab *slabs;
+   char *cur;
+   char *end;
+
+   /* The arena context; NULL once it has been freed. */
+   ralloc_header *owner;
+
+   /* The owner plus every block stolen out of the arena. */
+   unsigned refs;
+
+   /* Set once a block from elsewhere was put into the arena, or a block
+    * escaped from it; freeing the arena then has to walk its tree.
+    * Otherwise calling the recorded destructors is enough.
+    */
+   bool needs_walk;
+   ralloc_header **destructors;
+   unsigned destructor_count;
+   unsigned destructor_capacity;
+
+   /* Freed small blocks, chained through their next pointers. */
+   ralloc_header *free_blocks[ARENA_FREE_CLASSES];
+};
+
 static void unlink_block(ralloc_header *info);
 static void unsafe_free(ralloc_header *info);
+static void arena_unref(struct ralloc_arena *arena);
 
 static ralloc_header *
 get_header(const void *ptr)
@@ -88,11 +165,47 @@ get_header(const void *ptr)
 
 #define PTR_FROM_HEADER(info) (((char *) info) + sizeof(ralloc_header))
 
+static inline ralloc_header *
+get_parent(const ralloc_header *info)
+{
+   return (ralloc_header *) ((uintptr_t) info->parent & ~ARENA_BLOCK);
+}
+
+static inline void
+set_parent(ralloc_header *info, ralloc_header *parent)
+{
+   info->parent = (ralloc_header *)
+      ((uintptr_t) parent | ((uintptr_t) info->parent & ARENA_BLOCK));
+}
+
+/* NULL for malloc'd blocks. */
+static inline struct arena_block *
+get_arena_block(const ralloc_header *info)
+{
+   if ((uintptr_t) info->parent & ARENA_BLOCK)
+      return (struct arena_block *) info - 1;
+   return NULL;
+}
+
+static inline struct ralloc_arena *
+get_arena(const ralloc_header *info)
+{
+   struct arena_block *block = get_arena_block(info);
+   return block != NULL ? block->arena : NULL;
+}
+
 static void
 add_child(ralloc_header *parent, ralloc_header *info)
 {
    if (parent != NULL) {
-      info->parent = parent;
+      struct ralloc_arena *arena = get_arena(parent);
+
+      /* Something that is not plain memory of the parent's arena? */
+      if (arena != NULL && (get_arena(info) != arena ||
+                            (get_arena_block(info)->size & ESCAPED)))
+         arena->needs_walk = true;
+
+      set_parent(info, parent);
       info->next = parent->child;
       parent->child = info;
 
@@ -107,17 +220,328 @@ ralloc_context(const void *ctx)
    return ralloc_size(ctx, 0);
 }
 
+static struct ralloc_slab *
+slab_create(struct ralloc_slab_pool *pool, size_t size)
+{
+   struct ralloc_slab *slab = NULL;
+
+   if (pool != NULL && size == pool->slab_size) {
+      mtx_lock(&pool->mutex);
+      slab = pool->free_slabs;
+      if (slab != NULL) {
+         pool->free_slabs = slab->next;
+         pool->free_count--;
+      }
+      mtx_unlock(&pool->mutex);
+   }
+
+   if (slab == NULL) {
+      slab = malloc(sizeof(struct ralloc_slab) + size);
+      if (unlikely(slab == NULL))
+         return NULL;
+      slab->size = size;
+   }
+   slab->next = NULL;
+   return slab;
+}
+
+static void
+pool_unref(struct ralloc_slab_pool *pool)
+{
+   struct ralloc_slab *slab, *next;
+   bool last;
+
+   mtx_lock(&pool->mutex);
+   last = --pool->refs == 0;
+   mtx_unlock(&pool->mutex);
+   if (!last)
+      return;
+
+   for (slab = pool->free_slabs; slab != NULL; slab = next) {
+      next = slab->next;
+      free(slab);
+   }
+   mtx_destroy(&pool->mutex);
+   free(pool);
+}
+
+/* Bump-allocates \p size bytes (a multiple of ARENA_ALIGN) from the arena.
+ * The memory is not cleared.
+ */
+static void *
+arena_alloc(struct ralloc_arena *arena, size_t size)
+{
+   struct ralloc_slab *slab;
+   char *ptr;
+
+   if (likely((size_t) (arena->end - arena->cur) >= size)) {
+      ptr = arena->cur;
+      arena->cur += size;
+      return ptr;
+   }
+
+   /* Big allocations get a slab of their own, so that the rest of the
+    * current slab is not wasted.
+    */
+   if (size > arena->slab_size / 4) {
+      slab = slab_create(NULL, size);
+      if (unlikely(slab == NULL))
+         return NULL;
+      slab->next = arena->slabs->next;
+      arena->slabs->next = slab;
+      return slab + 1;
+   }
+
+   if (arena->pool == NULL && arena->slab_size < MAX_SLAB_SIZE)
+      arena->slab_size *= 2;
+   slab = slab_create(arena->pool, arena->slab_size);
+   if (unlikely(slab == NULL))
+      return NULL;
+   slab->next = arena->slabs;
+   arena->slabs = slab;
+   ptr = (char *) (slab + 1);
+   arena->cur = ptr + size;
+   arena->end = ptr + slab->size;
+   return ptr;
+}
+
+/* Allocates a block with room for \p size bytes, header cleared. */
+static ralloc_header *
+arena_alloc_block(struct ralloc_arena *arena, size_t size)
+{
+   struct arena_block *block;
+   ralloc_header *info;
+
+   size = ARENA_ROUND(size);
+   if (size <= ARENA_FREE_MAX && arena->free_blocks[size / ARENA_ALIGN]) {
+      info = arena->free_blocks[size / ARENA_ALIGN];
+      arena->free_blocks[size / ARENA_ALIGN] = info->next;
+      block = (struct arena_block *) info - 1;
+   } else {
+      block = arena_alloc(arena, sizeof(struct arena_block) +
+                                 sizeof(ralloc_header) + size);
+      if (unlikely(block == NULL))
+         return NULL;
+      info = (ralloc_header *) (block + 1);
+   }
+   block->arena = arena;
+   block->size = size;
+   memset(info, 0, sizeof(ralloc_header));
+   info->parent = (ralloc_header *) ARENA_BLOCK;
+   return info;
+}
+
+/* Keeps a freed block around for reuse.  A reused block may still be in
+ * the destructor list; that is fine, destructors are cleared once called.
+ */
+static void
+arena_free_block(struct ralloc_arena *arena, ralloc_header *info)
+{
+   size_t size = get_arena_block(info)->size;
+
+   if (size <= ARENA_FREE_MAX && arena->owner != NULL) {
+#ifdef DEBUG
+      info->canary = 0;
+#endif
+      info->next = arena->free_blocks[size / ARENA_ALIGN];
+      arena->free_blocks[size / ARENA_ALIGN] = info;
+   }
+}
+
+static void
+arena_record_destructor(struct ralloc_arena *arena, ralloc_header *info)
+{
+   if (arena->destructor_count == arena->destructor_capacity) {
+      unsigned capacity = arena->destructor_capacity ?
+         arena->destructor_capacity * 2 : 64;
+      ralloc_header **list =
+         arena_alloc(arena, ARENA_ROUND(capacity * sizeof(ralloc_header *)));
+      if (unlikely(list == NULL)) {
+         /* Can't keep track; fall back to walking the tree. */
+         arena->needs_walk = true;
+         return;
+      }
+      if (arena->destructor_count)
+         memcpy(list, arena->destructors,
+                arena->destructor_count * sizeof(ralloc_header *));
+      arena->destructors = list;
+      arena->destructor_capacity = capacity;
+   }
+   arena->destructors[arena->destructor_count++] = info;
+}
+
+/* Frees the arena context: everything below it goes away. */
+static void
+arena_close(ralloc_header *info)
+{
+   struct ralloc_arena *arena = get_arena(info);
+   ralloc_header *temp;
+   unsigned i;
+
+   /* Nothing is reused from here on. */
+   arena->owner = NULL;
+
+   if (arena->needs_walk) {
+      while (info->child != NULL) {
+         temp = info->child;
+         info->child = temp->next;
+         unsafe_free(temp);
+      }
+      if (info->destructor != NULL)
+         info->destructor(PTR_FROM_HEADER(info));
+   } else {
+      /* Everything below the owner is arena memory; only destructors need
+       * calling, children before their parents.
+       */
+      for (i = arena->destructor_count; i-- > 0; ) {
+         void (*destructor)(void *);
+         temp = arena->destructors[i];
+         destructor = temp->destructor;
+         if (destructor != NULL) {
+            temp->destructor = NULL;
+            destructor(PTR_FROM_HEADER(temp));
+         }
+      }
+      if (info->destructor != NULL)
+         info->destructor(PTR_FROM_HEADER(info));
+   }
+
+   arena_unref(arena);
+}
+
+static void
+arena_unref(struct ralloc_arena *arena)
+{
+   struct ralloc_slab_pool *pool = arena->pool;
+   struct ralloc_slab *slab, *next, *keep = NULL, *keep_tail = NULL;
+   unsigned keep_count = 0;
+
+   if (--arena->refs != 0)
+      return;
+
+   /* The arena itself lives in the first slab; don't touch it past here. */
+   for (slab = arena->slabs; slab != NULL; slab = next) {
+      next = slab->next;
+      if (pool != NULL && slab->size == pool->slab_size) {
+         slab->next = keep;
+         keep = slab;
+         if (keep_tail == NULL)
+            keep_tail = slab;
+         keep_count++;
+      } else {
+         free(slab);
+      }
+   }
+
+   if (pool == NULL)
+      return;
+
+   mtx_lock(&pool->mutex);
+   while (keep != NULL && pool->free_count + keep_count > pool->max_free) {
+      slab = keep;
+      keep = keep->next;
+      keep_count--;
+      free(slab);
+   }
+   if (keep != NULL) {
+      keep_tail->next = pool->free_slabs;
+      pool->free_slabs = keep;
+      pool->free_count += keep_count;
+   }
+   mtx_unlock(&pool->mutex);
+
+   pool_unref(pool);
+}
+
+struct ralloc_slab_pool *
+ralloc_slab_pool_create(size_t slab_size, unsigned max_free_slabs)
+{
+   struct ralloc_slab_pool *pool = calloc(1, sizeof(struct ralloc_slab_pool));
+   if (unlikely(pool == NULL))
+      return NULL;
+   mtx_init(&pool->mutex, mtx_plain);
+   pool->slab_size = ARENA_ROUND(slab_size);
+   pool->max_free = max_free_slabs;
+   pool->refs = 1;
+   return pool;
+}
+
+void
+ralloc_slab_pool_destroy(struct ralloc_slab_pool *pool)
+{
+   if (pool != NULL)
+      pool_unref(pool);
+}
+
+void *
+ralloc_arena_context(const void *ctx, struct ralloc_slab_pool *pool)
+{
+   size_t slab_size = pool != NULL ? pool->slab_size : DEFAULT_SLAB_SIZE;
+   struct ralloc_slab *slab = slab_create(pool, slab_size);
+   struct ralloc_arena *arena;
+   ralloc_header *info;
+
+   if (unlikely(slab == NULL))
+      return NULL;
+
+   arena = (struct ralloc_arena *) (slab + 1);
+   memset(arena, 0, sizeof(struct ralloc_arena));
+   arena->pool = pool;
+   arena->slab_size = slab_size;
+   arena->slabs = slab;
+   arena->cur = (char *) arena + ARENA_ROUND(sizeof(struct ralloc_arena));
+   arena->end = (char *) (slab + 1) + slab->size;
+   arena->refs = 1;
+
+   if (pool != NULL) {
+      mtx_lock(&pool->mutex);
+      pool->refs++;
+      mtx_unlock(&pool->mutex);
+   }
+
+   info = arena_alloc_block(arena, 0);
+   arena->owner = info;
+#ifdef DEBUG
+   info->canary = CANARY;
+#endif
+   add_child(ctx != NULL ? get_header(ctx) : NULL, info);
+   return PTR_FROM_HEADER(info);
+}
+
+struct ralloc_slab_pool *
+ralloc_arena_pool(const void *ptr)
+{
+   struct ralloc_arena *arena;
+   ralloc_header *info;
+
+   if (unlikely(ptr == NULL))
+      return NULL;
+
+   info = get_header(ptr);
+   arena = get_arena(info);
+   return arena != NULL ? arena->pool : NULL;
+}
+
 void *
 ralloc_size(const void *ctx, size_t size)
 {
-   void *block = calloc(1, size + sizeof(ralloc_header));
    ralloc_header *info;
    ralloc_header *parent;
+   struct ralloc_arena *arena;
 
-   if (unlikely(block == NULL))
-      return NULL;
-   info = (ralloc_header *) block;
    parent = ctx != NULL ? get_header(ctx) : NULL;
+   arena = parent != NULL ? get_arena(parent) : NULL;
+   if (arena != NULL) {
+      info = arena_alloc_block(arena, size);
+      if (unlikely(info == NULL))
+         return NULL;
+      /* Same as calloc'd memory below. */
+      memset(PTR_FROM_HEADER(info), 0, get_arena_block(info)->size);
+   } else {
+      info = calloc(1, size + sizeof(ralloc_header));
+      if (unlikely(info == NULL))
+         return NULL;
+   }
 
    add_child(parent, info);
 
@@ -141,18 +565,61 @@ rzalloc_size(const void *ctx, size_t size)
 static void *
 resize(void *ptr, size_t size)
 {
-   ralloc_header *child, *old, *info;
+   ralloc_header *child, *old, *info, *parent;
+   struct arena_block *block;
 
    old = get_header(ptr);
-   info = realloc(old, size + sizeof(ralloc_header));
-
-   if (info == NULL)
-      return NULL;
+   block = get_arena_block(old);
+   if (block != NULL) {
+      struct ralloc_arena *arena = block->arena;
+      size_t capacity = block->size & ~ESCAPED;
+      size_t new_capacity;
+      struct arena_block *new_block;
+
+      if (size <= capacity)
+         return ptr;
+
+      /* Last thing allocated from the current slab: grow in place. */
+      size = ARENA_ROUND(size);
+      if ((char *) ptr + capacity == arena->cur &&
+          (size_t) (arena->end - (char *) ptr) >= size) {
+         arena->cur = (char *) ptr + size;
+         block->size = size | (block->size & ESCAPED);
+         return ptr;
+      }
+
+      /* Otherwise move, leaving room to grow: strings are often appended
+       * to piece by piece.
+       */
+      new_capacity = size > capacity * 2 ? size : capacity * 2;
+      new_block = arena_alloc(arena, sizeof(struct arena_block) +
+                                     sizeof(ralloc_header) + new_capacity);
+      if (new_block == NULL)
+         return NULL;
+      memcpy(new_block, block, sizeof(struct arena_block) +
+                               sizeof(ralloc_header) + capacity);
+      new_block->size = new_capacity | (block->size & ESCAPED);
+      info = (ralloc_header *) (new_block + 1);
+      if (old->destructor != NULL) {
+         old->destructor = NULL;
+         arena_record_destructor(arena, info);
+      }
+      if (arena->owner == old)
+         arena->owner = info;
+      else if (!(block->size & ESCAPED))
+         arena_free_block(arena, old);
+   } else {
+      info = realloc(old, size + sizeof(ralloc_header));
+
+      if (info == NULL)
+         return NULL;
+   }
 
    /* Update parent and sibling's links to the reallocated node. */
-   if (info != old && info->parent != NULL) {
-      if (info->parent->child == old)
-	 info->parent->child = info;
+   parent = get_parent(info);
+   if (info != old && parent != NULL) {
+      if (parent->child == old)
+	 parent->child = info;
 
       if (info->prev != NULL)
 	 info->prev->next = info;
@@ -163,7 +630,7 @@ resize(void *ptr, size_t size)
 
    /* Update child->parent links for all children */
    for (child = info->child; child != NULL; child = child->next)
-      child->parent = info;
+      set_parent(child, info);
 
    return PTR_FROM_HEADER(info);
 }
@@ -221,10 +688,12 @@ ralloc_free(void *ptr)
 static void
 unlink_block(ralloc_header *info)
 {
+   ralloc_header *parent = get_parent(info);
+
    /* Unlink from parent & siblings */
-   if (info->parent != NULL) {
-      if (info->parent->child == info)
-	 info->parent->child = info->next;
+   if (parent != NULL) {
+      if (parent->child == info)
+	 parent->child = info->next;
 
       if (info->prev != NULL)
 	 info->prev->next = info->next;
@@ -232,7 +701,7 @@ unlink_block(ralloc_header *info)
       if (info->next != NULL)
 	 info->next->prev = info->prev;
    }
-   info->parent = NULL;
+   set_parent(info, NULL);
    info->prev = NULL;
    info->next = NULL;
 }
@@ -241,46 +710,81 @@ static void
 unsafe_free(ralloc_header *info)
 {
    /* Recursively free any children...don't waste time unlinking them. */
+   struct arena_block *block = get_arena_block(info);
    ralloc_header *temp;
+
+   if (block != NULL && info == block->arena->owner) {
+      arena_close(info);
+      return;
+   }
+
    while (info->child != NULL) {
       temp = info->child;
       info->child = temp->next;
       unsafe_free(temp);
    }
 
-   /* Free the block itself.  Call the destructor first, if any. */
-   if (info->destructor != NULL)
-      info->destructor(PTR_FROM_HEADER(info));
+   /* Free the block itself.  Call the destructor first, if any.  Arena
+    * blocks are cleared so that freeing the arena does not call it again.
+    */
+   if (info->destructor != NULL) {
+      void (*destructor)(void *) = info->destructor;
+      info->destructor = NULL;
+      destructor(PTR_FROM_HEADER(info));
+   }
 
-   free(info);
+   /* Arena memory goes away with the arena, which blocks that escaped from
+    * it keep alive; small blocks are reused before that.
+    */
+   if (block == NULL)
+      free(info);
+   else if (block->size & ESCAPED)
+      arena_unref(block->arena);
+   else
+      arena_free_block(block->arena, info);
 }
 
 void
 ralloc_steal(const void *new_ctx, void *ptr)
 {
    ralloc_header *info, *parent;
+   struct arena_block *block;
 
    if (unlikely(ptr == NULL))
       return;
 
    info = get_header(ptr);
-   parent = get_header(new_ctx);
+   parent = new_ctx != NULL ? get_header(new_ctx) : NULL;
+   block = get_arena_block(info);
 
    unlink_block(info);
 
+   /* Moving out of the arena: keep the arena's memory alive for it, and
+    * make freeing the arena walk its tree, so the block's destructor is
+    * not called from the arena's list.
+    */
+   if (block != NULL && info != block->arena->owner &&
+       (parent == NULL || get_arena(parent) != block->arena) &&
+       !(block->size & ESCAPED)) {
+      block->size |= ESCAPED;
+      block->arena->refs++;
+      block->arena->needs_walk = true;
+   }
+
    add_child(parent, info);
 }
 
 void *
 ralloc_parent(const void *ptr)
 {
-   ralloc_header *info;
+   ralloc_header *info, *parent;
 
    if (unlikely(ptr == NULL))
       return NULL;
 
    info = get_header(ptr);
-   return info->parent ? PTR_FROM_HEADER(info->parent) : NULL;
+   parent = get_parent(info);
+   return parent ? PTR_FROM_HEADER(parent) : NULL;
 }
 
 static void *autofree_context = NULL;
@@ -305,6 +809,10 @@ void
 ralloc_set_destructor(const void *ptr, void(*destructor)(void *))
 {
    ralloc_header *info = get_header(ptr);
+   struct ralloc_arena *arena = get_arena(info);
+   if (destructor != NULL && arena != NULL && info->destructor == NULL &&
+       info != arena->owner)
+      arena_record_destructor(arena, info);
    info->destructor = destructor;
 }
 
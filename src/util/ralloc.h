@@ -91,6 +91,52 @@ extern "C" {
  */
 void *ralloc_context(const void *ctx);
 
+/** \defgroup arena Arena Contexts @{
+ *
+ * An arena context carves itself and everything allocated below it out of
+ * large slabs, instead of doing a \c malloc per allocation.  Freeing the
+ * arena context releases all slabs at once, without visiting every
+ * allocation (destructors still get called).  Freeing individual
+ * allocations inside an arena works; small ones are reused for later
+ * allocations of the same size, bigger ones are only reclaimed together
+ * with the whole arena.
+ *
+ * Allocations can be stolen out of an arena; the slabs then stay alive
+ * until those allocations are freed too.
+ *
+ * Slabs can come from a slab pool, which keeps slabs of freed arenas
+ * around for reuse.  Pools are thread safe; an arena, like any other
+ * ralloc tree, must only be used by one thread at a time.
+ */
+struct ralloc_slab_pool;
+
+/**
+ * Create a pool of \p slab_size byte slabs, which keeps at most
+ * \p max_free_slabs unused slabs around.
+ */
+struct ralloc_slab_pool *ralloc_slab_pool_create(size_t slab_size,
+                                                 unsigned max_free_slabs);
+
+/**
+ * Destroy a slab pool.  Arenas still using the pool keep it alive until they
+ * are freed.
+ */
+void ralloc_slab_pool_destroy(struct ralloc_slab_pool *pool);
+
+/**
+ * Allocate a new arena context chained off of \p ctx (which may be NULL).
+ *
+ * \param pool  Pool to take slabs from and return them to; may be NULL.
+ */
+void *ralloc_arena_context(const void *ctx, struct ralloc_slab_pool *pool);
+
+/**
+ * Return the slab pool of the arena \p ptr was allocated from, or NULL if
+ * it is not arena memory or its arena has no pool.
+ */
+struct ralloc_slab_pool *ralloc_arena_pool(const void *ptr);
+/** @} */
+
 /**
  * Allocate memory chained off of the given context.
  *
@@ -230,7 +276,8 @@ void ralloc_free(void *ptr);
  * "Steal" memory from one context, changing it to another.
  *
  * This changes \p ptr's context to \p new_ctx.  This is quite useful if
- * memory is allocated out of a temporary context.
+ * memory is allocated out of a temporary context.  A NULL \p new_ctx makes
+ * \p ptr a context of its own.
  */
 void ralloc_steal(const void *new_ctx, void *ptr);
 
@@ -0,0 +1,750 @@
+// Throughput and latency benchmark for glslopt_optimize.
+//
+// Loads the test suite shader corpus (and optionally more folders) into
+// memory up front, then compiles every shader N times per target and
+// reports shaders/sec, latency percentiles, allocation counts and peak
+// memory use. Nothing but glslopt_optimize/glslopt_shader_delete is inside
+// the timed region. With -p, only the preprocessor is measured: shaders are
+// compiled with kGlslOptionProfile and the preprocess phase time is reported.
+// With -s, synthetic straight-line shaders of the given lengths are added,
+// to see how compile time scales with shader length. With -o, shaders are
+// compiled for their optimized output only (no raw output, reflection or stats).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "glsl_optimizer.h"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <dirent.h>
+#include <time.h>
+#include <sys/resource.h>
+#endif
+
+
+// -------------------------------------------------------------------------
+// Allocation counting.
+//
+// With glibc, malloc & friends are replaced by versions that count calls and
+// forward to the libc allocator. This catches ralloc, operator new and
+// everything else inside the optimizer. Elsewhere (or under sanitizers,
+// which bring their own malloc) allocation counts are not reported.
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define BENCH_SANITIZER 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define BENCH_SANITIZER 1
+#endif
+#endif
+
+#if defined(__GLIBC__) && !defined(BENCH_SANITIZER)
+#define BENCH_COUNT_ALLOCATIONS 1
+
+static size_t s_AllocCount = 0;
+static size_t s_AllocBytes = 0;
+
+extern "C" {
+void* __libc_malloc (size_t size);
+void* __libc_calloc (size_t count, size_t size);
+void* __libc_realloc (void* ptr, size_t size);
+void __libc_free (void* ptr);
+
+void* malloc (size_t size) __THROW
+{
+	++s_AllocCount;
+	s_AllocBytes += size;
+	return __libc_malloc (size);
+}
+
+void* calloc (size_t count, size_t size) __THROW
+{
+	++s_AllocCount;
+	s_AllocBytes += count * size;
+	return __libc_calloc (count, size);
+}
+
+void* realloc (void* ptr, size_t size) __THROW
+{
+	++s_AllocCount;
+	s_AllocBytes += size;
+	return __libc_realloc (ptr, size);
+}
+
+void free (void* ptr) __THROW
+{
+	__libc_free (ptr);
+}
+} // extern "C"
+
+#else
+#define BENCH_COUNT_ALLOCATIONS 0
+#endif // defined(__GLIBC__) && !defined(BENCH_SANITIZER)
+
+
+static double GetTimeMs ()
+{
+	#ifdef _MSC_VER
+	static LARGE_INTEGER freq;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency (&freq);
+	LARGE_INTEGER t;
+	QueryPerformanceCounter (&t);
+	return double(t.QuadPart) * 1000.0 / double(freq.QuadPart);
+	#else
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+	#endif
+}
+
+// Peak resident set size of the process so far, in kilobytes.
+static long GetPeakRssKB ()
+{
+	#ifdef _MSC_VER
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo (GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return -1;
+	return long(pmc.PeakWorkingSetSize / 1024);
+	#else
+	struct rusage usage;
+	if (getrusage (RUSAGE_SELF, &usage) != 0)
+		return -1;
+	#ifdef __APPLE__
+	return long(usage.ru_maxrss / 1024); // bytes on OS X
+	#else
+	return long(usage.ru_maxrss); // kilobytes elsewhere
+	#endif
+	#endif
+}
+
+
+// -------------------------------------------------------------------------
+// Corpus loading
+
+typedef std::vector<std::string> StringVector;
+
+static bool ReadStringFromFile (const std::string& pathName, std::string& output)
+{
+	FILE* file = fopen (pathName.c_str(), "rb");
+	if (file == NULL)
+		return false;
+	fseek (file, 0, SEEK_END);
+	long length = ftell (file);
+	fseek (file, 0, SEEK_SET);
+	if (length < 0)
+	{
+		fclose (file);
+		return false;
+	}
+	output.resize (length);
+	size_t readLength = length ? fread (&output[0], 1, length, file) : 0;
+	fclose (file);
+	if (readLength != size_t(length))
+	{
+		output.clear();
+		return false;
+	}
+
+	size_t pos = 0;
+	while ((pos = output.find ("\r\n", pos)) != std::string::npos)
+		output.erase (pos, 1);
+	return true;
+}
+
+static bool EndsWith (const std::string& str, const char* sub)
+{
+	const size_t len = strlen (sub);
+	return str.size() >= len && strcmp (str.c_str() + str.size() - len, sub) == 0;
+}
+
+static StringVector GetFiles (const std::string& folder)
+{
+	StringVector res;
+
+	#ifdef _MSC_VER
+	WIN32_FIND_DATAA FindFileData;
+	HANDLE hFind = FindFirstFileA ((folder+"/*").c_str(), &FindFileData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return res;
+	do {
+		if (!(FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			res.push_back (FindFileData.cFileName);
+	} while (FindNextFileA (hFind, &FindFileData));
+	FindClose (hFind);
+	#else
+	DIR *dirp;
+	struct dirent *dp;
+	if ((dirp = opendir(folder.c_str())) == NULL)
+		return res;
+	while ( (dp = readdir(dirp)) )
+	{
+		std::string fname = dp->d_name;
+		if (fname == "." || fname == "..")
+			continue;
+		res.push_back (fname);
+	}
+	closedir(dirp);
+	#endif
+
+	// directory order is arbitrary; keep runs comparable
+	std::sort (res.begin(), res.end());
+	return res;
+}
+
+
+struct BenchShader
+{
+	std::string name;
+	std::string source;
+	bool vertex;
+	bool failed;
+	std::vector<double> times;
+};
+
+struct BenchTarget
+{
+	const char* name;
+	glslopt_target target;
+	const char* inputSuffix; // test suite input files used for this target
+	bool enabled;
+	std::vector<BenchShader> shaders;
+
+	// results
+	size_t compiles;
+	size_t failed;
+	double totalMs;
+	std::vector<double> times;
+	long allocCount; // -1 if not available
+	long allocBytes;
+	long peakRssKB;
+};
+
+// Same inputs the test suite uses: Metal output is produced from GLES3 inputs.
+static BenchTarget s_Targets[] = {
+	{ "es2", kGlslTargetOpenGLES20, "-inES.txt" },
+	{ "es3", kGlslTargetOpenGLES30, "-inES3.txt" },
+	{ "gl", kGlslTargetOpenGL, "-in.txt" },
+	{ "metal", kGlslTargetMetal, "-inES3.txt" },
+};
+static const int kTargetCount = sizeof(s_Targets)/sizeof(s_Targets[0]);
+
+static void AddShader (BenchTarget& target, const std::string& name, const std::string& source, bool vertex)
+{
+	BenchShader shader;
+	shader.name = name;
+	shader.source = source;
+	shader.vertex = vertex;
+	shader.failed = false;
+	target.shaders.push_back (shader);
+}
+
+// Loads <folder>/vertex and <folder>/fragment using the test suite naming
+// (foo-in.txt, foo-inES.txt, foo-inES3.txt), plus any *.vert / *.frag files
+// directly in <folder>, which are used for every target.
+static size_t LoadFolder (const std::string& folder)
+{
+	static const char* kTypeName[2] = { "vertex", "fragment" };
+	size_t loaded = 0;
+	for (int type = 0; type < 2; ++type)
+	{
+		const std::string typeFolder = folder + "/" + kTypeName[type];
+		const StringVector files = GetFiles (typeFolder);
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			std::string source;
+			bool haveSource = false;
+			for (int t = 0; t < kTargetCount; ++t)
+			{
+				if (!EndsWith (files[i], s_Targets[t].inputSuffix))
+					continue;
+				if (!haveSource && !ReadStringFromFile (typeFolder + "/" + files[i], source))
+				{
+					printf ("Failed to read %s/%s\n", typeFolder.c_str(), files[i].c_str());
+					break;
+				}
+				haveSource = true;
+				AddShader (s_Targets[t], std::string(kTypeName[type]) + "/" + files[i], source, type == 0);
+				++loaded;
+			}
+		}
+	}
+
+	const StringVector files = GetFiles (folder);
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		const bool vertex = EndsWith (files[i], ".vert");
+		if (!vertex && !EndsWith (files[i], ".frag"))
+			continue;
+		std::string source;
+		if (!ReadStringFromFile (folder + "/" + files[i], source))
+		{
+			printf ("Failed to read %s/%s\n", folder.c_str(), files[i].c_str());
+			continue;
+		}
+		for (int t = 0; t < kTargetCount; ++t)
+		{
+			AddShader (s_Targets[t], files[i], source, vertex);
+			++loaded;
+		}
+	}
+	return loaded;
+}
+
+// A long straight-line fragment shader computing 'values' vec4s: whole and
+// swizzled copies, partial writes, constants and small ifs, each value using
+// the previous ones. This is what makes the optimizer passes that track
+// assignments (copy & constant propagation, CSE etc.) slow if they scale
+// worse than linearly.
+static std::string MakeLongShader (int values, glslopt_target target)
+{
+	const bool es3 = target == kGlslTargetOpenGLES30 || target == kGlslTargetMetal;
+	std::string src;
+	char buf[256];
+	if (es3)
+		src += "#version 300 es\n";
+	if (target != kGlslTargetOpenGL)
+		src += "precision mediump float;\n";
+	src += "uniform vec4 u[8];\n";
+	src += es3 ? "in vec4 v;\nout vec4 fragColor;\n" : "varying vec4 v;\n";
+	src += "void main() {\n\tvec4 a0 = v;\n\tvec4 a1 = v.wzyx;\n";
+	for (int i = 2; i <= values; ++i)
+	{
+		switch (i % 4)
+		{
+		case 0: snprintf (buf, sizeof(buf), "\tvec4 a%d = a%d.wzyx;\n", i, i-1); break;
+		case 1: snprintf (buf, sizeof(buf), "\tfloat k%d = %d.5;\n\tvec4 a%d = a%d * u[%d] + k%d;\n", i, i%7, i, i-1, i%8, i); break;
+		case 2: snprintf (buf, sizeof(buf), "\tvec4 a%d = a%d;\n\ta%d.xy = a%d.yx;\n", i, i-1, i, i-2); break;
+		default: snprintf (buf, sizeof(buf), "\tvec4 a%d;\n\tif (a%d.x > 0.5) a%d = a%d * 0.5; else a%d = a%d;\n", i, i-1, i, i-1, i, i-2); break;
+		}
+		src += buf;
+	}
+	// sum up some of the values so that nothing is dead code
+	src += es3 ? "\tfragColor = a1" : "\tgl_FragColor = a1";
+	const int step = values / 16 > 1 ? values / 16 : 1;
+	for (int i = values; i > 1; i -= step)
+	{
+		snprintf (buf, sizeof(buf), " + a%d", i);
+		src += buf;
+	}
+	src += ";\n}\n";
+	return src;
+}
+
+static size_t AddLongShaders (const std::vector<int>& sizes)
+{
+	size_t added = 0;
+	for (size_t i = 0; i < sizes.size(); ++i)
+	{
+		char name[64];
+		snprintf (name, sizeof(name), "long-%d", sizes[i]);
+		for (int t = 0; t < kTargetCount; ++t)
+		{
+			AddShader (s_Targets[t], name, MakeLongShader (sizes[i], s_Targets[t].target), false);
+			++added;
+		}
+	}
+	return added;
+}
+
+
+// -------------------------------------------------------------------------
+// Running
+
+static double Percentile (const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0.0;
+	// nearest rank
+	size_t rank = size_t(ceil (p / 100.0 * sorted.size()));
+	if (rank < 1)
+		rank = 1;
+	if (rank > sorted.size())
+		rank = sorted.size();
+	return sorted[rank-1];
+}
+
+static double Mean (const std::vector<double>& v)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < v.size(); ++i)
+		sum += v[i];
+	return v.empty() ? 0.0 : sum / v.size();
+}
+
+static void RunTarget (BenchTarget& target, int iterations, int warmup, int level, bool preprocessOnly, bool outputOnly)
+{
+	unsigned options = preprocessOnly ? kGlslOptionProfile : 0;
+	if (outputOnly)
+		options |= kGlslOptionSkipRawOutput | kGlslOptionSkipReflection | kGlslOptionSkipStats;
+	glslopt_ctx* ctx = glslopt_initialize (target.target);
+	glslopt_set_optimization_level (ctx, (glslopt_optimization_level)level);
+
+	std::vector<BenchShader>& shaders = target.shaders;
+	const size_t n = shaders.size();
+
+	for (int it = 0; it < warmup; ++it)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			glslopt_shader* shader = glslopt_optimize (ctx, shaders[i].vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment, shaders[i].source.c_str(), options);
+			shaders[i].failed = !glslopt_get_status (shader);
+			glslopt_shader_delete (shader);
+		}
+	}
+
+	target.times.clear();
+	target.times.reserve (n * iterations);
+	for (size_t i = 0; i < n; ++i)
+	{
+		shaders[i].times.clear();
+		shaders[i].times.reserve (iterations);
+	}
+
+	#if BENCH_COUNT_ALLOCATIONS
+	const size_t allocCount0 = s_AllocCount, allocBytes0 = s_AllocBytes;
+	#endif
+	double preprocessMs = 0.0;
+	const double time0 = GetTimeMs();
+	for (int it = 0; it < iterations; ++it)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			const double t0 = GetTimeMs();
+			glslopt_shader* shader = glslopt_optimize (ctx, shaders[i].vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment, shaders[i].source.c_str(), options);
+			if (it == 0 && warmup == 0)
+				shaders[i].failed = !glslopt_get_status (shader);
+			if (preprocessOnly)
+			{
+				const double ms = glslopt_shader_get_phase_time (shader, kGlslPhasePreprocess);
+				glslopt_shader_delete (shader);
+				shaders[i].times.push_back (ms);
+				preprocessMs += ms;
+				continue;
+			}
+			glslopt_shader_delete (shader);
+			shaders[i].times.push_back (GetTimeMs() - t0);
+		}
+	}
+	target.totalMs = preprocessOnly ? preprocessMs : GetTimeMs() - time0;
+	target.compiles = n * iterations;
+
+	#if BENCH_COUNT_ALLOCATIONS
+	target.allocCount = long(s_AllocCount - allocCount0);
+	target.allocBytes = long(s_AllocBytes - allocBytes0);
+	#else
+	target.allocCount = -1;
+	target.allocBytes = -1;
+	#endif
+	// allocations can not be told apart per phase
+	if (preprocessOnly)
+	{
+		target.allocCount = -1;
+		target.allocBytes = -1;
+	}
+	target.peakRssKB = GetPeakRssKB();
+
+	target.failed = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (shaders[i].failed)
+			++target.failed;
+		target.times.insert (target.times.end(), shaders[i].times.begin(), shaders[i].times.end());
+		std::sort (shaders[i].times.begin(), shaders[i].times.end());
+	}
+	std::sort (target.times.begin(), target.times.end());
+
+	glslopt_cleanup (ctx);
+}
+
+
+// -------------------------------------------------------------------------
+// Reporting
+
+static void PrintReport (int iterations, bool preprocessOnly)
+{
+	printf ("\n%-6s %8s %8s %7s %10s %9s %9s %9s %9s %9s %12s %10s %11s\n",
+		"target", "shaders", "compiles", "failed", "shaders/s",
+		"mean ms", "p50 ms", "p95 ms", "p99 ms", "max ms",
+		"allocs/shdr", "KB/shdr", "peak RSS MB");
+	for (int t = 0; t < kTargetCount; ++t)
+	{
+		const BenchTarget& target = s_Targets[t];
+		if (!target.enabled || target.shaders.empty())
+			continue;
+		const double perSec = target.totalMs > 0.0 ? target.compiles * 1000.0 / target.totalMs : 0.0;
+		printf ("%-6s %8d %8d %7d %10.1f %9.3f %9.3f %9.3f %9.3f %9.3f",
+			target.name, (int)target.shaders.size(), (int)target.compiles, (int)target.failed, perSec,
+			Mean (target.times), Percentile (target.times, 50), Percentile (target.times, 95),
+			Percentile (target.times, 99), target.times.empty() ? 0.0 : target.times.back());
+		if (target.allocCount >= 0 && target.compiles)
+			printf (" %12.1f %10.1f", double(target.allocCount) / target.compiles, double(target.allocBytes) / target.compiles / 1024.0);
+		else
+			printf (" %12s %10s", "n/a", "n/a");
+		printf (" %11.1f\n", target.peakRssKB / 1024.0);
+	}
+	if (preprocessOnly)
+		printf ("\n%d timed iteration(s) per shader; latencies are the preprocess phase of each glslopt_optimize call.\n", iterations);
+	else
+		printf ("\n%d timed iteration(s) per shader; latencies are per glslopt_optimize call.\n", iterations);
+}
+
+// Per value compile times of the synthetic shaders: flat means linear scaling.
+static void PrintScaling (const std::vector<int>& sizes)
+{
+	printf ("\n%-6s %8s %9s %12s\n", "target", "values", "p50 ms", "us/value");
+	for (int t = 0; t < kTargetCount; ++t)
+	{
+		const BenchTarget& target = s_Targets[t];
+		if (!target.enabled)
+			continue;
+		for (size_t i = 0; i < sizes.size(); ++i)
+		{
+			char name[64];
+			snprintf (name, sizeof(name), "long-%d", sizes[i]);
+			for (size_t j = 0; j < target.shaders.size(); ++j)
+			{
+				const BenchShader& shader = target.shaders[j];
+				if (shader.name != name)
+					continue;
+				const double ms = Percentile (shader.times, 50);
+				printf ("%-6s %8d %9.3f %12.2f%s\n", target.name, sizes[i], ms, ms * 1000.0 / sizes[i], shader.failed ? " (failed)" : "");
+			}
+		}
+	}
+}
+
+static void WriteJsonString (FILE* file, const char* str)
+{
+	fputc ('"', file);
+	for ( ; *str; ++str)
+	{
+		const unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\')
+			fprintf (file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf (file, "\\u%04x", c);
+		else
+			fputc (c, file);
+	}
+	fputc ('"', file);
+}
+
+static bool WriteJson (const char* filename, int iterations, int warmup, int level, bool preprocessOnly, bool outputOnly)
+{
+	const bool toStdout = strcmp (filename, "-") == 0;
+	FILE* file = toStdout ? stdout : fopen (filename, "wt");
+	if (!file)
+	{
+		printf ("Failed to open %s for writing\n", filename);
+		return false;
+	}
+
+	fprintf (file, "{\n\t\"iterations\": %d,\n\t\"warmup\": %d,\n\t\"level\": %d,\n", iterations, warmup, level);
+	fprintf (file, "\t\"preprocessOnly\": %s,\n", preprocessOnly ? "true" : "false");
+	fprintf (file, "\t\"outputOnly\": %s,\n", outputOnly ? "true" : "false");
+	fprintf (file, "\t\"allocationCounts\": %s,\n", BENCH_COUNT_ALLOCATIONS ? "true" : "false");
+	fprintf (file, "\t\"targets\": [");
+	bool first = true;
+	for (int t = 0; t < kTargetCount; ++t)
+	{
+		const BenchTarget& target = s_Targets[t];
+		if (!target.enabled || target.shaders.empty())
+			continue;
+		const double perSec = target.totalMs > 0.0 ? target.compiles * 1000.0 / target.totalMs : 0.0;
+		fprintf (file, "%s\n\t\t{\n", first ? "" : ",");
+		first = false;
+		fprintf (file, "\t\t\t\"target\": \"%s\",\n", target.name);
+		fprintf (file, "\t\t\t\"shaders\": %d,\n", (int)target.shaders.size());
+		fprintf (file, "\t\t\t\"compiles\": %d,\n", (int)target.compiles);
+		fprintf (file, "\t\t\t\"failed\": %d,\n", (int)target.failed);
+		fprintf (file, "\t\t\t\"totalMs\": %.4f,\n", target.totalMs);
+		fprintf (file, "\t\t\t\"shadersPerSec\": %.2f,\n", perSec);
+		fprintf (file, "\t\t\t\"meanMs\": %.4f,\n", Mean (target.times));
+		fprintf (file, "\t\t\t\"p50Ms\": %.4f,\n", Percentile (target.times, 50));
+		fprintf (file, "\t\t\t\"p95Ms\": %.4f,\n", Percentile (target.times, 95));
+		fprintf (file, "\t\t\t\"p99Ms\": %.4f,\n", Percentile (target.times, 99));
+		fprintf (file, "\t\t\t\"maxMs\": %.4f,\n", target.times.empty() ? 0.0 : target.times.back());
+		if (target.allocCount >= 0 && target.compiles)
+		{
+			fprintf (file, "\t\t\t\"allocsPerShader\": %.2f,\n", double(target.allocCount) / target.compiles);
+			fprintf (file, "\t\t\t\"bytesPerShader\": %.0f,\n", double(target.allocBytes) / target.compiles);
+		}
+		else
+		{
+			fprintf (file, "\t\t\t\"allocsPerShader\": null,\n");
+			fprintf (file, "\t\t\t\"bytesPerShader\": null,\n");
+		}
+		fprintf (file, "\t\t\t\"peakRssKB\": %ld,\n", target.peakRssKB);
+		fprintf (file, "\t\t\t\"perShader\": [");
+		for (size_t i = 0; i < target.shaders.size(); ++i)
+		{
+			const BenchShader& shader = target.shaders[i];
+			fprintf (file, "%s\n\t\t\t\t{ \"name\": ", i ? "," : "");
+			WriteJsonString (file, shader.name.c_str());
+			fprintf (file, ", \"status\": %s, \"p50Ms\": %.4f, \"minMs\": %.4f }",
+				shader.failed ? "false" : "true", Percentile (shader.times, 50), shader.times.empty() ? 0.0 : shader.times.front());
+		}
+		fprintf (file, "\n\t\t\t]\n\t\t}");
+	}
+	fprintf (file, "\n\t]\n}\n");
+
+	if (!toStdout)
+		fclose (file);
+	return true;
+}
+
+
+static bool ParseSizes (const char* list, std::vector<int>& sizes)
+{
+	while (*list)
+	{
+		char* end;
+		const long size = strtol (list, &end, 10);
+		if (end == list || size < 2 || size > 100000 || (*end && *end != ','))
+		{
+			printf ("Bad synthetic shader size list: %s\n", list);
+			return false;
+		}
+		sizes.push_back (int(size));
+		list = *end ? end + 1 : end;
+	}
+	return true;
+}
+
+static int PrintHelp ()
+{
+	printf ("Usage: glsl_bench [options] [<testfolder> [<extra folder> ...]]\n");
+	printf ("\t-n <count> : timed iterations over the corpus per target (default 10)\n");
+	printf ("\t-w <count> : untimed warm-up iterations (default 1)\n");
+	printf ("\t-t <list> : comma separated targets to run: es2,es3,gl,metal (default all)\n");
+	printf ("\t-O0 .. -O3 : optimization level (default -O3)\n");
+	printf ("\t-p : time the preprocessor only (preprocess phase of profiled compiles)\n");
+	printf ("\t-o : optimized output only: skip raw output, reflection and stats\n");
+	printf ("\t-s <list> : also run synthetic straight-line shaders computing this many values each, e.g. 250,500,1000\n");
+	printf ("\t-j <file> : also write results as JSON to file (- for stdout)\n");
+	printf ("\n\tFolders are scanned like the test suite: vertex/*-in*.txt and fragment/*-in*.txt.\n");
+	printf ("\t*.vert and *.frag files directly inside a folder are run for every target.\n");
+	return 1;
+}
+
+static bool EnableTargets (const char* list)
+{
+	for (int t = 0; t < kTargetCount; ++t)
+		s_Targets[t].enabled = false;
+	while (*list)
+	{
+		const char* end = strchr (list, ',');
+		const size_t len = end ? size_t(end - list) : strlen (list);
+		bool found = false;
+		for (int t = 0; t < kTargetCount; ++t)
+		{
+			if (strlen (s_Targets[t].name) == len && strncmp (s_Targets[t].name, list, len) == 0)
+			{
+				s_Targets[t].enabled = true;
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			printf ("Unknown target: %.*s\n", (int)len, list);
+			return false;
+		}
+		list += len;
+		if (*list == ',')
+			++list;
+	}
+	return true;
+}
+
+int main (int argc, const char** argv)
+{
+	int iterations = 10;
+	int warmup = 1;
+	int level = kGlslOptLevel3;
+	const char* jsonFile = NULL;
+	bool preprocessOnly = false;
+	bool outputOnly = false;
+	StringVector folders;
+	std::vector<int> sizes;
+
+	for (int t = 0; t < kTargetCount; ++t)
+		s_Targets[t].enabled = true;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		if (arg[0] != '-')
+			folders.push_back (arg);
+		else if (strcmp (arg, "-n") == 0 && i + 1 < argc)
+			iterations = atoi (argv[++i]);
+		else if (strcmp (arg, "-w") == 0 && i + 1 < argc)
+			warmup = atoi (argv[++i]);
+		else if (strcmp (arg, "-t") == 0 && i + 1 < argc)
+		{
+			if (!EnableTargets (argv[++i]))
+				return 1;
+		}
+		else if (strcmp (arg, "-j") == 0 && i + 1 < argc)
+			jsonFile = argv[++i];
+		else if (strcmp (arg, "-p") == 0)
+			preprocessOnly = true;
+		else if (strcmp (arg, "-o") == 0)
+			outputOnly = true;
+		else if (strcmp (arg, "-s") == 0 && i + 1 < argc)
+		{
+			if (!ParseSizes (argv[++i], sizes))
+				return 1;
+		}
+		else if (arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3' && arg[3] == 0)
+			level = arg[2] - '0';
+		else
+			return PrintHelp ();
+	}
+	if ((folders.empty() && sizes.empty()) || iterations < 1 || warmup < 0)
+		return PrintHelp ();
+
+	// everything is read before anything is timed
+	size_t loaded = 0;
+	for (size_t i = 0; i < folders.size(); ++i)
+		loaded += LoadFolder (folders[i]);
+	if (!loaded && !folders.empty())
+	{
+		printf ("No shaders found in %s\n", folders[0].c_str());
+		return 1;
+	}
+	AddLongShaders (sizes);
+
+	// report JSON alone on stdout when asked to, so it can be piped
+	const bool quiet = jsonFile && strcmp (jsonFile, "-") == 0;
+	for (int t = 0; t < kTargetCount; ++t)
+	{
+		BenchTarget& target = s_Targets[t];
+		if (!target.enabled || target.shaders.empty())
+			continue;
+		if (!quiet)
+		{
+			printf ("** %s: %d shaders x %d iterations...\n", target.name, (int)target.shaders.size(), iterations);
+			fflush (stdout);
+		}
+		RunTarget (target, iterations, warmup, level, preprocessOnly, outputOnly);
+	}
+
+	if (!quiet)
+	{
+		PrintReport (iterations, preprocessOnly);
+		if (!sizes.empty())
+			PrintScaling (sizes);
+	}
+	if (jsonFile && !WriteJson (jsonFile, iterations, warmup, level, preprocessOnly, outputOnly))
+		return 1;
+	return 0;
+}
@@ -1,7 +1,9 @@
+#include <map>
 #include <string>
 #include <vector>
 #include <time.h>
 #include "../src/glsl/glsl_optimizer.h"
+#include "../include/c11/threads.h"
 
 #define GL_GLEXT_PROTOTYPES 1
 
@@ -472,13 +474,108 @@ static const char* kGlslPrecNames[kGlslPrecCount] = {
 };
 
 
+// Optimized output with stats and reflection info appended, as stored
+// in the expected test results.
+// output is the optimized output, if it did not stay in the shader.
+static std::string GetOptimizedText (glslopt_shader* shader, const char* output = NULL)
+{
+	std::string textOpt = output ? output : glslopt_get_output (shader);
+
+	// append stats
+	char buffer[1000];
+	int statsAlu, statsTex, statsFlow;
+	glslopt_shader_get_stats (shader, &statsAlu, &statsTex, &statsFlow);
+	sprintf(buffer, "\n// stats: %i alu %i tex %i flow\n", statsAlu, statsTex, statsFlow);
+	textOpt += buffer;
+	
+	// append inputs
+	const int inputCount = glslopt_shader_get_input_count (shader);
+	if (inputCount > 0)
+	{
+		sprintf(buffer, "// inputs: %i\n", inputCount);
+		textOpt += buffer;
+	}
+	for (int i = 0; i < inputCount; ++i)
+	{
+		const char* parName;
+		glslopt_basic_type parType;
+		glslopt_precision parPrec;
+		int parVecSize, parMatSize, parArrSize, location;
+		glslopt_shader_get_input_desc(shader, i, &parName, &parType, &parPrec, &parVecSize, &parMatSize, &parArrSize, &location);
+		if (location >= 0)
+			sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i] loc %i\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize, location);
+		else
+			sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i]\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize);
+		textOpt += buffer;
+	}
+	// append uniforms
+	const int uniformCount = glslopt_shader_get_uniform_count (shader);
+	const int uniformSize = glslopt_shader_get_uniform_total_size (shader);
+	if (uniformCount > 0)
+	{
+		sprintf(buffer, "// uniforms: %i (total size: %i)\n", uniformCount, uniformSize);
+		textOpt += buffer;
+	}
+	for (int i = 0; i < uniformCount; ++i)
+	{
+		const char* parName;
+		glslopt_basic_type parType;
+		glslopt_precision parPrec;
+		int parVecSize, parMatSize, parArrSize, location;
+		glslopt_shader_get_uniform_desc(shader, i, &parName, &parType, &parPrec, &parVecSize, &parMatSize, &parArrSize, &location);
+		if (location >= 0)
+			sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i] loc %i\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize, location);
+		else
+			sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i]\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize);
+		textOpt += buffer;
+	}
+	// append textures
+	const int textureCount = glslopt_shader_get_texture_count (shader);
+	if (textureCount > 0)
+	{
+		sprintf(buffer, "// textures: %i\n", textureCount);
+		textOpt += buffer;
+	}
+	for (int i = 0; i < textureCount; ++i)
+	{
+		const char* parName;
+		glslopt_basic_type parType;
+		glslopt_precision parPrec;
+		int parVecSize, parMatSize, parArrSize, location;
+		glslopt_shader_get_texture_desc(shader, i, &parName, &parType, &parPrec, &parVecSize, &parMatSize, &parArrSize, &location);
+		if (location >= 0)
+			sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i] loc %i\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize, location);
+		else
+			sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i]\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize);
+		textOpt += buffer;
+	}
+
+	return textOpt;
+}
+
+
+// Work item for the multi-threaded run: an already massaged input together
+// with whatever the single-threaded run produced for it.
+struct ThreadedTestItem
+{
+	int target;
+	bool vertex;
+	std::string testName;
+	std::string input;
+	std::string expected;
+};
+typedef std::vector<ThreadedTestItem> ThreadedTestItems;
+
+
 static bool TestFile (glslopt_ctx* ctx, bool vertex,
 	const std::string& testName,
 	const std::string& inputPath,
 	const std::string& outputPath,
 	bool gles,
 	bool doCheckGLSL,
-	bool doCheckMetal)
+	bool doCheckMetal,
+	int target,
+	ThreadedTestItems& threadedItems)
 {
 	std::string input;
 	if (!ReadStringFromFile (inputPath.c_str(), input))
@@ -509,76 +606,15 @@ static bool TestFile (glslopt_ctx* ctx, bool vertex,
 	if (optimizeOk)
 	{
 		std::string textHir = glslopt_get_raw_output (shader);
-		std::string textOpt = glslopt_get_output (shader);
+		std::string textOpt = GetOptimizedText (shader);
 
-		// append stats
-		char buffer[1000];
-		int statsAlu, statsTex, statsFlow;
-		glslopt_shader_get_stats (shader, &statsAlu, &statsTex, &statsFlow);
-		sprintf(buffer, "\n// stats: %i alu %i tex %i flow\n", statsAlu, statsTex, statsFlow);
-		textOpt += buffer;
-		
-		// append inputs
-		const int inputCount = glslopt_shader_get_input_count (shader);
-		if (inputCount > 0)
-		{
-			sprintf(buffer, "// inputs: %i\n", inputCount);
-			textOpt += buffer;
-		}
-		for (int i = 0; i < inputCount; ++i)
-		{
-			const char* parName;
-			glslopt_basic_type parType;
-			glslopt_precision parPrec;
-			int parVecSize, parMatSize, parArrSize, location;
-			glslopt_shader_get_input_desc(shader, i, &parName, &parType, &parPrec, &parVecSize, &parMatSize, &parArrSize, &location);
-			if (location >= 0)
-				sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i] loc %i\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize, location);
-			else
-				sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i]\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize);
-			textOpt += buffer;
-		}
-		// append uniforms
-		const int uniformCount = glslopt_shader_get_uniform_count (shader);
-		const int uniformSize = glslopt_shader_get_uniform_total_size (shader);
-		if (uniformCount > 0)
-		{
-			sprintf(buffer, "// uniforms: %i (total size: %i)\n", uniformCount, uniformSize);
-			textOpt += buffer;
-		}
-		for (int i = 0; i < uniformCount; ++i)
-		{
-			const char* parName;
-			glslopt_basic_type parType;
-			glslopt_precision parPrec;
-			int parVecSize, parMatSize, parArrSize, location;
-			glslopt_shader_get_uniform_desc(shader, i, &parName, &parType, &parPrec, &parVecSize, &parMatSize, &parArrSize, &location);
-			if (location >= 0)
-				sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i] loc %i\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize, location);
-			else
-				sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i]\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize);
-			textOpt += buffer;
-		}
-		// append textures
-		const int textureCount = glslopt_shader_get_texture_count (shader);
-		if (textureCount > 0)
-		{
-			sprintf(buffer, "// textures: %i\n", textureCount);
-			textOpt += buffer;
-		}
-		for (int i = 0; i < textureCount; ++i)
-		{
-			const char* parName;
-			glslopt_basic_type parType;
-			glslopt_precision parPrec;
-			int parVecSize, parMatSize, parArrSize, location;
-			glslopt_shader_get_texture_desc(shader, i, &parName, &parType, &parPrec, &parVecSize, &parMatSize, &parArrSize, &location);
-			if (location >= 0)
-				sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i] loc %i\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize, location);
-			else
-				sprintf(buffer, "//  #%i: %s (%s %s) %ix%i [%i]\n", i, parName, kGlslPrecNames[parPrec], kGlslTypeNames[parType], parVecSize, parMatSize, parArrSize);
-			textOpt += buffer;
-		}
+		ThreadedTestItem item;
+		item.target = target;
+		item.vertex = vertex;
+		item.testName = testName;
+		item.input = input;
+		item.expected = textHir + textOpt;
+		threadedItems.push_back (item);
 
 		std::string outputOpt;
 		ReadStringFromFile (outputPath.c_str(), outputOpt);
@@ -623,6 +659,880 @@ static bool TestFile (glslopt_ctx* ctx, bool vertex,
 }
 
 
+static const glslopt_target kThreadedTargets[] = {
+	kGlslTargetOpenGLES20,
+	kGlslTargetOpenGLES30,
+	kGlslTargetOpenGL,
+	kGlslTargetMetal,
+};
+static const int kThreadedTargetCount = sizeof(kThreadedTargets)/sizeof(kThreadedTargets[0]);
+// positions of the targets glslopt_optimize_es3_metal produces
+static const int kThreadedES3 = 1;
+static const int kThreadedMetal = 3;
+
+// Unoptimized plus optimized output, with stats and reflection, as the
+// single threaded run writes it. output is the optimized output, if it did
+// not stay in the shader.
+static std::string GetFullText (glslopt_shader* shader, const char* output = NULL)
+{
+	return glslopt_get_raw_output (shader) + GetOptimizedText (shader, output);
+}
+
+// Whether shader compiled to what the single threaded run got.
+static bool MatchesExpected (glslopt_shader* shader, const std::string& expected, const char* output = NULL)
+{
+	return glslopt_get_status (shader) && GetFullText (shader, output) == expected;
+}
+
+struct ThreadedTestState
+{
+	const ThreadedTestItems* items;
+	glslopt_ctx** sharedContexts; // when NULL, each thread makes its own
+	mtx_t lock;
+	size_t next;
+	size_t errors;
+};
+
+static int ThreadedTestWorker (void* data)
+{
+	ThreadedTestState* state = (ThreadedTestState*)data;
+
+	glslopt_ctx* ctx[kThreadedTargetCount];
+	for (int i = 0; i < kThreadedTargetCount; ++i)
+		ctx[i] = state->sharedContexts ? state->sharedContexts[i] : glslopt_initialize(kThreadedTargets[i]);
+
+	for (;;)
+	{
+		mtx_lock (&state->lock);
+		size_t index = state->next++;
+		mtx_unlock (&state->lock);
+		if (index >= state->items->size())
+			break;
+
+		const ThreadedTestItem& item = (*state->items)[index];
+		glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+		glslopt_shader* shader = glslopt_optimize (ctx[item.target], type, item.input.c_str(), 0);
+		bool ok = MatchesExpected (shader, item.expected);
+		glslopt_shader_delete (shader);
+
+		if (!ok)
+		{
+			mtx_lock (&state->lock);
+			printf ("\n  %s: threaded output does not match single threaded output\n", item.testName.c_str());
+			++state->errors;
+			mtx_unlock (&state->lock);
+		}
+	}
+
+	if (!state->sharedContexts)
+	{
+		for (int i = 0; i < kThreadedTargetCount; ++i)
+			glslopt_cleanup (ctx[i]);
+	}
+	return 0;
+}
+
+static int GetHardwareThreadCount ()
+{
+	#ifdef _MSC_VER
+	SYSTEM_INFO info;
+	GetSystemInfo (&info);
+	return (int)info.dwNumberOfProcessors;
+	#else
+	return (int)sysconf (_SC_NPROCESSORS_ONLN);
+	#endif
+}
+
+// Optimizes everything the single threaded run did again, from many threads
+// at once, and checks that results are byte for byte the same.
+static size_t RunThreadedTests (const ThreadedTestItems& items, glslopt_ctx** sharedContexts)
+{
+	// always run a few threads, even on single core machines
+	int threadCount = GetHardwareThreadCount();
+	if (threadCount < 4)
+		threadCount = 4;
+
+	printf ("\n** running %i tests on %i threads (%s contexts)...\n", (int)items.size(), threadCount, sharedContexts ? "shared" : "per-thread");
+
+	ThreadedTestState state;
+	state.items = &items;
+	state.sharedContexts = sharedContexts;
+	mtx_init (&state.lock, mtx_plain);
+	state.next = 0;
+	state.errors = 0;
+
+	std::vector<thrd_t> threads (threadCount);
+	for (int i = 0; i < threadCount; ++i)
+		thrd_create (&threads[i], ThreadedTestWorker, &state);
+	for (int i = 0; i < threadCount; ++i)
+		thrd_join (threads[i], NULL);
+
+	mtx_destroy (&state.lock);
+	return state.errors;
+}
+
+// Same as above, but through glslopt_optimize_batch, one batch per target.
+static size_t RunBatchTests (const ThreadedTestItems& items, glslopt_ctx** contexts)
+{
+	int threadCount = GetHardwareThreadCount();
+	if (threadCount < 4)
+		threadCount = 4;
+
+	printf ("\n** running %i tests in batches on %i threads...\n", (int)items.size(), threadCount);
+
+	size_t errors = 0;
+	for (int target = 0; target < kThreadedTargetCount; ++target)
+	{
+		std::vector<const ThreadedTestItem*> targetItems;
+		std::vector<glslopt_batch_item> batch;
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			if (items[i].target != target)
+				continue;
+			glslopt_batch_item item;
+			item.type = items[i].vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+			item.shaderSource = items[i].input.c_str();
+			item.options = 0;
+			batch.push_back (item);
+			targetItems.push_back (&items[i]);
+		}
+		if (batch.empty())
+			continue;
+
+		std::vector<glslopt_shader*> shaders (batch.size());
+		glslopt_optimize_batch (contexts[target], &batch[0], &shaders[0], (int)batch.size(), threadCount);
+
+		for (size_t i = 0; i < shaders.size(); ++i)
+		{
+			bool ok = MatchesExpected (shaders[i], targetItems[i]->expected);
+			if (!ok)
+			{
+				printf ("\n  %s: batch output does not match single threaded output\n", targetItems[i]->testName.c_str());
+				++errors;
+			}
+			glslopt_shader_delete (shaders[i]);
+		}
+	}
+	return errors;
+}
+
+struct OutputWriterState
+{
+	mtx_t lock;
+	std::map<glslopt_shader*, std::string> outputs;
+	int calls;
+};
+
+static void CollectOutput (void* user, glslopt_shader* shader, const char* data, size_t size)
+{
+	OutputWriterState* state = (OutputWriterState*)user;
+	mtx_lock (&state->lock);
+	state->outputs[shader] = std::string (data, size);
+	++state->calls;
+	mtx_unlock (&state->lock);
+}
+
+// Optimizes everything in batches with an output writer: it must get the
+// output of every successfully optimized shader, once per returned shader,
+// and the shaders must not keep it.
+static size_t RunOutputWriterTests (const ThreadedTestItems& items, glslopt_ctx** contexts)
+{
+	printf ("\n** running %i tests with output writer...\n", (int)items.size());
+
+	size_t errors = 0;
+	OutputWriterState state;
+	mtx_init (&state.lock, mtx_plain);
+	for (int target = 0; target < kThreadedTargetCount; ++target)
+	{
+		std::vector<const ThreadedTestItem*> targetItems;
+		std::vector<glslopt_batch_item> batch;
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			if (items[i].target != target)
+				continue;
+			glslopt_batch_item item;
+			item.type = items[i].vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+			item.shaderSource = items[i].input.c_str();
+			item.options = 0;
+			batch.push_back (item);
+			targetItems.push_back (&items[i]);
+		}
+		if (batch.empty())
+			continue;
+
+		state.outputs.clear();
+		state.calls = 0;
+		std::vector<glslopt_shader*> shaders (batch.size());
+		glslopt_set_output_writer (contexts[target], CollectOutput, &state);
+		glslopt_optimize_batch (contexts[target], &batch[0], &shaders[0], (int)batch.size(), 4);
+		// with a writer, the same source is not handed out as the same shader
+		glslopt_shader* again = glslopt_optimize (contexts[target], batch[0].type, batch[0].shaderSource, 0);
+		glslopt_set_output_writer (contexts[target], NULL, NULL);
+
+		bool ok = state.calls == (int)shaders.size() + 1 && state.outputs.size() == shaders.size() + 1;
+		ok &= again != shaders[0] && !glslopt_shader_is_shared (again) && glslopt_get_output (again) == NULL;
+		for (size_t i = 0; ok && i < shaders.size(); ++i)
+		{
+			const std::string& output = state.outputs[shaders[i]];
+			ok = glslopt_get_output (shaders[i]) == NULL && MatchesExpected (shaders[i], targetItems[i]->expected, output.c_str());
+		}
+		ok &= state.outputs[again] == state.outputs[shaders[0]];
+		if (!ok)
+		{
+			printf ("\n  output writer did not get the optimized output (target %i)\n", target);
+			++errors;
+		}
+		glslopt_shader_delete (again);
+		for (size_t i = 0; i < shaders.size(); ++i)
+			glslopt_shader_delete (shaders[i]);
+	}
+	mtx_destroy (&state.lock);
+	return errors;
+}
+
+// Optimizes everything with profiling on: output must not change, and the
+// collected pass stats must be consistent.
+static size_t RunProfileTests (const ThreadedTestItems& items, glslopt_ctx** contexts)
+{
+	printf ("\n** running %i tests with profiling...\n", (int)items.size());
+
+	size_t errors = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		const ThreadedTestItem& item = items[i];
+		glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+		glslopt_shader* shader = glslopt_optimize (contexts[item.target], type, item.input.c_str(), kGlslOptionProfile);
+		bool ok = MatchesExpected (shader, item.expected);
+
+		const int iterations = glslopt_shader_get_optimization_iterations (shader);
+		const int passCount = glslopt_shader_get_pass_count (shader);
+		int totalCalls = 0;
+		for (int j = 0; j < passCount; ++j)
+		{
+			const char* name;
+			int calls, progressCalls;
+			double timeMs;
+			glslopt_shader_get_pass_stats (shader, j, &name, &calls, &progressCalls, &timeMs);
+			if (!name || calls < 0 || progressCalls > calls || calls > 2 * iterations + 1 || timeMs < 0.0)
+				ok = false;
+			totalCalls += calls;
+		}
+		if (passCount == 0 || (iterations > 0) != (totalCalls > 0))
+			ok = false;
+		for (int j = 0; j < kGlslPhaseCount; ++j)
+		{
+			if (glslopt_shader_get_phase_time (shader, (glslopt_phase)j) < 0.0)
+				ok = false;
+		}
+
+		if (!ok)
+		{
+			printf ("\n  %s: profiled output or stats are wrong\n", item.testName.c_str());
+			++errors;
+		}
+		glslopt_shader_delete (shader);
+	}
+	return errors;
+}
+
+// Optimization levels and pipelines: lower levels must still produce working
+// shaders, and spelling out the default pipeline must give the default output.
+static size_t RunOptimizationLevelTests (const ThreadedTestItems& items)
+{
+	printf ("\n** running %i tests with optimization levels...\n", (int)items.size());
+
+	size_t errors = 0;
+	glslopt_ctx* ctx[kThreadedTargetCount];
+	for (int i = 0; i < kThreadedTargetCount; ++i)
+		ctx[i] = glslopt_initialize (kThreadedTargets[i]);
+
+	static const char* kBadPipelines[] = { "nosuchpass", "inline,,dce", "(inline,dce", "inline)", "dce**", "loop_analysis" };
+	for (size_t i = 0; i < sizeof(kBadPipelines)/sizeof(kBadPipelines[0]); ++i)
+	{
+		if (glslopt_set_optimization_pipeline (ctx[0], kBadPipelines[i]))
+		{
+			printf ("\n  pipeline '%s' should not parse\n", kBadPipelines[i]);
+			++errors;
+		}
+	}
+
+	for (int level = kGlslOptLevel0; level <= kGlslOptLevel3; ++level)
+	{
+		for (int i = 0; i < kThreadedTargetCount; ++i)
+		{
+			if (level == kGlslOptLevel3)
+			{
+				// the default pipeline, spelled out by hand
+				glslopt_set_optimization_level (ctx[i], kGlslOptLevel3);
+				std::string pipeline = glslopt_get_optimization_pipeline (ctx[i]);
+				glslopt_set_optimization_level (ctx[i], kGlslOptLevel0);
+				if (!glslopt_set_optimization_pipeline (ctx[i], (" " + pipeline + " ").c_str()))
+				{
+					printf ("\n  default pipeline does not parse\n");
+					++errors;
+				}
+			}
+			else
+				glslopt_set_optimization_level (ctx[i], (glslopt_optimization_level)level);
+		}
+
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			const ThreadedTestItem& item = items[i];
+			glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+			glslopt_shader* shader = glslopt_optimize (ctx[item.target], type, item.input.c_str(), 0);
+			bool ok = level == kGlslOptLevel3 ? MatchesExpected (shader, item.expected) : glslopt_get_status (shader);
+			if (!ok)
+			{
+				printf ("\n  %s: failed at optimization level %i\n", item.testName.c_str(), level);
+				++errors;
+			}
+			glslopt_shader_delete (shader);
+		}
+	}
+
+	for (int i = 0; i < kThreadedTargetCount; ++i)
+		glslopt_cleanup (ctx[i]);
+	return errors;
+}
+
+// Shaders compiled on one context start out from the same builtin types and
+// variables: changes one shader makes to its builtins must not show up in the
+// next one, and builtins that depend on extensions must follow the extensions.
+static size_t RunBuiltinSnapshotTests ()
+{
+	printf ("\n** running builtin snapshot tests...\n");
+
+	struct SnapshotTest {
+		glslopt_target target;
+		glslopt_shader_type type;
+		bool status;
+		const char* source;
+	};
+	static const SnapshotTest kTests[] = {
+		// first one with these builtins makes them; the rest start from copies
+		{ kGlslTargetOpenGL, kGlslOptShaderVertex, true,
+			"#version 120\nvoid main() { gl_Position = gl_Vertex; }\n" },
+		// redeclares (sizes) gl_TexCoord and makes gl_Position invariant
+		{ kGlslTargetOpenGL, kGlslOptShaderVertex, true,
+			"#version 120\nvarying vec4 gl_TexCoord[2];\ninvariant gl_Position;\nvoid main() { gl_Position = gl_Vertex; gl_TexCoord[1] = gl_Vertex; }\n" },
+		// would be out of bounds with the size above
+		{ kGlslTargetOpenGL, kGlslOptShaderVertex, true,
+			"#version 120\nvoid main() { gl_Position = gl_Vertex; gl_TexCoord[5] = gl_Vertex; }\n" },
+		{ kGlslTargetOpenGL, kGlslOptShaderVertex, false,
+			"#version 120\nvarying vec4 gl_TexCoord[2];\nvoid main() { gl_Position = gl_Vertex; gl_TexCoord[5] = gl_Vertex; }\n" },
+		// sampler2DShadow is only a type with the extension enabled
+		{ kGlslTargetOpenGLES20, kGlslOptShaderFragment, false,
+			"uniform sampler2DShadow s;\nvoid main() { gl_FragColor = vec4(0.0); }\n" },
+		{ kGlslTargetOpenGLES20, kGlslOptShaderFragment, true,
+			"#extension GL_EXT_shadow_samplers : enable\nuniform sampler2DShadow s;\nvoid main() { gl_FragColor = vec4(shadow2DEXT(s, vec3(0.0))); }\n" },
+		{ kGlslTargetOpenGLES20, kGlslOptShaderFragment, false,
+			"uniform sampler2DShadow s;\nvoid main() { gl_FragColor = vec4(0.0); }\n" },
+	};
+
+	size_t errors = 0;
+	glslopt_ctx* ctxGL = glslopt_initialize (kGlslTargetOpenGL);
+	glslopt_ctx* ctxES = glslopt_initialize (kGlslTargetOpenGLES20);
+	for (size_t i = 0; i < sizeof(kTests)/sizeof(kTests[0]); ++i)
+	{
+		const SnapshotTest& test = kTests[i];
+		glslopt_ctx* ctx = test.target == kGlslTargetOpenGL ? ctxGL : ctxES;
+		glslopt_shader* shader = glslopt_optimize (ctx, test.type, test.source, 0);
+		if (glslopt_get_status (shader) != test.status)
+		{
+			printf ("\n  builtin snapshot test %i: expected %s, got: %s\n", (int)i, test.status ? "success" : "failure", glslopt_get_log (shader));
+			++errors;
+		}
+		glslopt_shader_delete (shader);
+	}
+	glslopt_cleanup (ctxGL);
+	glslopt_cleanup (ctxES);
+	return errors;
+}
+
+// Whole-program optimization: varyings the fragment shader does not read go
+// away from the vertex shader, constant ones get folded into the fragment
+// shader, packing merges the rest, and mismatched stages fail to link.
+// Line continuations are collapsed before preprocessing, with newlines added
+// back later so that error messages still point at the right source line,
+// whatever mix of newline styles the source uses.
+static size_t RunLineContinuationTests ()
+{
+	printf ("\n** running line continuation tests...\n");
+
+	struct ContinuationTest {
+		const char* source;
+		const char* errorLocation;
+	};
+	static const ContinuationTest kTests[] = {
+		// CR LF lines, with a CR LF and an LF CR continuation
+		{ "precision mediump float;\r\nvoid main() {\r\n  float a = 1.0 + \\\r\n    2.0;\r\n  float b = 3.0 \\\n\r    * 4.0;\r\n"
+			"  gl_FragColor = vec4(a, b, 0.0, 1.0);\r\n  undefined_thing = 1.0;\r\n}\r\n", "(8,2)" },
+		// LF CR lines, with continuations of both kinds in a macro
+		{ "precision mediump float;\n\r#define SCALE(x) \\\r\n  ((x) * \\\n\r  2.0)\n\rvoid main() {\n\r"
+			"  gl_FragColor = vec4(SCALE(1.0));\n\r  undefined_thing = 1.0;\n\r}\n\r", "(7,2)" },
+		// CR lines
+		{ "precision mediump float;\rvoid main() {\r  float a = \\\r  1.0;\r  undefined_thing = a;\r}\r", "(5,2)" },
+	};
+
+	size_t errors = 0;
+	glslopt_ctx* ctx = glslopt_initialize (kGlslTargetOpenGLES20);
+	for (size_t i = 0; i < sizeof(kTests)/sizeof(kTests[0]); ++i)
+	{
+		const ContinuationTest& test = kTests[i];
+		glslopt_shader* shader = glslopt_optimize (ctx, kGlslOptShaderFragment, test.source, 0);
+		const char* log = glslopt_get_log (shader);
+		if (glslopt_get_status (shader) || !strstr (log, test.errorLocation) || !strstr (log, "undefined_thing"))
+		{
+			printf ("\n  line continuation test %i: expected an error at %s, got: %s\n", (int)i, test.errorLocation, log);
+			++errors;
+		}
+		glslopt_shader_delete (shader);
+	}
+	glslopt_cleanup (ctx);
+	return errors;
+}
+
+static size_t RunProgramTests ()
+{
+	printf ("\n** running whole-program tests...\n");
+
+	static const char* kVertex =
+		"attribute vec4 pos;\nattribute vec2 uv;\nattribute vec3 nrm;\n"
+		"varying vec2 vUV;\nvarying float vFog;\nvarying vec3 vNormal;\nvarying vec4 vColor;\n"
+		"void main() {\n"
+		"  gl_Position = pos;\n  vUV = uv * 2.0;\n  vFog = pos.z * 0.1;\n"
+		"  vNormal = normalize(nrm * 3.0);\n  vColor = vec4(1.0, 0.5, 0.25, 1.0);\n"
+		"}\n";
+	static const char* kFragment =
+		"precision mediump float;\nuniform sampler2D tex;\n"
+		"varying vec2 vUV;\nvarying float vFog;\nvarying vec3 vNormal;\nvarying vec4 vColor;\n"
+		"void main() { gl_FragColor = texture2D(tex, vUV) * vColor + vec4(vFog); }\n";
+	static const char* kFragmentMismatch =
+		"precision mediump float;\nvarying vec3 vUV;\n"
+		"void main() { gl_FragColor = vec4(vUV, 1.0); }\n";
+
+	struct ProgramTest {
+		const char* fragment;
+		unsigned options;
+		bool status;
+		int fragmentInputs;
+		const char* present; // in both outputs
+		const char* absent; // in neither output
+	};
+	static const ProgramTest kTests[] = {
+		{ kFragment, 0, true, 2, "vFog", "vNormal" },
+		{ kFragment, 0, true, 2, "vUV", "vColor" },
+		{ kFragment, kGlslOptionPackVaryings, true, 1, "xlv_pack0", "vUV" },
+		{ kFragmentMismatch, 0, false, 0, NULL, NULL },
+	};
+
+	size_t errors = 0;
+	glslopt_ctx* ctx = glslopt_initialize (kGlslTargetOpenGLES20);
+	for (size_t i = 0; i < sizeof(kTests)/sizeof(kTests[0]); ++i)
+	{
+		const ProgramTest& test = kTests[i];
+		glslopt_shader* vs;
+		glslopt_shader* fs;
+		bool status = glslopt_optimize_program (ctx, kVertex, test.fragment, test.options, &vs, &fs);
+		bool ok = status == test.status && glslopt_get_status (vs) == test.status && glslopt_get_status (fs) == test.status;
+		if (ok && status)
+		{
+			const std::string vsText = glslopt_get_output (vs);
+			const std::string fsText = glslopt_get_output (fs);
+			ok &= glslopt_shader_get_input_count (fs) == test.fragmentInputs;
+			ok &= vsText.find (test.present) != std::string::npos && fsText.find (test.present) != std::string::npos;
+			ok &= vsText.find (test.absent) == std::string::npos && fsText.find (test.absent) == std::string::npos;
+		}
+		if (!ok)
+		{
+			printf ("\n  whole-program test %i failed:\n%s\n%s\n%s\n%s\n", (int)i,
+				glslopt_get_log (vs), glslopt_get_log (fs),
+				status ? glslopt_get_output (vs) : "", status ? glslopt_get_output (fs) : "");
+			++errors;
+		}
+		glslopt_shader_delete (vs);
+		glslopt_shader_delete (fs);
+	}
+	glslopt_cleanup (ctx);
+	return errors;
+}
+
+// Optimizes the ES3 and Metal shaders for both targets at once: both
+// results must match what optimizing them separately gives.
+static size_t RunES3MetalTests (const ThreadedTestItems& items, glslopt_ctx** contexts)
+{
+	printf ("\n** running ES3 + Metal tests...\n");
+
+	size_t errors = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		const ThreadedTestItem& item = items[i];
+		if (item.target != kThreadedES3 && item.target != kThreadedMetal)
+			continue;
+		const int other = item.target == kThreadedES3 ? kThreadedMetal : kThreadedES3;
+		glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+		glslopt_shader* shaders[kThreadedTargetCount] = {};
+		glslopt_optimize_es3_metal (contexts[item.target], type, item.input.c_str(), 0, &shaders[kThreadedES3], &shaders[kThreadedMetal]);
+		glslopt_shader* reference = glslopt_optimize (contexts[other], type, item.input.c_str(), 0);
+
+		bool ok = MatchesExpected (shaders[item.target], item.expected) && glslopt_get_status (shaders[other]) == glslopt_get_status (reference);
+		if (ok)
+			ok = std::string (glslopt_get_log (shaders[other])) == glslopt_get_log (reference);
+		if (ok && glslopt_get_status (reference))
+			ok = MatchesExpected (shaders[other], GetFullText (reference));
+		if (!ok)
+		{
+			printf ("\n  %s: ES3 + Metal output does not match separate outputs\n", item.testName.c_str());
+			++errors;
+		}
+		glslopt_shader_delete (shaders[kThreadedES3]);
+		glslopt_shader_delete (shaders[kThreadedMetal]);
+		glslopt_shader_delete (reference);
+	}
+
+	// needs an ES3 or Metal context
+	glslopt_shader* es3;
+	glslopt_shader* metal;
+	glslopt_optimize_es3_metal (contexts[0], kGlslOptShaderFragment, "void main() { gl_FragColor = vec4(1.0); }\n", 0, &es3, &metal);
+	if (glslopt_get_status (es3) || glslopt_get_status (metal))
+	{
+		printf ("\n  ES3 + Metal in an ES2 context did not fail\n");
+		++errors;
+	}
+	glslopt_shader_delete (es3);
+	glslopt_shader_delete (metal);
+	return errors;
+}
+
+// Optimizes everything without raw output, reflection and stats: the
+// optimized output must stay the same, and the rest must be left empty.
+static size_t RunOutputOnlyTests (const ThreadedTestItems& items, glslopt_ctx** contexts)
+{
+	printf ("\n** running %i tests with optimized output only...\n", (int)items.size());
+
+	const unsigned kOutputOnly = kGlslOptionSkipRawOutput | kGlslOptionSkipReflection | kGlslOptionSkipStats;
+	size_t errors = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		const ThreadedTestItem& item = items[i];
+		glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+		glslopt_shader* full = glslopt_optimize (contexts[item.target], type, item.input.c_str(), 0);
+		glslopt_shader* shaders[2] = { glslopt_optimize (contexts[item.target], type, item.input.c_str(), kOutputOnly), NULL };
+		// and as part of ES3 and Metal at once
+		if (item.target == kThreadedES3 || item.target == kThreadedMetal)
+		{
+			glslopt_shader* es3;
+			glslopt_shader* metal;
+			glslopt_optimize_es3_metal (contexts[item.target], type, item.input.c_str(), kOutputOnly, &es3, &metal);
+			shaders[1] = item.target == kThreadedES3 ? es3 : metal;
+			glslopt_shader_delete (item.target == kThreadedES3 ? metal : es3);
+		}
+
+		bool ok = true;
+		for (int j = 0; j < 2 && shaders[j]; ++j)
+		{
+			glslopt_shader* shader = shaders[j];
+			int alu, tex, flow;
+			glslopt_shader_get_stats (shader, &alu, &tex, &flow);
+			ok &= glslopt_get_status (shader) && std::string (glslopt_get_output (shader)) == glslopt_get_output (full);
+			ok &= glslopt_get_raw_output (shader) == NULL && alu == 0 && tex == 0 && flow == 0;
+			ok &= glslopt_shader_get_input_count (shader) == 0 && glslopt_shader_get_uniform_count (shader) == 0 && glslopt_shader_get_texture_count (shader) == 0;
+		}
+		if (!ok)
+		{
+			printf ("\n  %s: optimized output only does not match\n", item.testName.c_str());
+			++errors;
+		}
+		glslopt_shader_delete (full);
+		for (int j = 0; j < 2 && shaders[j]; ++j)
+			glslopt_shader_delete (shaders[j]);
+	}
+
+	// Metal output color locations come from the unoptimized shader, where
+	// the first output is still there
+	static const char* kOutputs = "#version 300 es\nout mediump vec4 unused;\nout mediump vec4 col;\nvoid main() { col = vec4(1.0); }\n";
+	glslopt_shader* metal = glslopt_optimize (contexts[kThreadedMetal], kGlslOptShaderFragment, kOutputs, kOutputOnly);
+	glslopt_shader* es3;
+	glslopt_shader* metal2;
+	glslopt_optimize_es3_metal (contexts[kThreadedMetal], kGlslOptShaderFragment, kOutputs, kOutputOnly, &es3, &metal2);
+	if (!glslopt_get_status (metal) || !strstr (glslopt_get_output (metal), "col [[color(1)]]") ||
+		!glslopt_get_status (metal2) || strcmp (glslopt_get_output (metal), glslopt_get_output (metal2)) != 0)
+	{
+		printf ("\n  optimized output only: wrong Metal output locations\n");
+		++errors;
+	}
+	glslopt_shader_delete (metal);
+	glslopt_shader_delete (es3);
+	glslopt_shader_delete (metal2);
+	return errors;
+}
+
+typedef void (*ShaderVarDescFunc) (glslopt_shader*, int, const char**, glslopt_basic_type*, glslopt_precision*, int*, int*, int*, int*);
+
+static bool ShaderVarsMatch (glslopt_shader* shader, const glslopt_shader_var* vars, int count, int expectedCount, ShaderVarDescFunc getDesc)
+{
+	if (count != expectedCount || (count == 0) != (vars == NULL))
+		return false;
+	for (int i = 0; i < count; ++i)
+	{
+		const char* name;
+		glslopt_basic_type type;
+		glslopt_precision prec;
+		int vecSize, matSize, arrSize, location;
+		getDesc (shader, i, &name, &type, &prec, &vecSize, &matSize, &arrSize, &location);
+		const glslopt_shader_var& v = vars[i];
+		if (v.name != name || v.type != type || v.prec != prec || v.vectorSize != vecSize || v.matrixSize != matSize || v.arraySize != arrSize || v.location != location)
+			return false;
+	}
+	return true;
+}
+
+// Checks the reflection arrays against the per index functions, and that
+// shaders with more variables than fit in the old fixed size lists keep
+// them all.
+static size_t RunReflectionTests (const ThreadedTestItems& items, glslopt_ctx** contexts)
+{
+	printf ("\n** running %i tests of reflection arrays...\n", (int)items.size());
+
+	size_t errors = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		const ThreadedTestItem& item = items[i];
+		glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+		glslopt_shader* shader = glslopt_optimize (contexts[item.target], type, item.input.c_str(), 0);
+		int inputCount, uniformCount, textureCount;
+		const glslopt_shader_var* inputs = glslopt_shader_get_inputs (shader, &inputCount);
+		const glslopt_shader_var* uniforms = glslopt_shader_get_uniforms (shader, &uniformCount);
+		const glslopt_shader_var* textures = glslopt_shader_get_textures (shader, &textureCount);
+		if (!ShaderVarsMatch (shader, inputs, inputCount, glslopt_shader_get_input_count (shader), glslopt_shader_get_input_desc) ||
+			!ShaderVarsMatch (shader, uniforms, uniformCount, glslopt_shader_get_uniform_count (shader), glslopt_shader_get_uniform_desc) ||
+			!ShaderVarsMatch (shader, textures, textureCount, glslopt_shader_get_texture_count (shader), glslopt_shader_get_texture_desc))
+		{
+			printf ("\n  %s: reflection arrays do not match\n", item.testName.c_str());
+			++errors;
+		}
+		glslopt_shader_delete (shader);
+	}
+
+	const int kInputs = 200, kUniforms = 1100, kTextures = 150;
+	std::string source;
+	char buffer[100];
+	for (int i = 0; i < kInputs; ++i)
+	{
+		sprintf (buffer, "varying float i%i;\n", i);
+		source += buffer;
+	}
+	for (int i = 0; i < kUniforms; ++i)
+	{
+		sprintf (buffer, "uniform float u%i;\n", i);
+		source += buffer;
+	}
+	for (int i = 0; i < kTextures; ++i)
+	{
+		sprintf (buffer, "uniform sampler2D t%i;\n", i);
+		source += buffer;
+	}
+	source += "void main() {\n float r = 0.0;\n";
+	for (int i = 0; i < kInputs; ++i)
+	{
+		sprintf (buffer, " r += i%i;\n", i);
+		source += buffer;
+	}
+	for (int i = 0; i < kUniforms; ++i)
+	{
+		sprintf (buffer, " r += u%i;\n", i);
+		source += buffer;
+	}
+	for (int i = 0; i < kTextures; ++i)
+	{
+		sprintf (buffer, " r += texture2D(t%i, vec2(r)).x;\n", i);
+		source += buffer;
+	}
+	source += " gl_FragColor = vec4(r);\n}\n";
+
+	glslopt_shader* shader = glslopt_optimize (contexts[0], kGlslOptShaderFragment, source.c_str(), 0);
+	int inputCount, uniformCount, textureCount;
+	const glslopt_shader_var* inputs = glslopt_shader_get_inputs (shader, &inputCount);
+	const glslopt_shader_var* uniforms = glslopt_shader_get_uniforms (shader, &uniformCount);
+	const glslopt_shader_var* textures = glslopt_shader_get_textures (shader, &textureCount);
+	if (!glslopt_get_status (shader) || inputCount != kInputs || uniformCount != kUniforms || textureCount != kTextures ||
+		strcmp (inputs[kInputs-1].name, "i199") != 0 || strcmp (uniforms[kUniforms-1].name, "u1099") != 0 || strcmp (textures[kTextures-1].name, "t149") != 0)
+	{
+		printf ("\n  reflection of a large shader: got %i inputs, %i uniforms, %i textures\n%s\n", inputCount, uniformCount, textureCount, glslopt_get_log (shader));
+		++errors;
+	}
+	glslopt_shader_delete (shader);
+	return errors;
+}
+
+// Optimizes everything as define variants: defines the shaders never use
+// must not change anything. Then checks that defines do apply, and that
+// compiles of the same preprocessed source share their results.
+static size_t RunVariantTests (const ThreadedTestItems& items, glslopt_ctx** contexts)
+{
+	printf ("\n** running %i tests as define variants...\n", (int)items.size());
+
+	static const char* kUnused[] = { "XLV_UNUSED_VARIANT", "XLV_UNUSED_VALUE=1.0" };
+	const glslopt_variant kUnusedVariants[] = { { NULL, 0 }, { kUnused, 1 }, { kUnused, 2 } };
+	const int kUnusedCount = sizeof(kUnusedVariants)/sizeof(kUnusedVariants[0]);
+
+	size_t errors = 0;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		const ThreadedTestItem& item = items[i];
+		glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+		glslopt_shader* shaders[kUnusedCount];
+		glslopt_optimize_variants (contexts[item.target], type, item.input.c_str(), 0, kUnusedVariants, shaders, kUnusedCount);
+		for (int j = 0; j < kUnusedCount; ++j)
+		{
+			bool ok = MatchesExpected (shaders[j], item.expected);
+			if (!ok)
+			{
+				printf ("\n  %s: variant %i output does not match single shader output\n", item.testName.c_str(), j);
+				++errors;
+			}
+			glslopt_shader_delete (shaders[j]);
+		}
+	}
+
+	static const char* kSource =
+		"precision mediump float;\nuniform vec4 col;\n"
+		"void main() {\n"
+		"#ifdef FOG\n  gl_FragColor = col * SCALE;\n#else\n  gl_FragColor = col;\n#endif\n"
+		"}\n";
+	static const char* kFog[] = { "FOG", "SCALE=(K * 2.0)", "K=0.25" };
+	static const char* kFogUnused[] = { "FOG", "UNUSED", "SCALE=(K * 2.0)", "K=0.25" };
+	static const char* kUnusedOnly[] = { "UNUSED=1" };
+	static const char* kInvalid[] = { "FOG", "2BAD" };
+	static const char* kLineBreak[] = { "FOG", "K=0.25\nSCALE=(K * 2.0)" };
+	const glslopt_variant kVariants[] = {
+		{ NULL, 0 },
+		{ kFog, 3 },
+		{ kFogUnused, 4 },
+		{ kUnusedOnly, 1 },
+		{ kInvalid, 2 },
+		{ kLineBreak, 2 },
+	};
+	const int kInvalidCount = 2;
+	const int kVariantCount = sizeof(kVariants)/sizeof(kVariants[0]);
+
+	glslopt_ctx* ctx = glslopt_initialize (kGlslTargetOpenGLES20);
+	glslopt_shader* shaders[kVariantCount];
+	glslopt_optimize_variants (ctx, kGlslOptShaderFragment, kSource, 0, kVariants, shaders, kVariantCount);
+	std::string withDefines = std::string("#define FOG\n#define SCALE (K * 2.0)\n#define K 0.25\n") + kSource;
+	glslopt_shader* reference = glslopt_optimize (ctx, kGlslOptShaderFragment, withDefines.c_str(), 0);
+
+	bool ok = glslopt_get_status (reference);
+	for (int i = 0; i < kVariantCount; ++i)
+		ok &= glslopt_get_status (shaders[i]) == (i < kVariantCount - kInvalidCount);
+	if (ok)
+	{
+		const std::string plain = glslopt_get_output (shaders[0]);
+		const std::string fog = glslopt_get_output (shaders[1]);
+		ok &= fog == glslopt_get_output (reference);
+		ok &= fog == glslopt_get_output (shaders[2]);
+		ok &= plain == glslopt_get_output (shaders[3]);
+		ok &= plain != fog && fog.find ("0.5") != std::string::npos;
+
+		// the same preprocessed source shares one result, as long as one is alive
+		ok &= shaders[0] == shaders[3] && shaders[1] == shaders[2];
+		ok &= glslopt_shader_is_shared (shaders[1]) && !glslopt_shader_is_shared (reference);
+		glslopt_shader* again = glslopt_optimize (ctx, kGlslOptShaderFragment, withDefines.c_str(), 0);
+		glslopt_shader* profiled = glslopt_optimize (ctx, kGlslOptShaderFragment, withDefines.c_str(), kGlslOptionProfile);
+		ok &= again == reference && glslopt_shader_is_shared (reference);
+		ok &= profiled != reference && !glslopt_shader_is_shared (profiled);
+		glslopt_shader_delete (again);
+		glslopt_shader_delete (profiled);
+
+		// same preprocessed source, but only one has preprocessor warnings
+		const std::string blank = std::string ("\n\n\n") + kSource;
+		const std::string warned = std::string ("#if 1\n#elif\n#endif\n") + kSource;
+		glslopt_shader* quiet = glslopt_optimize (ctx, kGlslOptShaderFragment, blank.c_str(), 0);
+		glslopt_shader* noisy = glslopt_optimize (ctx, kGlslOptShaderFragment, warned.c_str(), 0);
+		ok &= glslopt_get_status (quiet) && glslopt_get_status (noisy) && quiet != noisy;
+		ok &= !strcmp (glslopt_get_output (quiet), glslopt_get_output (noisy));
+		ok &= !*glslopt_get_log (quiet) && strstr (glslopt_get_log (noisy), "#elif") != NULL;
+		glslopt_shader_delete (quiet);
+		glslopt_shader_delete (noisy);
+	}
+	if (!ok)
+	{
+		printf ("\n  define variant tests failed:\n");
+		for (int i = 0; i < kVariantCount; ++i)
+			printf ("%s\n%s\n", glslopt_get_log (shaders[i]), glslopt_get_status (shaders[i]) ? glslopt_get_output (shaders[i]) : "");
+		++errors;
+	}
+	for (int i = 0; i < kVariantCount; ++i)
+		glslopt_shader_delete (shaders[i]);
+	glslopt_shader_delete (reference);
+	glslopt_cleanup (ctx);
+	return errors;
+}
+
+// Optimizes everything twice with a result cache: the second time around
+// everything must come from the cache, and still match.
+static size_t RunCacheTests (const ThreadedTestItems& items, const std::string& cacheDir)
+{
+	printf ("\n** running %i tests with result cache...\n", (int)items.size());
+
+	StringVector oldFiles = GetFiles (cacheDir, ".glslopt");
+	for (size_t i = 0; i < oldFiles.size(); ++i)
+		DeleteFile (cacheDir + "/" + oldFiles[i]);
+
+	size_t errors = 0;
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		glslopt_ctx* ctx[kThreadedTargetCount];
+		for (int i = 0; i < kThreadedTargetCount; ++i)
+		{
+			ctx[i] = glslopt_initialize (kThreadedTargets[i]);
+			glslopt_set_cache_dir (ctx[i], cacheDir.c_str());
+		}
+
+		for (size_t i = 0; i < items.size(); ++i)
+		{
+			const ThreadedTestItem& item = items[i];
+			glslopt_shader_type type = item.vertex ? kGlslOptShaderVertex : kGlslOptShaderFragment;
+			glslopt_shader* shader = glslopt_optimize (ctx[item.target], type, item.input.c_str(), 0);
+			bool ok = MatchesExpected (shader, item.expected);
+			if (!ok)
+			{
+				printf ("\n  %s: cached output does not match (pass %i)\n", item.testName.c_str(), pass);
+				++errors;
+			}
+			glslopt_shader_delete (shader);
+		}
+
+		int totalHits = 0, totalMisses = 0;
+		for (int i = 0; i < kThreadedTargetCount; ++i)
+		{
+			int hits, misses;
+			glslopt_get_cache_stats (ctx[i], &hits, &misses);
+			totalHits += hits;
+			totalMisses += misses;
+			glslopt_cleanup (ctx[i]);
+		}
+		if (totalHits + totalMisses != (int)items.size() || (pass == 1 && totalHits != (int)items.size()))
+		{
+			printf ("\n  unexpected cache stats on pass %i: %i hits %i misses\n", pass, totalHits, totalMisses);
+			++errors;
+		}
+	}
+
+	StringVector files = GetFiles (cacheDir, ".glslopt");
+	for (size_t i = 0; i < files.size(); ++i)
+		DeleteFile (cacheDir + "/" + files[i]);
+	#ifdef _MSC_VER
+	RemoveDirectoryA (cacheDir.c_str());
+	#else
+	rmdir (cacheDir.c_str());
+	#endif
+
+	return errors;
+}
+
+
 int main (int argc, const char** argv)
 {
 	if (argc < 2)
@@ -650,6 +1560,7 @@ int main (int argc, const char** argv)
 	static const char* kTypeName[2] = { "vertex", "fragment" };
 	size_t tests = 0;
 	size_t errors = 0;
+	ThreadedTestItems threadedItems;
 	for (int type = 0; type < 2; ++type)
 	{
 		std::string testFolder = baseFolder + "/" + kTypeName[type];
@@ -672,14 +1583,14 @@ int main (int argc, const char** argv)
 				std::string outname = inname.substr (0,inname.size()-strlen(kApiIn[api])) + kApiOut[api];
 				std::string outnameMetal = inname.substr (0,inname.size()-strlen(kApiIn[api])) + kApiOutMetal[api];
 				const bool useMetal = (api == 1);
-				bool ok = TestFile (ctx[api], type==0, inname, testFolder + "/" + inname, testFolder + "/" + outname, api<=1, hasOpenGL, false);
+				bool ok = TestFile (ctx[api], type==0, inname, testFolder + "/" + inname, testFolder + "/" + outname, api<=1, hasOpenGL, false, api, threadedItems);
 				if (!ok)
 				{
 					++errors;
 				}
 				if (useMetal)
 				{
-					ok = TestFile (ctxMetal, type==0, inname, testFolder + "/" + inname, testFolder + "/" + outnameMetal, api==0, false, hasMetal);
+					ok = TestFile (ctxMetal, type==0, inname, testFolder + "/" + inname, testFolder + "/" + outnameMetal, api==0, false, hasMetal, 3, threadedItems);
 					if (!ok)
 					{
 						++errors;
@@ -692,6 +1603,24 @@ int main (int argc, const char** argv)
 	clock_t time1 = clock();
 	float timeDelta = float(time1-time0)/CLOCKS_PER_SEC;
 
+	// same shaders again, concurrently: one context per thread, and one
+	// context shared by all threads
+	errors += RunThreadedTests (threadedItems, NULL);
+	glslopt_ctx* sharedContexts[kThreadedTargetCount] = { ctx[0], ctx[1], ctx[2], ctxMetal };
+	errors += RunThreadedTests (threadedItems, sharedContexts);
+	errors += RunBatchTests (threadedItems, sharedContexts);
+	errors += RunOutputWriterTests (threadedItems, sharedContexts);
+	errors += RunProfileTests (threadedItems, sharedContexts);
+	errors += RunOptimizationLevelTests (threadedItems);
+	errors += RunBuiltinSnapshotTests ();
+	errors += RunLineContinuationTests ();
+	errors += RunProgramTests ();
+	errors += RunVariantTests (threadedItems, sharedContexts);
+	errors += RunES3MetalTests (threadedItems, sharedContexts);
+	errors += RunOutputOnlyTests (threadedItems, sharedContexts);
+	errors += RunReflectionTests (threadedItems, sharedContexts);
+	errors += RunCacheTests (threadedItems, baseFolder + "/cache-temp");
+
 	if (errors != 0)
 		printf ("\n**** %i tests (%.2fsec), %i !!!FAILED!!!\n", (int)tests, timeDelta, (int)errors);
 	else
@@ -700,7 +1629,7 @@ int main (int argc, const char** argv)
 	// 3.25s
 	// with builtin call linking, 3.84s
 
-	for (int i = 0; i < 2; ++i)
+	for (int i = 0; i < 3; ++i)
 		glslopt_cleanup (ctx[i]);
 	glslopt_cleanup (ctxMetal);
 	CleanupGL();